@@ -0,0 +1,55 @@
+# Throughput of the heuristic and the Prism engines over the methods of a part
+# of the standard library, starting each run with an empty file cache. Lookups one
+# method at a time parse each file once with Prism, against a scan and trial
+# parses per method with the heuristic.
+require 'benchmark'
+require_relative '../lib/fast_method_source'
+
+# A sample of the standard library. Requiring all of it loads objspace/trace,
+# which traces every allocation and slows the Prism engine down to a crawl.
+LIBRARIES = %w[
+  set json optparse prism net/http uri fileutils erb ripper logger tempfile
+  pathname ostruct open3 securerandom time yaml rdoc rubygems
+]
+
+$VERBOSE = nil
+LIBRARIES.each do |library|
+  begin
+    require library
+  rescue LoadError
+  end
+end
+
+methods = ObjectSpace.each_object(Module).flat_map do |mod|
+  mod.instance_methods(false).map { |name| mod.instance_method(name) } rescue []
+end
+methods.select! { |method| method.source_location && File.file?(method.source_location[0]) }
+
+def cold_start
+  max_mapped_files = FastMethodSource.max_mapped_files
+  FastMethodSource.max_mapped_files = 0
+  FastMethodSource.max_mapped_files = max_mapped_files
+  FastMethodSource.clear_cache
+end
+
+files = methods.map { |method| method.source_location[0] }.uniq
+puts "Methods: #{methods.size} in #{files.size} files"
+
+# Room for every file, so that neither engine reads a file twice.
+FastMethodSource.max_mapped_files = files.size
+
+Benchmark.bm(28) do |bm|
+  [:heuristic, :prism].each do |engine|
+    FastMethodSource.engine = engine
+
+    cold_start
+    bm.report("#{engine} source_for") do
+      methods.each { |method| FastMethodSource.source_for(method) rescue nil }
+    end
+
+    cold_start
+    bm.report("#{engine} sources_for") do
+      FastMethodSource.sources_for(methods)
+    end
+  end
+end
@@ -0,0 +1,61 @@
+# Lookups of the methods of a part of the standard library, and how many of
+# them took the end of the method straight from its iseq (the fast path)
+# instead of scanning and parsing for it (the fallback).
+require 'benchmark'
+require_relative '../lib/fast_method_source'
+
+LIBRARIES = %w[
+  set json optparse prism net/http uri fileutils erb ripper logger tempfile
+  pathname ostruct open3 securerandom time yaml rdoc rubygems
+]
+
+$VERBOSE = nil
+LIBRARIES.each do |library|
+  begin
+    require library
+  rescue LoadError
+  end
+end
+
+methods = ObjectSpace.each_object(Module).flat_map do |mod|
+  mod.instance_methods(false).map { |name| mod.instance_method(name) } rescue []
+end
+methods.select! { |method| method.source_location && File.file?(method.source_location[0]) }
+procs = ObjectSpace.each_object(Proc).select do |proc|
+  proc.source_location && File.file?(proc.source_location[0])
+end
+
+def fast_path_split
+  before = FastMethodSource.stats
+  yield
+  after = FastMethodSource.stats
+  hits = after[:fast_path_hits] - before[:fast_path_hits]
+  fallbacks = after[:fast_path_fallbacks] - before[:fast_path_fallbacks]
+
+  format('%d fast path, %d fallback (%.1f%% fast)', hits, fallbacks,
+         100.0 * hits / [hits + fallbacks, 1].max)
+end
+
+puts "Methods: #{methods.size}, procs: #{procs.size}"
+
+splits = {}
+Benchmark.bm(22) do |bm|
+  bm.report('source_for') do
+    splits['source_for'] = fast_path_split do
+      methods.each { |method| FastMethodSource.source_for(method) rescue nil }
+    end
+  end
+
+  bm.report('sources_for') do
+    splits['sources_for'] = fast_path_split { FastMethodSource.sources_for(methods) }
+  end
+
+  # Blocks are where the fallback has to parse to find the end.
+  bm.report('source_for (procs)') do
+    splits['source_for (procs)'] = fast_path_split do
+      procs.each { |proc| FastMethodSource.source_for(proc) rescue nil }
+    end
+  end
+end
+
+splits.each { |name, split| puts format('%-22s %s', name, split) }
@@ -0,0 +1,52 @@
+# Cold lookups into files of different sizes, reading each file into the heap,
+# mapping it, or mapping it and reading it ahead. Every lookup is of the last
+# method in the file, so the whole file gets indexed. Files stay in the page
+# cache, as they do right after Ruby has loaded them.
+#
+# Usage: ruby benchmarks/io.rb [max file size in KiB]
+require 'benchmark'
+require 'tmpdir'
+require_relative '../lib/fast_method_source'
+
+SIZES = [1, 4, 16, 64, 256, 1024, 4096, 16384].select { |kib| kib <= Integer(ARGV[0] || 16384) }
+LINE = "  def one_liner_%07d; :one_liner; end\n"
+
+STRATEGIES = {
+  'read' => [Float::INFINITY, Float::INFINITY],
+  'mmap' => [0, Float::INFINITY],
+  'mmap + readahead' => [0, 0]
+}
+
+def method_in(dir, kib)
+  lines = kib * 1024 / (LINE % 0).bytesize
+  path = File.join(dir, "io_#{kib}.rb")
+  File.open(path, 'w') do |file|
+    file.puts "class Io#{kib}"
+    lines.times { |i| file.write(LINE % i) }
+    file.puts 'end'
+  end
+  load path
+
+  Object.const_get("Io#{kib}").instance_method(format('one_liner_%07d', lines - 1))
+end
+
+FastMethodSource.max_mapped_files = 0
+
+Dir.mktmpdir do |dir|
+  puts format('%-8s %s', 'size', STRATEGIES.keys.map { |name| format('%18s', name) }.join)
+
+  SIZES.each do |kib|
+    method = method_in(dir, kib)
+    rounds = [2048 / kib, 5].max
+
+    times = STRATEGIES.values.map do |map_threshold, readahead_threshold|
+      FastMethodSource.map_threshold = map_threshold.infinite? ? 1 << 40 : map_threshold
+      FastMethodSource.readahead_threshold = readahead_threshold.infinite? ? 1 << 40 : readahead_threshold
+      FastMethodSource.source_for(method)
+
+      Benchmark.realtime { rounds.times { FastMethodSource.source_for(method) } } / rounds
+    end
+
+    puts format('%-8s %s', "#{kib} KiB", times.map { |time| format('%15.1f us', time * 1e6) }.join)
+  end
+end
@@ -0,0 +1,33 @@
+# Lookups of a tiny method at the top of a 50K-line file. The time per lookup
+# should not depend on the size of the file.
+require 'benchmark'
+require 'tempfile'
+require_relative '../lib/fast_method_source'
+
+LINES = 50_000
+ITERATIONS = 20_000
+
+file = Tempfile.new(['fms_large_file', '.rb'])
+file.write("# Tiny method\ndef fms_tiny_method\n  :tiny\nend\n\n")
+file.write("FMS_LARGE_FILE_PADDING = [\n")
+LINES.times { |i| file.write("  #{i},\n") }
+file.write("]\n")
+file.flush
+load file.path
+
+method = method(:fms_tiny_method)
+
+puts "Lines: #{LINES}"
+puts "Lookups: #{ITERATIONS}"
+
+Benchmark.bm(26) do |bm|
+  bm.report('FastMethodSource#source') do
+    ITERATIONS.times { FastMethodSource.source_for(method) }
+  end
+
+  bm.report('FastMethodSource#comment') do
+    ITERATIONS.times { FastMethodSource.comment_for(method) }
+  end
+end
+
+file.close!
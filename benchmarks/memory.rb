@@ -0,0 +1,39 @@
+# Memory cost of looking up every method of the standard library: RSS, minor
+# page faults and privately dirtied memory, before and after. Linux only.
+require 'rbconfig'
+require_relative '../lib/fast_method_source'
+
+def proc_stats
+  stat = File.read('/proc/self/stat').split(') ').last.split
+  rollup = File.read('/proc/self/smaps_rollup')
+  {
+    rss_kb: rollup[/^Rss:\s+(\d+)/, 1].to_i,
+    private_dirty_kb: rollup[/^Private_Dirty:\s+(\d+)/, 1].to_i,
+    minor_faults: stat[7].to_i
+  }
+end
+
+abort 'This benchmark needs /proc (Linux).' unless File.exist?('/proc/self/smaps_rollup')
+
+$VERBOSE = nil
+Dir[File.join(RbConfig::CONFIG['rubylibdir'], '**/*.rb')].sort.each do |path|
+  begin
+    require path
+  rescue Exception
+  end
+end
+
+methods = ObjectSpace.each_object(Module).flat_map do |mod|
+  mod.instance_methods(false).map { |name| mod.instance_method(name) } rescue []
+end
+methods.select! { |method| method.source_location && File.file?(method.source_location[0]) }
+
+GC.start
+before = proc_stats
+results = methods.map { |method| FastMethodSource.comment_and_source_for(method) rescue nil }
+after = proc_stats
+
+puts "Methods: #{methods.size} (#{results.compact.size} found)"
+before.each_key do |key|
+  puts format('%-18s %10d -> %10d (%+d)', key, before[key], after[key], after[key] - before[key])
+end
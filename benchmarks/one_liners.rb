@@ -0,0 +1,37 @@
+# Repeated lookups of one-liner methods and blocks, where the file is already
+# mapped and the result cached, so that what's left is the cost of a call:
+# reading the method's location and name and getting to the cached result.
+require 'benchmark'
+require 'tempfile'
+require_relative '../lib/fast_method_source'
+
+COUNT = 2_000
+ROUNDS = 100
+
+file = Tempfile.new(['one_liners', '.rb'])
+file.puts 'class OneLiners'
+COUNT.times { |i| file.puts "  def one_liner_#{i}; #{i}; end" }
+file.puts "  BLOCKS = [#{COUNT.times.map { |i| "proc { #{i} }" }.join(",\n")}]"
+file.puts 'end'
+file.flush
+load file.path
+
+methods = COUNT.times.map { |i| OneLiners.instance_method(:"one_liner_#{i}") }
+procs = OneLiners::BLOCKS
+FastMethodSource.max_cache_bytes = 64 << 20
+
+{ 'methods' => methods, 'procs' => procs }.each do |kind, subjects|
+  subjects.each { |subject| FastMethodSource.source_for(subject) }
+
+  allocated = GC.stat(:total_allocated_objects)
+  time = Benchmark.realtime do
+    ROUNDS.times { subjects.each { |subject| FastMethodSource.source_for(subject) } }
+  end
+  allocated = GC.stat(:total_allocated_objects) - allocated
+  lookups = ROUNDS * subjects.size
+
+  puts format('%-8s %.0f ns/lookup, %.2f objects/lookup',
+              kind, time / lookups * 1e9, allocated.to_f / lookups)
+end
+
+file.close!
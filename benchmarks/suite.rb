@@ -0,0 +1,169 @@
+# A self-contained benchmark suite. It generates synthetic corpora
+# (benchmarks/suite/corpora.rb). For every corpus, operation and cache mode,
+# it measures:
+#
+# * latency percentiles per lookup
+# * throughput
+# * system calls, allocations and RSS growth
+#
+# The results are written as JSON so that two versions can be compared with
+# benchmarks/suite/compare.rb.
+#
+# Modes:
+#   cold   - every lookup reads its file again (max_mapped_files = 0)
+#   warm   - files stay mapped, results aren't cached
+#   cached - results are cached too (max_cache_bytes)
+#
+# Usage: ruby benchmarks/suite.rb [options]
+require 'json'
+require 'optparse'
+require 'rbconfig'
+require 'time'
+require 'tmpdir'
+require_relative '../lib/fast_method_source'
+require_relative 'suite/corpora'
+
+OPERATIONS = {
+  'source' => FastMethodSource.method(:source_for),
+  'comment' => FastMethodSource.method(:comment_for),
+  'comment_and_source' => FastMethodSource.method(:comment_and_source_for)
+}
+
+MODES = {
+  'cold' => { max_mapped_files: 0, max_cache_bytes: 0 },
+  'warm' => { max_mapped_files: 64, max_cache_bytes: 0 },
+  'cached' => { max_mapped_files: 64, max_cache_bytes: 256 << 20 }
+}
+
+options = {
+  output: nil,
+  corpora: Corpora::ALL.keys,
+  operations: OPERATIONS.keys,
+  modes: MODES.keys,
+  lookups: 2_000,
+  rounds: 3
+}
+
+OptionParser.new do |parser|
+  parser.banner = 'Usage: ruby benchmarks/suite.rb [options]'
+  parser.on('-o', '--output FILE', 'Write JSON to FILE instead of stdout') { |file| options[:output] = file }
+  parser.on('-c', '--corpora LIST', Array, "Corpora to run (#{Corpora::ALL.keys.join(', ')})") do |list|
+    options[:corpora] = list.map(&:to_sym)
+  end
+  parser.on('--operations LIST', Array, "Operations to run (#{OPERATIONS.keys.join(', ')})") do |list|
+    options[:operations] = list
+  end
+  parser.on('-m', '--modes LIST', Array, "Modes to run (#{MODES.keys.join(', ')})") { |list| options[:modes] = list }
+  parser.on('-n', '--lookups N', Integer, 'Lookups per round, spread over the corpus') { |n| options[:lookups] = n }
+  parser.on('-r', '--rounds N', Integer, 'Measured rounds, after one to warm up') { |n| options[:rounds] = n }
+end.parse!
+
+def rss_kb
+  File.read('/proc/self/status')[/^VmRSS:\s+(\d+)/, 1].to_i
+rescue Errno::ENOENT
+  nil
+end
+
+def percentile(sorted, fraction)
+  sorted[[(sorted.size * fraction).ceil - 1, 0].max]
+end
+
+def configure(mode)
+  FastMethodSource.clear_cache
+  FastMethodSource.max_mapped_files = 0
+  FastMethodSource.max_mapped_files = mode[:max_mapped_files]
+  FastMethodSource.max_cache_bytes = mode[:max_cache_bytes]
+end
+
+# Every lookup is timed on its own; the counters cover all rounds.
+def measure(operation, subjects, rounds)
+  latencies = []
+  failures = 0
+
+  # The first round warms up whatever the mode keeps.
+  subjects.each { |subject| operation.call(subject) rescue nil }
+
+  GC.start
+  rss_before = rss_kb
+  syscalls = FastMethodSource.syscall_count
+  allocations = GC.stat(:total_allocated_objects)
+  started = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+
+  rounds.times do
+    subjects.each do |subject|
+      start = Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      begin
+        operation.call(subject)
+      rescue FastMethodSource::SourceNotFoundError
+        failures += 1
+      end
+      latencies << Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond) - start
+    end
+  end
+
+  elapsed = Process.clock_gettime(Process::CLOCK_MONOTONIC) - started
+  allocations = GC.stat(:total_allocated_objects) - allocations
+  syscalls = FastMethodSource.syscall_count - syscalls
+  rss_after = rss_kb
+  latencies.sort!
+
+  {
+    lookups: latencies.size,
+    failures: failures,
+    latency_ns: {
+      p50: percentile(latencies, 0.50),
+      p90: percentile(latencies, 0.90),
+      p99: percentile(latencies, 0.99),
+      max: latencies.last,
+      mean: latencies.sum / latencies.size
+    },
+    lookups_per_second: (latencies.size / elapsed).round,
+    syscalls_per_lookup: (syscalls.to_f / latencies.size).round(3),
+    allocations_per_lookup: (allocations.to_f / latencies.size).round(3),
+    rss_kb: { before: rss_before, after: rss_after, growth: rss_after && rss_after - rss_before }
+  }
+end
+
+report = {
+  library: { version: FastMethodSource::VERSION, engine: FastMethodSource.engine },
+  ruby: { version: RUBY_VERSION, platform: RUBY_PLATFORM, revision: RUBY_REVISION },
+  options: options.reject { |key, _| key == :output },
+  started_at: Time.now.utc.iso8601,
+  corpora: {}
+}
+
+Dir.mktmpdir('fms_suite') do |dir|
+  options[:corpora].each do |name|
+    subjects = Corpora.load(name, dir)
+    step = [subjects.size / options[:lookups], 1].max
+    sample = subjects.each_slice(step).map(&:first).first(options[:lookups])
+    files = sample.map { |subject| subject.source_location.first }.uniq
+    corpus = report[:corpora][name] = {
+      description: Corpora::ALL[name].first,
+      subjects: subjects.size,
+      sampled: sample.size,
+      files: files.size,
+      bytes: files.sum { |path| File.size(path) },
+      results: {}
+    }
+
+    options[:modes].each do |mode|
+      configure(MODES.fetch(mode))
+      # Cold lookups read a whole file each time, so they get fewer rounds.
+      rounds = mode == 'cold' ? 1 : options[:rounds]
+
+      options[:operations].each do |operation|
+        result = measure(OPERATIONS.fetch(operation), sample, rounds)
+        corpus[:results]["#{operation}/#{mode}"] = result
+
+        warn format('%-13s %-26s p50 %8.1f us  p99 %9.1f us  %9d/s', name, "#{operation}/#{mode}",
+                    result[:latency_ns][:p50] / 1e3, result[:latency_ns][:p99] / 1e3,
+                    result[:lookups_per_second])
+      end
+    end
+  end
+end
+
+configure(MODES['warm'])
+json = JSON.pretty_generate(report)
+options[:output] ? File.write(options[:output], json + "\n") : puts(json)
@@ -0,0 +1,46 @@
+# Compares two reports of benchmarks/suite.rb, metric by metric. Exits with
+# status 1 if any metric got worse by more than the threshold.
+#
+# Usage: ruby benchmarks/suite/compare.rb BASELINE.json CURRENT.json [threshold %]
+require 'json'
+
+# Metric => [how to get it from a result, whether higher is better].
+METRICS = {
+  'p50' => [->(result) { result['latency_ns']['p50'] }, false],
+  'p99' => [->(result) { result['latency_ns']['p99'] }, false],
+  'lookups/s' => [->(result) { result['lookups_per_second'] }, true],
+  'syscalls' => [->(result) { result['syscalls_per_lookup'] }, false],
+  'allocations' => [->(result) { result['allocations_per_lookup'] }, false],
+  'failures' => [->(result) { result['failures'] }, false]
+}
+
+abort 'Usage: ruby benchmarks/suite/compare.rb BASELINE.json CURRENT.json [threshold %]' if ARGV.size < 2
+
+baseline, current = ARGV.first(2).map { |path| JSON.parse(File.read(path)) }
+threshold = Float(ARGV[2] || 10)
+regressions = 0
+
+current['corpora'].each do |corpus, report|
+  base_report = baseline['corpora'][corpus] or next
+
+  report['results'].each do |key, result|
+    base_result = base_report['results'][key] or next
+
+    changes = METRICS.map do |metric, (value_of, higher_is_better)|
+      before = value_of.(base_result)
+      after = value_of.(result)
+      change = before.zero? ? (after.zero? ? 0.0 : Float::INFINITY) : 100.0 * (after - before) / before
+      worse = higher_is_better ? -change > threshold : change > threshold
+      # Counts that stay tiny aren't worth flagging.
+      worse &&= (after - before).abs >= 0.5 if %w[syscalls allocations].include?(metric)
+      regressions += 1 if worse
+
+      format('%s %+.1f%%%s', metric, change, worse ? ' !' : '')
+    end
+
+    puts format('%-13s %-26s %s', corpus, key, changes.join('  '))
+  end
+end
+
+puts "#{regressions} regression(s) over #{threshold}%"
+exit(regressions.zero? ? 0 : 1)
@@ -0,0 +1,127 @@
+# Synthetic corpora for benchmarks/suite.rb. Each one is a set of Ruby files
+# generated from scratch, so that results only depend on the library and not
+# on which gems or which version of the standard library are installed.
+module Corpora
+  # Name => [description, generator]. A generator returns a Hash of file name
+  # => source. Whatever it defines goes under a module named after the corpus.
+  ALL = {}
+
+  def self.define(name, description, &generator)
+    ALL[name] = [description, generator]
+  end
+
+  # Writes the corpus to +dir+ and loads it. Returns the methods and procs it
+  # defines, in the order they appear in its files.
+  def self.load(name, dir)
+    _, generator = ALL.fetch(name)
+    namespace = "Fms#{name.to_s.split('_').map(&:capitalize).join}Corpus"
+
+    generator.call(namespace).each do |basename, source|
+      path = File.join(dir, "#{name}_#{basename}.rb")
+      File.write(path, source)
+      Kernel.load(path)
+    end
+
+    subjects_of(Object.const_get(namespace))
+  end
+
+  def self.subjects_of(namespace)
+    subjects = []
+    queue = [namespace]
+
+    until queue.empty?
+      mod = queue.shift
+      subjects.concat(mod.instance_methods(false).map { |name| mod.instance_method(name) })
+      mod.constants(false).sort.each do |name|
+        const = mod.const_get(name)
+        queue << const if const.is_a?(Module)
+        subjects.concat(const) if const.is_a?(Array) && const.all?(Proc)
+      end
+    end
+
+    subjects.sort_by(&:source_location)
+  end
+
+  define :huge_file, 'one file of 30,000 commented three-line methods (about 2 MB)' do |namespace|
+    source = +"module #{namespace}\n"
+    30_000.times do |i|
+      source << "  # Returns #{i}.\n  def method_#{i}(arg)\n    arg + #{i}\n  end\n\n"
+    end
+    { 'huge' => source << "end\n" }
+  end
+
+  define :deep_nesting, 'methods 12 modules and 20 blocks deep' do |namespace|
+    10.times.to_h do |file|
+      modules = 12.times.map { |depth| "Level#{depth}" }
+      source = +"module #{namespace}\n"
+      modules.each_with_index { |name, depth| source << "#{'  ' * (depth + 1)}module #{name}\n" }
+
+      indent = '  ' * (modules.size + 1)
+      20.times do |i|
+        source << "#{indent}def method_#{file}_#{i}(items)\n"
+        20.times do |depth|
+          source << "#{indent}#{'  ' * (depth + 1)}items.each do |item#{depth}|\n"
+          source << "#{indent}#{'  ' * (depth + 2)}next if item#{depth}.nil?\n"
+        end
+        source << "#{indent}#{'  ' * 21}items\n"
+        20.downto(1) { |depth| source << "#{indent}#{'  ' * depth}end\n" }
+        source << "#{indent}end\n\n"
+      end
+
+      modules.size.downto(1) { |depth| source << "#{'  ' * depth}end\n" }
+      [file.to_s, source << "end\n"]
+    end
+  end
+
+  define :long_methods, 'methods of 1,000 lines' do |namespace|
+    10.times.to_h do |file|
+      source = +"module #{namespace}\n"
+      10.times do |i|
+        source << "  def method_#{file}_#{i}(value)\n"
+        500.times do |line|
+          source << "    value = value * #{line} + 1 if value.odd?\n"
+          source << "    # Keeps value within bounds: #{line}.\n"
+        end
+        source << "    value\n  end\n\n"
+      end
+      [file.to_s, source << "end\n"]
+    end
+  end
+
+  define :heredocs, 'methods built around heredocs that contain `end` lines' do |namespace|
+    10.times.to_h do |file|
+      source = +"module #{namespace}\n"
+      50.times do |i|
+        source << "  def method_#{file}_#{i}(name)\n"
+        source << "    <<~RUBY + <<-TEXT\n"
+        source << "      def \#{name}\n        :#{i}\n      end\n"
+        source << "    RUBY\n  end\n    TEXT\n  end\n\n"
+      end
+      [file.to_s, source << "end\n"]
+    end
+  end
+
+  define :procs, 'procs and lambdas of every syntax, one or more lines' do |namespace|
+    10.times.to_h do |file|
+      source = +"module #{namespace}\n  PROCS_#{file} = [\n"
+      50.times do |i|
+        source << "    proc { |x| x + #{i} },\n"
+        source << "    lambda do |x|\n      x * #{i}\n    end,\n"
+        source << "    ->(x) {\n      x - #{i}\n    },\n"
+        source << "    proc do |x, y = #{i}|\n      [x, y].map { |z| z.to_s }\n    end,\n"
+      end
+      [file.to_s, source << "  ]\nend\n"]
+    end
+  end
+
+  define :one_liners, 'one-liner and endless methods' do |namespace|
+    10.times.to_h do |file|
+      source = +"module #{namespace}\n"
+      250.times do |i|
+        source << "  def method_#{file}_#{i}; #{i}; end\n"
+        source << "  def endless_#{file}_#{i}(x) = x + #{i}\n"
+      end
+      [file.to_s, source << "end\n"]
+    end
+  end
+end
@@ -0,0 +1,59 @@
+# The first lookups into freshly loaded files, with and without
+# FastMethodSource.warm!. Each run loads the files in a process of its own,
+# waits for warming to finish, and then looks up two methods per file, as a
+# doc server's first requests after a deploy would. Warming happens while the
+# application boots, so its time isn't counted.
+#
+# Usage: ruby benchmarks/warm.rb [files] [methods per file]
+require 'benchmark'
+require 'tmpdir'
+require_relative '../lib/fast_method_source'
+
+FILES = Integer(ARGV[0] || 50)
+METHODS = Integer(ARGV[1] || 400)
+
+def write_files(dir)
+  FILES.times.map do |i|
+    path = File.join(dir, "warm_#{i}.rb")
+    File.open(path, 'w') do |file|
+      file.puts "module Warm#{i}"
+      METHODS.times { |j| file.write("  def self.method_#{j}(x)\n    if x\n      x + #{j}\n    end\n  end\n\n") }
+      file.puts 'end'
+    end
+    path
+  end
+end
+
+def run(paths, warm)
+  reader, writer = IO.pipe
+
+  pid = fork do
+    reader.close
+    FastMethodSource.max_mapped_files = FILES
+    FastMethodSource.warm! if warm
+    paths.each { |path| load path }
+    sleep 0.001 while warm && FastMethodSource.stats[:files_warmed] < FILES
+
+    methods = FILES.times.flat_map do |i|
+      mod = Object.const_get("Warm#{i}")
+      [mod.method(:"method_#{METHODS / 2}"), mod.method(:"method_#{METHODS - 1}")]
+    end
+    writer.write(Marshal.dump(Benchmark.realtime { methods.each { |method| FastMethodSource.source_for(method) } }))
+    exit!(0)
+  end
+
+  writer.close
+  time = Marshal.load(reader.read)
+  Process.wait(pid)
+  time
+end
+
+Dir.mktmpdir do |dir|
+  paths = write_files(dir)
+  puts "#{FILES} files, #{METHODS} methods each, 2 lookups per file"
+
+  [false, true].each do |warm|
+    time = 5.times.map { run(paths, warm) }.min
+    puts format('%-8s %10.1f us per lookup', warm ? 'warm!' : 'cold', time / (FILES * 2) * 1e6)
+  end
+end
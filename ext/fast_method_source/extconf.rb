@@ -3,5 +3,20 @@ require 'mkmf'
 $CFLAGS << ' -std=c99 -Wno-declaration-after-statement'
 
 have_func('rb_sym2str', 'ruby.h')
+have_func('rb_parser_set_context')
+have_func('rb_ast_dispose')
+have_func('rb_method_iseq')
+have_func('rb_proc_get_iseq')
+have_func('rb_iseq_path')
+have_func('rb_iseq_first_lineno')
+have_func('rb_iseq_code_location')
+have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+have_func('pthread_create', 'pthread.h')
+have_header('sys/sdt.h')
+have_func('rb_ext_ractor_safe', 'ruby.h')
+have_func('rb_ractor_local_storage_ptr_newkey', 'ruby/ractor.h')
+have_func('rb_ractor_make_shareable', 'ruby/ractor.h')
+have_struct_member('struct stat', 'st_mtim', 'sys/stat.h')
+have_struct_member('struct stat', 'st_mtimespec', 'sys/stat.h')
 
 create_makefile('fast_method_source/fast_method_source')
@@ -3,13 +3,27 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <fcntl.h>
+#include <string.h>
 #include <ruby.h>
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif
 
 #include "node.h"
-
+#include "file_cache.h"
+#include "line_index.h"
+#include "prism_engine.h"
+#include "probes.h"
+#include "result_cache.h"
+#include "scanner.h"
+#include "span_store.h"
+#include "stats.h"
+#include "warmer.h"
+
+#ifndef HAVE_RB_PARSER_SET_CONTEXT
 #ifdef _WIN32
 #include <io.h>
 static const char *null_filename = "NUL";
@@ -21,28 +35,32 @@ static const char *null_filename = "/dev/null";
 #define DUP(fd) dup(fd)
 #define DUP2(fd, newfd) dup2(fd, newfd)
 #endif
+#endif
 
-#ifndef HAVE_RB_SYM2STR
-# define rb_sym2str(obj) rb_id2str(SYM2ID(obj))
+/* Parser internals of Ruby 2.6+ that node.h doesn't know about. */
+#ifdef HAVE_RB_PARSER_SET_CONTEXT
+VALUE rb_parser_set_context(VALUE vparser, const void *base, int main);
+#endif
+#ifdef HAVE_RB_AST_DISPOSE
+void rb_ast_dispose(void *ast);
 #endif
 
-#ifdef __APPLE__
-void *
-memrchr(const void *s, int c, size_t n)
-{
-    const unsigned char *cp;
+/* VM internals that know where the code of a method starts and ends. */
+#if defined(HAVE_RB_METHOD_ISEQ) && defined(HAVE_RB_PROC_GET_ISEQ) && \
+    defined(HAVE_RB_ISEQ_PATH) && defined(HAVE_RB_ISEQ_FIRST_LINENO) && \
+    defined(HAVE_RB_ISEQ_CODE_LOCATION)
+# define HAVE_ISEQ_CODE_LOCATION 1
+typedef struct rb_iseq_struct rb_iseq_t;
+const rb_iseq_t *rb_method_iseq(VALUE body);
+const rb_iseq_t *rb_proc_get_iseq(VALUE proc, int *is_proc);
+VALUE rb_iseq_path(const rb_iseq_t *iseq);
+VALUE rb_iseq_first_lineno(const rb_iseq_t *iseq);
+void rb_iseq_code_location(const rb_iseq_t *iseq, int *first_lineno, int *first_column,
+                           int *last_lineno, int *last_column);
+#endif
 
-    if (n != 0) {
-        cp = (unsigned char *)s + n;
-        do {
-            if (*(--cp) == (unsigned char)c)
-                return((void *)cp);
-        } while (--n != 0);
-    }
-    return NULL;
-}
-#else
-void *memrchr(const void *s, int c, size_t n);
+#ifndef HAVE_RB_SYM2STR
+# define rb_sym2str(obj) rb_id2str(SYM2ID(obj))
 #endif
 
 typedef struct {
@@ -50,449 +68,2312 @@ typedef struct {
     int comment : 1;
 } finder;
 
+/*
+ * Where the iseq of a method says its code ends: right before byte column of
+ * line lineno. A lineno of 0 when there's no iseq to ask.
+ */
+struct code_end {
+    unsigned lineno;
+    unsigned column;
+};
+
 struct method_data {
     unsigned method_location;
+    struct code_end code_end;
+    const char *filename;
+    VALUE path;
+    VALUE method;
+    /* What read_lines() found when it stat()ed the file, or NULL. */
+    const struct file_identity *identity;
+};
+
+/*
+ * Where a method was found. Holds no text: #source and friends slice it out
+ * of the file when they're called, as long as the file hasn't changed.
+ */
+struct source_ref {
+    VALUE path;
+
+    /* The text of the script the method was eval'd from, or Qnil. */
+    VALUE script;
+    struct file_identity identity;
+    unsigned start_line;
+    unsigned end_line;
+    size_t start_byte;
+    size_t end_byte;
+    size_t comment_start;
+};
+
+/*
+ * Scans that go on for longer than this many bytes let go of the GVL. Below
+ * that, releasing and reacquiring it costs more than the scan itself.
+ */
+#define SCAN_GVL_BUDGET (16 * 1024)
+
+struct scan_call {
+    struct expr_scan *scan;
+    enum scan_status status;
+};
+
+struct index_call {
+    struct mapped_file *file;
+    struct line_index lines;
+    int status;
+};
+
+struct spans_call {
+    struct mapped_file *file;
+    struct span_index spans;
+    int status;
+};
+
+struct batch_entry {
+    long index;
     const char *filename;
-    VALUE method_name;
+    unsigned lineno;
+    struct code_end code_end;
+
+    /* Set when the result came from the result cache. */
+    int resolved;
+
+    /* What the scan found: start is NULL when the line doesn't exist. */
+    const char *start;
+    const char *end;
+    const char *comment_start;
+    enum scan_status status;
+    int confirm;
+};
+
+/* The entries of one file, entries[from...to]. */
+struct batch_group {
+    long from;
+    long to;
+    struct mapped_file *file;
+    struct mapped_file view;
+
+    /* Built by a worker: 1 when it did, -1 when it ran out of memory. */
+    struct line_index lines;
+    int indexed;
+    struct span_index spans;
+    int spanned;
+};
+
+struct batch {
+    finder finder;
+    VALUE methods;
+    VALUE results;
+    VALUE filenames;
+    struct batch_entry *entries;
+    struct batch_group *groups;
+    VALUE entries_buf;
+    VALUE groups_buf;
+    long count;
+    long ngroups;
+    long next_group;
+    int nthreads;
+
+    /* Groups before this one have released their file. */
+    long finished;
+};
+
+struct batch_group_call {
+    struct batch *batch;
+    struct batch_group *group;
+};
+
+struct script_lookup {
+    finder finder;
+    VALUE method;
+};
+
+struct probed_lookup {
+    finder finder;
+    struct method_data data;
+    VALUE result;
+};
+
+struct probed_locate {
+    VALUE method;
+    VALUE path;
+    unsigned lineno;
+    struct code_end code_end;
+    VALUE ref;
+};
+
+struct probed_batch {
+    finder finder;
+    VALUE methods;
+    int nthreads;
+    VALUE results;
+};
+
+struct file_sources_call {
+    VALUE path;
+    VALUE methods;
+    struct mapped_file *file;
+
+    /* Set when the file was mapped by this call rather than already cached. */
+    int opened;
+};
+
+/*
+ * A lookup into a file that's held for its duration, so that the file can be
+ * released from an rb_ensure() cleanup if the lookup raises.
+ */
+struct file_lookup {
+    finder finder;
+    struct method_data *data;
+    struct mapped_file *file;
+    size_t from;
+    size_t to;
 };
 
 static VALUE read_lines(finder finder, struct method_data *data);
-static VALUE read_lines_before(struct method_data *data);
-static VALUE read_lines_after(struct method_data *data);
-static VALUE find_method_comment(struct method_data *data);
-static VALUE find_method_source(struct method_data *data);
-static VALUE find_comment_expression(struct method_data *data);
-static VALUE find_source_expression(struct method_data *data);
-static NODE *parse_expr(VALUE rb_str);
+static VALUE find_lines(finder finder, struct method_data *data);
+static VALUE find_lines_in_file(finder finder, struct mapped_file *file, unsigned lineno,
+                                const struct code_end *code_end);
+static int finder_kind(finder finder);
+static VALUE read_lines_in_batch(finder finder, VALUE methods, int nthreads);
+static VALUE run_batch(VALUE arg);
+static VALUE end_batch(VALUE arg);
+static void prepare_batch_group(struct batch *batch, struct batch_group *group);
+static void scan_batch_group(struct batch *batch, struct batch_group *group);
+static void *scan_batch_worker(void *ptr);
+static void *scan_batch_without_gvl(void *ptr);
+static void finish_batch_group(struct batch *batch, struct batch_group *group);
+static VALUE resolve_batch_group(VALUE arg);
+static VALUE resolve_batch_entry(struct batch *batch, struct batch_group *group,
+                                 struct batch_entry *entry);
+static void store_batch_error(struct batch *batch, struct batch_group *group, VALUE error);
+static VALUE acquire_batch_file(VALUE filename);
+static void read_batch_group_scripts(struct batch *batch, struct batch_group *group);
+static VALUE read_script_lookup(VALUE arg);
+static int compare_batch_entries(const void *a, const void *b);
+static VALUE probed_lookup(finder finder, VALUE method);
+static VALUE run_probed_lookup(VALUE arg);
+static VALUE fire_return_probe(VALUE arg);
+static VALUE run_probed_locate(VALUE arg);
+static VALUE fire_locate_return_probe(VALUE arg);
+static VALUE run_probed_batch(VALUE arg);
+static VALUE fire_batch_return_probe(VALUE arg);
+static long count_found(VALUE results);
+static VALUE locate_source(VALUE method, VALUE rb_filename, unsigned lineno,
+                           const struct code_end *code_end);
+static VALUE make_source_ref(VALUE arg);
+static VALUE find_lines_in_lookup(VALUE arg);
+static VALUE slice_lookup(VALUE arg);
+static VALUE release_lookup(VALUE arg);
+static VALUE find_comment_in_file(struct mapped_file *file, unsigned lineno);
+static VALUE find_source_in_file(struct mapped_file *file, unsigned lineno,
+                                 const struct code_end *code_end);
+static VALUE find_comment_and_source_in_file(struct mapped_file *file, unsigned lineno,
+                                             const struct code_end *code_end);
+static const char *find_source_end(struct mapped_file *file, unsigned lineno,
+                                   const struct code_end *code_end);
+static const char *find_code_end(struct mapped_file *file, unsigned lineno,
+                                 const struct code_end *code_end);
+static int method_location(VALUE method, VALUE *path, unsigned *lineno,
+                           struct code_end *code_end);
+static struct mapped_file *acquire_method_file(struct method_data *data);
+static int is_script_path(const char *path);
+static VALUE script_lines_of(VALUE method);
+static struct mapped_file *script_file_new(const char *path, VALUE lines);
+static void locate_in_script(struct mapped_file *file, unsigned *lineno,
+                             struct code_end *code_end);
+static void index_file(struct mapped_file *file);
+static void *index_file_without_gvl(void *ptr);
+static void index_spans(struct mapped_file *file);
+static void *index_spans_without_gvl(void *ptr);
+static enum scan_status next_candidate(struct expr_scan *scan);
+static void *expr_scan_next_without_gvl(void *ptr);
+static void without_gvl(void *(*func)(void *), void *arg);
+static int parse_expr(const char *src, size_t len);
+static int confirm_candidate(const char *start, const char *end);
+#ifndef HAVE_RB_PARSER_SET_CONTEXT
 static NODE *parse_with_silenced_stderr(VALUE rb_str);
-static void restore_ch(char *line, char ch, int last_ch_idx);
-static void close_map(int fd, char *map, size_t map_size, const char *filename);
-static void nulify_ch(char *line, char *ch, int last_ch_idx);
-static int contains_end_kw(const char *line);
-static int is_comment(const char *line, const size_t line_len);
-static int is_definition_end(const char *line);
-static int is_static_definition_start(const char *line);
-static size_t count_prefix_spaces(const char *line);
-static void raise_if_nil(VALUE val, VALUE method_name);
+#endif
+static void raise_if_nil(VALUE val, VALUE method);
+static VALUE source_not_found_error(VALUE method);
 static void method_data_init(VALUE self, struct method_data *data);
 static VALUE mMethodExtensions_source(VALUE self);
+static VALUE mMethodExtensions_comment(VALUE self);
+static VALUE mMethodExtensions_comment_and_source(VALUE self);
+static VALUE mFastMethodSource_sources_for(int argc, VALUE *argv, VALUE self);
+static VALUE mFastMethodSource_max_mapped_files(VALUE self);
+static VALUE mFastMethodSource_set_max_mapped_files(VALUE self, VALUE max);
+static VALUE mFastMethodSource_map_threshold(VALUE self);
+static VALUE mFastMethodSource_set_map_threshold(VALUE self, VALUE threshold);
+static VALUE mFastMethodSource_readahead_threshold(VALUE self);
+static VALUE mFastMethodSource_set_readahead_threshold(VALUE self, VALUE threshold);
+static VALUE mFastMethodSource_syscall_count(VALUE self);
+static VALUE mFastMethodSource_max_cache_bytes(VALUE self);
+static VALUE mFastMethodSource_set_max_cache_bytes(VALUE self, VALUE max);
+static VALUE mFastMethodSource_cache_bytes(VALUE self);
+static VALUE mFastMethodSource_clear_cache(VALUE self);
+static VALUE mFastMethodSource_span_cache_dir(VALUE self);
+static VALUE mFastMethodSource_locate(VALUE self, VALUE method);
+static VALUE mFastMethodSource_each_source_in_file(VALUE self, VALUE path, VALUE methods);
+static VALUE yield_file_sources(VALUE arg);
+static VALUE yield_script_sources(VALUE methods);
+static VALUE find_script_source(VALUE method);
+static VALUE slice_script_source(VALUE arg);
+static VALUE source_and_comment_in_file(struct mapped_file *file, unsigned lineno,
+                                        const struct code_end *code_end);
+static VALUE forget_file(VALUE arg);
+static void source_ref_mark(void *ptr);
+static size_t source_ref_memsize(const void *ptr);
+static struct source_ref *get_source_ref(VALUE self);
+static VALUE source_ref_slice(VALUE self, size_t from, size_t to);
+static VALUE cSourceRef_path(VALUE self);
+static VALUE cSourceRef_start_line(VALUE self);
+static VALUE cSourceRef_end_line(VALUE self);
+static VALUE cSourceRef_byte_range(VALUE self);
+static VALUE cSourceRef_comment_range(VALUE self);
+static VALUE cSourceRef_source(VALUE self);
+static VALUE cSourceRef_comment(VALUE self);
+static VALUE cSourceRef_comment_and_source(VALUE self);
+static VALUE mFastMethodSource_set_span_cache_dir(VALUE self, VALUE dir);
+static VALUE mFastMethodSource_engine(VALUE self);
+static VALUE mFastMethodSource_set_engine(VALUE self, VALUE engine);
+static VALUE mFastMethodSource_stats(VALUE self);
+static VALUE mFastMethodSource_reset_stats(VALUE self);
+static VALUE mFastMethodSource_warm_file(VALUE self, VALUE path);
+static VALUE mFastMethodSource_source_for(VALUE self, VALUE method);
+static VALUE mFastMethodSource_comment_for(VALUE self, VALUE method);
+static VALUE mFastMethodSource_comment_and_source_for(VALUE self, VALUE method);
 
 static VALUE rb_eSourceNotFoundError;
 
-static VALUE
-find_method_source(struct method_data *data)
-{
-    return read_lines_after(data);
-}
+/* Interned once, since every lookup may need them. */
+static ID id_source_location;
+static ID id_name;
+static ID id_threads;
+static ID id_of;
+static ID id_script_lines;
+
+/* RubyVM::InstructionSequence, or Qnil when there's no such thing. */
+static VALUE rb_cISeq = Qnil;
+static VALUE rb_cSourceRef;
+
+static const rb_data_type_t source_ref_type = {
+    "FastMethodSource::SourceRef",
+    {source_ref_mark, RUBY_TYPED_DEFAULT_FREE, source_ref_memsize,},
+    0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_FROZEN_SHAREABLE
+};
+#ifdef HAVE_RB_PARSER_SET_CONTEXT
+static VALUE parse_filename;
+#endif
 
 static VALUE
-find_method_comment(struct method_data *data)
+find_comment_in_file(struct mapped_file *file, unsigned lineno)
 {
-    return read_lines_before(data);
-}
+    size_t line_len;
+    const char *method_line;
 
-static VALUE
-read_lines_after(struct method_data *data)
-{
-    finder finder = {1, 0};
-    return read_lines(finder, data);
+    index_file(file);
+    index_spans(file);
+    method_line = mapped_file_line(file, lineno, &line_len);
+
+    if (method_line == NULL) {
+        return Qnil;
+    }
+
+    const char *comment_start = scan_comment_start(file, lineno);
+
+    return rb_str_new(comment_start, method_line - comment_start);
 }
 
 static VALUE
-read_lines_before(struct method_data *data)
+find_source_in_file(struct mapped_file *file, unsigned lineno, const struct code_end *code_end)
 {
-    finder finder = {0, 1};
-    return read_lines(finder, data);
+    size_t line_len;
+    const char *expr_start = mapped_file_line(file, lineno, &line_len);
+    const char *expr_end = find_source_end(file, lineno, code_end);
+
+    if (expr_end == NULL) {
+        return Qnil;
+    }
+
+    return rb_str_new(expr_start, expr_end - expr_start);
 }
 
-static VALUE
-find_comment_expression(struct method_data *data)
+/*
+ * Returns the end of the expression that starts at +lineno+, or NULL if it
+ * can't be found. When the iseq knows where the code ends (+code_end+ may be
+ * NULL), nothing is scanned or parsed.
+ */
+static const char *
+find_source_end(struct mapped_file *file, unsigned lineno, const struct code_end *code_end)
 {
-    struct stat filestat;
-    int fd;
-    char *map;
+    struct expr_scan scan;
+    size_t line_len;
+    const char *end;
+    enum scan_status status;
+    unsigned attempts = 0;
 
-    VALUE comment = Qnil;
+    index_file(file);
 
-    if ((fd = open(data->filename, O_RDONLY)) == -1) {
-        rb_raise(rb_eIOError, "failed to read - %s", data->filename);
+    if ((end = find_code_end(file, lineno, code_end)) != NULL) {
+        stats_add_parse_attempts(0);
+        return end;
     }
 
-    if (fstat(fd, &filestat) == -1) {
-        rb_raise(rb_eIOError, "filestat failed for %s", data->filename);
+    index_spans(file);
+
+    if (mapped_file_line(file, lineno, &line_len) == NULL) {
+        return NULL;
     }
 
-    map = mmap(NULL, filestat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (map == MAP_FAILED) {
-        rb_raise(rb_eIOError, "mmap failed for %s", data->filename);
+    expr_scan_init(&scan, file, lineno);
+
+    while ((status = next_candidate(&scan)) == SCAN_FOUND) {
+        if (!scan.confirm) {
+            break;
+        }
+
+        attempts++;
+        if (confirm_candidate(scan.start, scan.end)) {
+            break;
+        }
     }
 
-    char *rest = map;
-    unsigned line_count = 0;
+    stats_add(STATS_BYTES_SCANNED, scan.bytes_scanned);
+    stats_add(STATS_LINES_WALKED, scan.lines_walked);
+    stats_add_parse_attempts(attempts);
+
+    return status == SCAN_FOUND ? scan.end : NULL;
+}
+
+/*
+ * The fast path of find_source_end(). Counts a fallback whenever it returns
+ * NULL, unless there's no +code_end+ at all: that's a lookup that has been
+ * counted already. The file must be indexed. Doesn't need the GVL.
+ */
+static const char *
+find_code_end(struct mapped_file *file, unsigned lineno, const struct code_end *code_end)
+{
+    const char *end = NULL;
+
+    if (code_end == NULL) {
+        return NULL;
+    }
 
-    while (line_count++ != data->method_location - 1) {
-        rest = (char *) memchr(rest, '\n', filestat.st_size) + 1;
+    if (code_end->lineno != 0) {
+        end = scan_code_end(file, lineno, code_end->lineno, code_end->column);
     }
 
-    size_t end = filestat.st_size - strlen(rest);
-    map[end] = '\0';
+    stats_add(end != NULL ? STATS_FAST_PATH_HITS : STATS_FAST_PATH_FALLBACKS, 1);
 
-    size_t offset = end;
-    char *prev = NULL;
+    return end;
+}
 
-    while (line_count-- != 0) {
-        rest = memrchr(map, '\n', offset - 2);
+/*
+ * Finds where +method+ was defined, like #source_location. The location of
+ * a method or proc with an iseq is read straight from it, along with where
+ * its code ends; anything else (attr_reader, objects that merely respond to
+ * #source_location) is asked. The end only counts when the iseq starts on
+ * the line the location does. Returns -1 when the location is unknown.
+ */
+static int
+method_location(VALUE method, VALUE *path, unsigned *lineno, struct code_end *code_end)
+{
+    VALUE source_location;
 
-        if (rest == NULL) {
-            rest = memrchr(map, '\n', offset);
-        } else {
-            rest++;
-        }
+    code_end->lineno = 0;
+    code_end->column = 0;
 
-        offset = end - strlen(rest);
+#ifdef HAVE_ISEQ_CODE_LOCATION
+    const rb_iseq_t *iseq = NULL;
+    int first_lineno, first_column, last_lineno, last_column;
 
-        if (is_comment(rest, offset)) {
-            prev = rest;
-        } else {
-            if (prev == NULL) {
-                comment = rb_str_new("", 0);
-            } else {
-                comment = rb_str_new2(prev);
-            }
+    if (rb_obj_is_method(method)) {
+        iseq = rb_method_iseq(method);
+    } else if (rb_obj_is_proc(method)) {
+        iseq = rb_proc_get_iseq(method, NULL);
+    }
 
-            break;
+    if (iseq != NULL) {
+        *path = rb_iseq_path(iseq);
+        *lineno = NUM2UINT(rb_iseq_first_lineno(iseq));
+
+        rb_iseq_code_location(iseq, &first_lineno, &first_column, &last_lineno, &last_column);
+
+        if (first_lineno == (int) *lineno && last_lineno >= first_lineno && last_column >= 0) {
+            code_end->lineno = last_lineno;
+            code_end->column = last_column;
         }
+
+        return 0;
     }
+#endif
+
+    source_location = rb_funcall(method, id_source_location, 0);
 
-    if (munmap (map, filestat.st_size) == -1) {
-        rb_raise(rb_eIOError, "munmap failed for %s", data->filename);
+    if (NIL_P(source_location) ||
+        NIL_P(*path = RARRAY_AREF(source_location, 0)) ||
+        NIL_P(RARRAY_AREF(source_location, 1)))
+    {
+        return -1;
     }
-    close(fd);
 
-    return comment;
+    *lineno = NUM2UINT(RARRAY_AREF(source_location, 1));
+
+    return 0;
 }
 
-static VALUE
-find_source_expression(struct method_data *data)
+/*
+ * Pins the file +data+ was defined in. Code that was eval'd is read from the
+ * lines Ruby kept of it (RubyVM.keep_script_lines) instead: straight away
+ * when its path is made up, and when its file can't be read otherwise. The
+ * lines of +data+ are then made relative to the script. Raises
+ * SourceNotFoundError for a made-up path without kept lines, and IOError for
+ * a file that can't be read.
+ */
+static struct mapped_file *
+acquire_method_file(struct method_data *data)
 {
-    struct stat filestat;
-    int fd;
-    char *map;
-
-    VALUE source = Qnil;
+    int script = is_script_path(data->filename);
+    struct mapped_file *file;
+    VALUE lines;
 
-    if ((fd = open(data->filename, O_RDONLY)) == -1) {
-        rb_raise(rb_eIOError, "failed to read - %s", data->filename);
+    if (!script && (file = file_cache_try_acquire(data->filename, data->identity)) != NULL) {
+        return file;
     }
 
-    if (fstat(fd, &filestat) == -1) {
-        rb_raise(rb_eIOError, "filestat failed for %s", data->filename);
+    if (NIL_P(lines = script_lines_of(data->method))) {
+        if (script) {
+            rb_exc_raise(source_not_found_error(data->method));
+        }
+
+        /* Fails again, this time with the reason. */
+        return file_cache_acquire(data->filename);
     }
 
-    map = mmap(NULL, filestat.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-    if (map == MAP_FAILED) {
-        rb_raise(rb_eIOError, "mmap failed for %s", data->filename);
+    file = script_file_new(data->filename, lines);
+    locate_in_script(file, &data->method_location, &data->code_end);
+
+    return file;
+}
+
+/*
+ * Whether +path+ is one Ruby makes up for code that doesn't come from a
+ * file, such as "(eval at foo.rb:3)" or "(irb)".
+ */
+static int
+is_script_path(const char *path)
+{
+    size_t len = strlen(path);
+
+    return len >= 2 && path[0] == '(' && path[len - 1] == ')';
+}
+
+/*
+ * The lines of the script +method+ was compiled from, if Ruby kept them: it
+ * does for eval'd code while RubyVM.keep_script_lines is on. Returns nil
+ * otherwise.
+ */
+static VALUE
+script_lines_of(VALUE method)
+{
+    VALUE iseq, lines;
+
+    if (NIL_P(rb_cISeq) || (!rb_obj_is_method(method) && !rb_obj_is_proc(method))) {
+        return Qnil;
     }
 
-    char *expr_start = map;
-    char *expr_end, *next_expr, *line;
-    unsigned line_count = 0;
+    iseq = rb_funcall(rb_cISeq, id_of, 1, method);
 
-    while (line_count++ != data->method_location - 1) {
-        expr_start = (char *) memchr(expr_start, '\n', filestat.st_size) + 1;
+    if (NIL_P(iseq) || !rb_respond_to(iseq, id_script_lines)) {
+        return Qnil;
     }
 
-    size_t last_ch_idx;
-    char ch, next_ch;
-    next_expr = expr_end = expr_start;
-    size_t leftover_size = filestat.st_size - strlen(expr_end);
-    size_t offset = filestat.st_size - leftover_size;
-    size_t next_offset;
-    size_t prefix_len = 0;
-    int inside_static_def = 0;
-    int should_parse = 0;
-    VALUE rb_expr;
+    lines = rb_funcall(iseq, id_script_lines, 0);
 
-    while (offset != 0) {
-        next_expr = (char *) memchr(expr_end, '\n', offset) + 1;
-        next_offset = strlen(next_expr);
-        line = expr_end;
+    return RB_TYPE_P(lines, T_ARRAY) && RARRAY_LEN(lines) > 0 ? lines : Qnil;
+}
 
-        last_ch_idx = offset - next_offset - 1;
+/* Joins the lines into an uncached file. */
+static struct mapped_file *
+script_file_new(const char *path, VALUE lines)
+{
+    struct mapped_file *file;
+    size_t len = 0, offset = 0;
+    char *contents;
 
-        nulify_ch(line, &ch, last_ch_idx);
+    for (long i = 0; i < RARRAY_LEN(lines); i++) {
+        VALUE line = RARRAY_AREF(lines, i);
 
-        expr_end = next_expr;
-        offset = next_offset;
+        len += RB_TYPE_P(line, T_STRING) ? RSTRING_LEN(line) : 0;
+    }
 
-        if (is_static_definition_start(line) && !inside_static_def) {
-            inside_static_def = 1;
-            prefix_len = count_prefix_spaces(line);
+    if ((contents = malloc(len > 0 ? len : 1)) == NULL) {
+        rb_memerror();
+    }
 
-            if (contains_end_kw(line)) {
-                if (parse_expr(rb_str_new2(line)) != NULL) {
-                    restore_ch(line, ch, last_ch_idx);
-                    rb_expr = rb_str_new2(expr_start);
+    for (long i = 0; i < RARRAY_LEN(lines); i++) {
+        VALUE line = RARRAY_AREF(lines, i);
 
-                    close_map(fd, map, filestat.st_size, data->filename);
-                    return rb_expr;
-                }
-            }
+        if (RB_TYPE_P(line, T_STRING)) {
+            memcpy(contents + offset, RSTRING_PTR(line), RSTRING_LEN(line));
+            offset += RSTRING_LEN(line);
         }
+    }
 
-        if (line[0] == '\n' || is_comment(line, strlen(line))) {
-            line[last_ch_idx] = ch;
-            continue;
-        }
+    if ((file = mapped_file_from_memory(path, contents, len)) == NULL) {
+        rb_memerror();
+    }
 
-        if (inside_static_def) {
-            if (is_definition_end(line) &&
-                count_prefix_spaces(line) == prefix_len)
-            {
-                restore_ch(line, ch, last_ch_idx);
-                rb_expr = rb_str_new2(expr_start);
+    return file;
+}
 
-                close_map(fd, map, filestat.st_size, data->filename);
-                return rb_expr;
-            } else {
-                line[last_ch_idx] = ch;
-                continue;
-            }
-        } else {
-            should_parse = 1;
-        }
+/*
+ * Turns the line numbers of a method into lines of its script. Code is eval'd
+ * from line 1 unless told otherwise (ERB starts at -1, Rails templates at 0),
+ * and the script doesn't say where it started. So the line is taken as is
+ * while it fits and the code end the iseq knows of lands on an `end` or a
+ * `}` there; otherwise the first line where it does wins.
+ */
+static void
+locate_in_script(struct mapped_file *file, unsigned *lineno, struct code_end *code_end)
+{
+    unsigned span = code_end->lineno != 0 ? code_end->lineno - *lineno : 0;
+    unsigned nlines, first;
 
-        if (should_parse) {
-            line[last_ch_idx] = ch;
-            nulify_ch(line, &next_ch, last_ch_idx + 1);
+    if (mapped_file_index(file) == -1 || span >= (nlines = file->lines.count)) {
+        return;
+    }
+
+    first = *lineno >= 1 && *lineno <= nlines - span ? *lineno : 1;
 
-            if (parse_expr(rb_str_new2(expr_start)) != NULL) {
-                rb_expr = rb_str_new2(expr_start);
-                close_map(fd, map, filestat.st_size, data->filename);
-                return rb_expr;
-            } else {
-                line[last_ch_idx+1] = next_ch;
+    if (code_end->lineno != 0 &&
+        scan_code_end(file, first, first + span, code_end->column) == NULL)
+    {
+        for (unsigned candidate = 1; candidate <= nlines - span; candidate++) {
+            if (scan_code_end(file, candidate, candidate + span, code_end->column) != NULL) {
+                first = candidate;
+                break;
             }
         }
+    }
 
-        line[last_ch_idx] = ch;
+    *lineno = first;
+    if (code_end->lineno != 0) {
+        code_end->lineno = first + span;
     }
-    close_map(fd, map, filestat.st_size, data->filename);
+}
 
-    return source;
+static void *
+index_file_without_gvl(void *ptr)
+{
+    struct index_call *call = ptr;
+
+    call->status = line_index_build(&call->lines, call->file->map, call->file->map_size);
+
+    return NULL;
 }
 
-static VALUE
-read_lines(finder finder, struct method_data *data)
+/*
+ * Indexes the lines of the file. Large files are indexed without the GVL;
+ * the index is installed once the GVL is back, so threads racing to index
+ * the same file never see each other's half-built index.
+ */
+static void
+index_file(struct mapped_file *file)
 {
-    if (finder.comment) {
-        return find_comment_expression(data);
-    } else if (finder.source) {
-        return find_source_expression(data);
+    struct index_call call;
+
+    if (file->has_lines || file->map_size < SCAN_GVL_BUDGET) {
+        if (mapped_file_index(file) == -1) {
+            rb_memerror();
+        }
+        return;
     }
 
-    return Qnil;
+    call.file = file;
+    without_gvl(index_file_without_gvl, &call);
+
+    if (call.status == -1) {
+        rb_memerror();
+    }
+
+    mapped_file_set_index(file, &call.lines);
 }
 
-static NODE *
-parse_with_silenced_stderr(VALUE rb_str)
+static void *
+index_spans_without_gvl(void *ptr)
 {
-    int old_stderr;
-    FILE *null_fd;
-    VALUE last_exception = rb_errinfo();
+    struct spans_call *call = ptr;
 
-    old_stderr = DUP(STDERR_FILENO);
-    fflush(stderr);
-    null_fd = fopen(null_filename, "w");
-    DUP2(fileno(null_fd), STDERR_FILENO);
+    call->status = span_store_fetch(&call->spans, call->file);
 
-    volatile VALUE vparser = rb_parser_new();
-    NODE *node = rb_parser_compile_string(vparser, "-", rb_str, 1);
-    rb_set_errinfo(last_exception);
+    return NULL;
+}
 
-    fflush(stderr);
-    fclose(null_fd);
+/*
+ * Finds the spans of every definition in the file once it's looked up for a
+ * second time: one pass over the file instead of a scan per method. With an
+ * on-disk store, the first lookup already loads or builds the index, since a
+ * later process gets to use it. Files are indexed without the GVL under the
+ * same rules as index_file(). Running out of memory only means going without
+ * the index.
+ *
+ * The :prism engine parses the file on its first lookup instead, and falls
+ * back to the heuristic index when Prism can't be used.
+ */
+static void
+index_spans(struct mapped_file *file)
+{
+    struct spans_call call;
 
-    DUP2(old_stderr, STDERR_FILENO);
-    close(old_stderr);
+    if (file->has_spans) {
+        return;
+    }
 
-    return node;
-}
+    if (prism_engine_enabled() && prism_span_index_build(&call.spans, file) == 0) {
+        mapped_file_set_spans(file, &call.spans);
+        return;
+    }
 
-static NODE *
-parse_expr(VALUE rb_str) {
-    return parse_with_silenced_stderr(rb_str);
+    if (file->lookups < 2 && !span_store_enabled()) {
+        return;
+    }
+
+    call.file = file;
+
+    if (file->map_size < SCAN_GVL_BUDGET) {
+        index_spans_without_gvl(&call);
+    } else {
+        without_gvl(index_spans_without_gvl, &call);
+    }
+
+    if (call.status == 0) {
+        mapped_file_set_spans(file, &call.spans);
+    }
 }
 
-static void
-restore_ch(char *line, char ch, int last_ch_idx)
+static void *
+expr_scan_next_without_gvl(void *ptr)
 {
-    line[last_ch_idx] = ch;
-    line[last_ch_idx + 1] = '\0';
+    struct scan_call *call = ptr;
+
+    call->status = expr_scan_next(call->scan, SCAN_UNLIMITED);
+
+    return NULL;
 }
 
-static void
-close_map(int fd, char *map, size_t map_size, const char *filename)
+/*
+ * Finds the next candidate end of the expression. Most expressions are found
+ * within a few lines, so the scan starts under the GVL and only lets go of it
+ * once it turns out to be long.
+ */
+static enum scan_status
+next_candidate(struct expr_scan *scan)
 {
-    close(fd);
-    if (munmap(map, map_size) == -1) {
-        rb_raise(rb_eIOError, "munmap failed for %s", filename);
+    struct scan_call call;
+    uint64_t started = stats_now();
+
+    call.scan = scan;
+    call.status = expr_scan_next(scan, SCAN_GVL_BUDGET);
+
+    if (call.status == SCAN_SUSPENDED) {
+        without_gvl(expr_scan_next_without_gvl, &call);
     }
+
+    stats_add(STATS_SCAN_NS, stats_now() - started);
+
+    return call.status;
 }
 
 static void
-nulify_ch(char *line, char *ch, int last_ch_idx)
+without_gvl(void *(*func)(void *), void *arg)
 {
-    *ch = line[last_ch_idx];
-    line[last_ch_idx] = '\0';
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(func, arg, NULL, NULL);
+#else
+    func(arg);
+#endif
 }
 
-static size_t
-count_prefix_spaces(const char *line)
+/*
+ * The comment ends where the source begins, so both come out of the mapping
+ * as one slice.
+ */
+static VALUE
+find_comment_and_source_in_file(struct mapped_file *file, unsigned lineno,
+                                const struct code_end *code_end)
 {
-    int i = 0;
-    size_t spaces = 0;
+    const char *expr_end = find_source_end(file, lineno, code_end);
 
-    do {
-        if (line[i] == ' ') {
-            spaces++;
-        } else {
-            break;
-        }
-    } while (line[i++] != '\n');
+    if (expr_end == NULL) {
+        return Qnil;
+    }
+
+    const char *comment_start = scan_comment_start(file, lineno);
 
-    return spaces;
+    return rb_str_new(comment_start, expr_end - comment_start);
 }
 
 static int
-is_definition_end(const char *line)
+finder_kind(finder finder)
 {
-    int i = 0;
+    return (finder.source ? 1 : 0) | (finder.comment ? 2 : 0);
+}
 
-    do {
-        if (line[i] == ' ') {
-            continue;
-        } else if (strncmp((line + i), "end", 3) == 0) {
-            return 1;
-        } else {
-            return 0;
+/*
+ * Looks the lines up in the result cache first, when it's enabled. Cached
+ * results are frozen and shared between callers.
+ */
+static VALUE
+read_lines(finder finder, struct method_data *data)
+{
+    struct file_identity identity;
+    int memoize = result_cache_enabled() && !is_script_path(data->filename) &&
+        file_identity_of(data->filename, &identity) == 0;
+    VALUE result;
+
+    if (memoize) {
+        result = result_cache_get(data->filename, data->method_location,
+                                  finder_kind(finder), &identity);
+        if (result != Qundef) {
+            return result;
         }
-    } while (line[i++] != '\0');
+        data->identity = &identity;
+    }
 
-    return 0;
+    result = find_lines(finder, data);
+
+    if (memoize && !NIL_P(result)) {
+        result_cache_put(data->filename, data->method_location,
+                         finder_kind(finder), &identity, rb_obj_freeze(result));
+    }
+
+    return result;
 }
 
-static int
-contains_end_kw(const char *line)
+/*
+ * Indexing, scanning and slicing can all raise, so the file is released from
+ * an ensure; otherwise it would stay pinned in the cache.
+ */
+static VALUE
+find_lines(finder finder, struct method_data *data)
 {
-    char *match;
-    char prev_ch;
+    struct file_lookup lookup;
 
-    if ((match = strstr(line, "end")) != NULL) {
-        prev_ch = (match - 1)[0];
-        return prev_ch == ' ' || prev_ch == '\0' || prev_ch == ';';
-    } else {
-        return 0;
-    }
+    lookup.finder = finder;
+    lookup.data = data;
+    lookup.file = acquire_method_file(data);
+
+    return rb_ensure(find_lines_in_lookup, (VALUE) &lookup, release_lookup, (VALUE) &lookup);
 }
 
-static int
-is_comment(const char *line, const size_t line_len)
+static VALUE
+find_lines_in_lookup(VALUE arg)
 {
-    for (size_t i = 0; i < line_len; i++) {
-        if (line[i] == ' ')
-            continue;
+    struct file_lookup *lookup = (struct file_lookup *) arg;
+
+    return find_lines_in_file(lookup->finder, lookup->file, lookup->data->method_location,
+                              &lookup->data->code_end);
+}
+
+static VALUE
+release_lookup(VALUE arg)
+{
+    struct file_lookup *lookup = (struct file_lookup *) arg;
+
+    file_cache_release(lookup->file);
+
+    return Qnil;
+}
 
-        return line[i] == '#' && line[i + 1] != '{';
+static VALUE
+find_lines_in_file(finder finder, struct mapped_file *file, unsigned lineno,
+                   const struct code_end *code_end)
+{
+    if (finder.comment && finder.source) {
+        return find_comment_and_source_in_file(file, lineno, code_end);
+    } else if (finder.comment) {
+        return find_comment_in_file(file, lineno);
+    } else if (finder.source) {
+        return find_source_in_file(file, lineno, code_end);
     }
 
-    return 0;
+    return Qnil;
 }
 
 static int
-is_static_definition_start(const char *line)
+compare_batch_entries(const void *a, const void *b)
 {
-    int i = 0;
+    const struct batch_entry *entry_a = a;
+    const struct batch_entry *entry_b = b;
+    int cmp = strcmp(entry_a->filename, entry_b->filename);
+
+    if (cmp != 0) {
+        return cmp;
+    } else if (entry_a->lineno != entry_b->lineno) {
+        return entry_a->lineno < entry_b->lineno ? -1 : 1;
+    }
 
-    do {
-        if (line[i] == ' ') {
-            continue;
-        } else if (strncmp((line + i), "def ", 4) == 0) {
-            return 1;
-        } else if (strncmp((line + i), "class ", 6) == 0) {
-            return 1;
-        } else {
-            return 0;
-        }
-    } while (line[i++] != '\0');
+    return entry_a->index < entry_b->index ? -1 : entry_a->index > entry_b->index;
+}
 
-    return 0;
+static VALUE
+acquire_batch_file(VALUE filename)
+{
+    return (VALUE) file_cache_acquire((const char *) filename);
 }
 
 static void
-raise_if_nil(VALUE val, VALUE method_name)
+store_batch_error(struct batch *batch, struct batch_group *group, VALUE error)
 {
-    if (NIL_P(val)) {
-        if (SYMBOL_P(method_name)) {
-            rb_raise(rb_eSourceNotFoundError, "could not locate source for %s",
-                     RSTRING_PTR(rb_sym2str(method_name)));
-        } else {
-            rb_raise(rb_eSourceNotFoundError, "could not locate source for %s",
-                     RSTRING_PTR(method_name));
+    for (long i = group->from; i < group->to; i++) {
+        long index = batch->entries[i].index;
+
+        if (NIL_P(rb_ary_entry(batch->results, index))) {
+            rb_ary_store(batch->results, index, error);
         }
     }
 }
 
+/*
+ * Maps the file of the group and takes whatever the result cache already
+ * has. Runs under the GVL, before the scan.
+ */
 static void
-method_data_init(VALUE self, struct method_data *data)
+prepare_batch_group(struct batch *batch, struct batch_group *group)
 {
-    VALUE source_location = rb_funcall(self, rb_intern("source_location"), 0);
-    VALUE name = rb_funcall(self, rb_intern("name"), 0);
+    struct span_index spans;
+    int state;
 
-    raise_if_nil(source_location, name);
+    /* Left to read_batch_group_scripts(). */
+    if (is_script_path(batch->entries[group->from].filename)) {
+        group->file = NULL;
+        return;
+    }
 
-    VALUE rb_filename = RARRAY_AREF(source_location, 0);
-    VALUE rb_method_location = RARRAY_AREF(source_location, 1);
+    group->file = (struct mapped_file *)
+        rb_protect(acquire_batch_file, (VALUE) batch->entries[group->from].filename, &state);
 
-    raise_if_nil(rb_filename, name);
-    raise_if_nil(rb_method_location, name);
+    if (state) {
+        group->file = NULL;
+        store_batch_error(batch, group, rb_errinfo());
+        rb_set_errinfo(Qnil);
+        return;
+    }
 
-    data->filename = RSTRING_PTR(rb_filename);
-    data->method_location = FIX2INT(rb_method_location);
-    data->method_name = name;
-}
+    /* Prism needs the GVL, so it can't wait for the workers. */
+    if (prism_engine_enabled() && !group->file->has_spans &&
+        prism_span_index_build(&spans, group->file) == 0)
+    {
+        mapped_file_set_spans(group->file, &spans);
+    }
 
-static VALUE
-mMethodExtensions_source(VALUE self)
-{
-    struct method_data data;
-    method_data_init(self, &data);
+    /* The workers can't safely look at the file itself, so they get a copy. */
+    group->view = *group->file;
+
+    if (!result_cache_enabled()) {
+        return;
+    }
 
-    VALUE source = find_method_source(&data);
-    raise_if_nil(source, data.method_name);
+    for (long i = group->from; i < group->to; i++) {
+        struct batch_entry *entry = &batch->entries[i];
+        VALUE result = result_cache_get(group->file->path, entry->lineno,
+                                        finder_kind(batch->finder), &group->file->identity);
 
-    return source;
+        if (result != Qundef) {
+            entry->resolved = 1;
+            rb_ary_store(batch->results, entry->index, result);
+        }
+    }
 }
 
-static VALUE
-mMethodExtensions_comment(VALUE self)
+/*
+ * Indexes the file of the group and finds the first candidate end and the
+ * comment of each of its methods. Runs without the GVL.
+ */
+static void
+scan_batch_group(struct batch *batch, struct batch_group *group)
+{
+    struct mapped_file *view = &group->view;
+    struct expr_scan scan;
+    size_t line_len;
+
+    if (group->file == NULL) {
+        return;
+    }
+
+    if (!view->has_lines) {
+        if (line_index_build(&group->lines, view->map, view->map_size) == -1) {
+            group->indexed = -1;
+            return;
+        }
+
+        group->indexed = 1;
+        view->lines = group->lines;
+        view->has_lines = 1;
+    }
+
+    /* Worth it as soon as the file has two methods to find. */
+    if (!view->has_spans && (group->to - group->from > 1 || span_store_enabled()) &&
+        span_store_fetch(&group->spans, view) == 0)
+    {
+        group->spanned = 1;
+        view->spans = group->spans;
+        view->has_spans = 1;
+    }
+
+    for (long i = group->from; i < group->to; i++) {
+        struct batch_entry *entry = &batch->entries[i];
+
+        if (entry->resolved ||
+            (entry->start = mapped_file_line(view, entry->lineno, &line_len)) == NULL)
+        {
+            continue;
+        }
+
+        if (batch->finder.source &&
+            (entry->end = find_code_end(view, entry->lineno, &entry->code_end)) != NULL)
+        {
+            entry->status = SCAN_FOUND;
+            entry->confirm = 0;
+        } else if (batch->finder.source) {
+            uint64_t started = stats_now();
+
+            expr_scan_init(&scan, view, entry->lineno);
+            entry->status = expr_scan_next(&scan, SCAN_UNLIMITED);
+            entry->end = scan.end;
+            entry->confirm = scan.confirm;
+
+            stats_add(STATS_SCAN_NS, stats_now() - started);
+            stats_add(STATS_BYTES_SCANNED, scan.bytes_scanned);
+            stats_add(STATS_LINES_WALKED, scan.lines_walked);
+        }
+
+        if (batch->finder.comment) {
+            entry->comment_start = scan_comment_start(view, entry->lineno);
+        }
+    }
+}
+
+static void *
+scan_batch_worker(void *ptr)
+{
+    struct batch *batch = ptr;
+    long i;
+
+    while ((i = __atomic_fetch_add(&batch->next_group, 1, __ATOMIC_RELAXED)) < batch->ngroups) {
+        scan_batch_group(batch, &batch->groups[i]);
+    }
+
+    return NULL;
+}
+
+/*
+ * Spreads the groups over a pool of native threads. The calling thread is a
+ * worker too, so a single thread doesn't spawn anything.
+ */
+static void *
+scan_batch_without_gvl(void *ptr)
+{
+    struct batch *batch = ptr;
+#ifdef HAVE_PTHREAD_CREATE
+    int nthreads = batch->nthreads < batch->ngroups ? batch->nthreads : (int) batch->ngroups;
+    pthread_t *threads = NULL;
+    int spawned = 0;
+
+    if (nthreads > 1 && (threads = malloc(sizeof(pthread_t) * (nthreads - 1))) != NULL) {
+        while (spawned < nthreads - 1 &&
+               pthread_create(&threads[spawned], NULL, scan_batch_worker, batch) == 0)
+        {
+            spawned++;
+        }
+    }
+#endif
+
+    scan_batch_worker(batch);
+
+#ifdef HAVE_PTHREAD_CREATE
+    for (int i = 0; i < spawned; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+#endif
+
+    return NULL;
+}
+
+/*
+ * Turns the candidates of the scan into a String. A candidate the parser
+ * rejects is rare enough to scan that method again from the start.
+ */
+static VALUE
+resolve_batch_entry(struct batch *batch, struct batch_group *group, struct batch_entry *entry)
+{
+    const char *start = entry->start;
+    const char *end = entry->start;
+
+    if (start == NULL) {
+        return Qnil;
+    }
+
+    if (batch->finder.source) {
+        if (entry->status != SCAN_FOUND) {
+            return Qnil;
+        }
+
+        end = entry->end;
+        if (!entry->confirm) {
+            stats_add_parse_attempts(0);
+        } else if (confirm_candidate(entry->start, entry->end)) {
+            stats_add_parse_attempts(1);
+        } else {
+            end = find_source_end(group->file, entry->lineno, NULL);
+        }
+
+        if (end == NULL) {
+            return Qnil;
+        }
+    }
+
+    if (batch->finder.comment) {
+        start = entry->comment_start;
+    }
+
+    return rb_str_new(start, end - start);
+}
+
+static VALUE
+resolve_batch_group(VALUE arg)
+{
+    struct batch_group_call *call = (struct batch_group_call *) arg;
+    struct batch *batch = call->batch;
+    struct batch_group *group = call->group;
+
+    if (group->indexed == 1) {
+        mapped_file_set_index(group->file, &group->lines);
+    }
+
+    if (group->spanned) {
+        mapped_file_set_spans(group->file, &group->spans);
+    }
+
+    for (long i = group->from; i < group->to; i++) {
+        struct batch_entry *entry = &batch->entries[i];
+        VALUE result;
+
+        if (entry->resolved) {
+            continue;
+        }
+
+        if (group->indexed == -1) {
+            result = find_lines_in_file(batch->finder, group->file, entry->lineno,
+                                        &entry->code_end);
+        } else {
+            result = resolve_batch_entry(batch, group, entry);
+        }
+
+        if (result_cache_enabled() && !NIL_P(result)) {
+            result_cache_put(group->file->path, entry->lineno, finder_kind(batch->finder),
+                             &group->file->identity, rb_obj_freeze(result));
+        }
+
+        rb_ary_store(batch->results, entry->index, result);
+    }
+
+    return Qnil;
+}
+
+/*
+ * A group without a file may be eval'd code whose lines Ruby kept. Its
+ * methods are looked up one at a time, like #source would, and take the
+ * place of the error the file left.
+ */
+static void
+read_batch_group_scripts(struct batch *batch, struct batch_group *group)
+{
+    for (long i = group->from; i < group->to; i++) {
+        long index = batch->entries[i].index;
+        struct script_lookup lookup;
+        VALUE result;
+        int state;
+
+        lookup.finder = batch->finder;
+        lookup.method = RARRAY_AREF(batch->methods, index);
+
+        if (NIL_P(script_lines_of(lookup.method))) {
+            continue;
+        }
+
+        result = rb_protect(read_script_lookup, (VALUE) &lookup, &state);
+
+        if (state) {
+            result = rb_errinfo();
+            rb_set_errinfo(Qnil);
+        }
+
+        rb_ary_store(batch->results, index, result);
+    }
+}
+
+static VALUE
+read_script_lookup(VALUE arg)
+{
+    struct script_lookup *lookup = (struct script_lookup *) arg;
+    struct method_data data;
+
+    method_data_init(lookup->method, &data);
+
+    return read_lines(lookup->finder, &data);
+}
+
+/*
+ * Parses the candidates of the group and builds the results. Runs under the
+ * GVL, after the scan. Exceptions are stored as the results of the entries
+ * they hit.
+ */
+static void
+finish_batch_group(struct batch *batch, struct batch_group *group)
+{
+    struct batch_group_call call;
+    int state;
+
+    if (group->file == NULL) {
+        read_batch_group_scripts(batch, group);
+        return;
+    }
+
+    call.batch = batch;
+    call.group = group;
+    rb_protect(resolve_batch_group, (VALUE) &call, &state);
+
+    file_cache_release(group->file);
+
+    if (state) {
+        store_batch_error(batch, group, rb_errinfo());
+        rb_set_errinfo(Qnil);
+    }
+}
+
+/*
+ * Looks up every method of the array, visiting each file once and its
+ * methods in the order they appear in it. Files are indexed and scanned
+ * without the GVL by +nthreads+ native threads; only the parser runs under
+ * it. Returns an array of results in the order of +methods+. Methods that
+ * can't be looked up get an exception instead of a String.
+ */
+static VALUE
+read_lines_in_batch(finder finder, VALUE methods, int nthreads)
+{
+    long count = RARRAY_LEN(methods);
+    struct batch batch;
+
+    MEMZERO(&batch, struct batch, 1);
+    batch.finder = finder;
+    batch.methods = methods;
+    batch.results = rb_ary_new_capa(count);
+    batch.filenames = rb_ary_new_capa(count);
+    batch.count = count;
+    batch.nthreads = nthreads;
+
+    /*
+     * Both are allocated here, with room for a group per method, so that
+     * they're still there for end_batch() after run_batch() raised.
+     */
+    batch.entries = ALLOCV_N(struct batch_entry, batch.entries_buf, count);
+    batch.groups = ALLOCV_N(struct batch_group, batch.groups_buf, count);
+
+    rb_ensure(run_batch, (VALUE) &batch, end_batch, (VALUE) &batch);
+
+    RB_GC_GUARD(batch.filenames);
+
+    return batch.results;
+}
+
+static VALUE
+run_batch(VALUE arg)
+{
+    struct batch *batch = (struct batch *) arg;
+    struct batch_entry *entries = batch->entries;
+    long located = 0;
+
+    for (long i = 0; i < batch->count; i++) {
+        struct batch_entry *entry = &entries[located];
+        VALUE filename;
+
+        rb_ary_store(batch->results, i, Qnil);
+        MEMZERO(entry, struct batch_entry, 1);
+
+        if (method_location(RARRAY_AREF(batch->methods, i), &filename, &entry->lineno,
+                            &entry->code_end) == -1)
+        {
+            continue;
+        }
+
+        rb_ary_push(batch->filenames, filename);
+        entry->index = i;
+        entry->filename = StringValueCStr(filename);
+        located++;
+    }
+
+    qsort(entries, located, sizeof(struct batch_entry), compare_batch_entries);
+
+    for (long from = 0, to; from < located; from = to) {
+        struct batch_group *group = &batch->groups[batch->ngroups++];
+
+        for (to = from + 1; to < located; to++) {
+            if (strcmp(entries[to].filename, entries[from].filename) != 0) {
+                break;
+            }
+        }
+
+        MEMZERO(group, struct batch_group, 1);
+        group->from = from;
+        group->to = to;
+        prepare_batch_group(batch, group);
+    }
+
+    if (batch->ngroups > 0) {
+        without_gvl(scan_batch_without_gvl, batch);
+    }
+
+    while (batch->finished < batch->ngroups) {
+        finish_batch_group(batch, &batch->groups[batch->finished++]);
+    }
+
+    for (long i = 0; i < batch->count; i++) {
+        if (NIL_P(RARRAY_AREF(batch->results, i))) {
+            rb_ary_store(batch->results, i,
+                         source_not_found_error(RARRAY_AREF(batch->methods, i)));
+        }
+    }
+
+    return Qnil;
+}
+
+/*
+ * Anything from locating the methods to waking up after the workers can
+ * raise. The groups that weren't finished by then still hold their file and
+ * whatever the workers built for it; the buffers go either way.
+ */
+static VALUE
+end_batch(VALUE arg)
+{
+    struct batch *batch = (struct batch *) arg;
+
+    for (long i = batch->finished; i < batch->ngroups; i++) {
+        struct batch_group *group = &batch->groups[i];
+
+        if (group->file == NULL) {
+            continue;
+        }
+
+        if (group->indexed == 1) {
+            line_index_free(&group->lines);
+        }
+
+        if (group->spanned) {
+            span_index_free(&group->spans);
+        }
+
+        file_cache_release(group->file);
+    }
+
+    batch->finished = batch->ngroups;
+
+    ALLOCV_END(batch->groups_buf);
+    ALLOCV_END(batch->entries_buf);
+
+    return Qnil;
+}
+
+#ifdef HAVE_RB_PARSER_SET_CONTEXT
+/*
+ * Tells whether the code parses. The parser collects syntax errors into an
+ * exception instead of printing them and $VERBOSE is lowered to keep warnings
+ * quiet, so nothing is written to stderr and no file descriptors change
+ * hands. A parser can't be reused after it compiled something, hence a new
+ * one per call.
+ */
+static int
+parse_expr(const char *src, size_t len)
+{
+    VALUE last_exception = rb_errinfo();
+    VALUE verbose = ruby_verbose;
+    volatile VALUE vparser = rb_parser_new();
+    void *ast;
+    int parsed;
+
+    rb_parser_set_context(vparser, NULL, 0);
+
+    ruby_verbose = Qnil;
+    rb_set_errinfo(Qnil);
+
+    ast = rb_parser_compile_string_path(vparser, parse_filename, rb_str_new(src, len), 1);
+    parsed = NIL_P(rb_errinfo());
+
+    rb_set_errinfo(last_exception);
+    ruby_verbose = verbose;
+
+#ifdef HAVE_RB_AST_DISPOSE
+    rb_ast_dispose(ast);
+#endif
+    RB_GC_GUARD(vparser);
+
+    return parsed;
+}
+#else
+static NODE *
+parse_with_silenced_stderr(VALUE rb_str)
+{
+    int old_stderr;
+    FILE *null_fd;
+    VALUE last_exception = rb_errinfo();
+
+    old_stderr = DUP(STDERR_FILENO);
+    fflush(stderr);
+    null_fd = fopen(null_filename, "w");
+    DUP2(fileno(null_fd), STDERR_FILENO);
+
+    volatile VALUE vparser = rb_parser_new();
+    NODE *node = rb_parser_compile_string(vparser, "-", rb_str, 1);
+    rb_set_errinfo(last_exception);
+
+    fflush(stderr);
+    fclose(null_fd);
+
+    DUP2(old_stderr, STDERR_FILENO);
+    close(old_stderr);
+
+    return node;
+}
+
+static int
+parse_expr(const char *src, size_t len)
+{
+    return parse_with_silenced_stderr(rb_str_new(src, len)) != NULL;
+}
+#endif
+
+/* parse_expr() on a candidate, timed and traced. */
+static int
+confirm_candidate(const char *start, const char *end)
+{
+    uint64_t started = stats_now();
+    size_t len = end - start;
+    int parsed;
+
+    PROBE_PARSE_ENTRY(start, len);
+    parsed = parse_expr(start, len);
+    PROBE_PARSE_RETURN(len, parsed);
+
+    stats_add(STATS_PARSE_NS, stats_now() - started);
+
+    return parsed;
+}
+
+static void
+raise_if_nil(VALUE val, VALUE method)
+{
+    if (NIL_P(val)) {
+        rb_exc_raise(source_not_found_error(method));
+    }
+}
+
+static VALUE
+source_not_found_error(VALUE method)
+{
+    VALUE name;
+
+    if (rb_respond_to(method, id_name)) {
+        name = rb_funcall(method, id_name, 0);
+    } else {
+        name = rb_inspect(method);
+    }
+
+    if (SYMBOL_P(name)) {
+        name = rb_sym2str(name);
+    }
+
+    return rb_exc_new_str(rb_eSourceNotFoundError,
+                          rb_sprintf("could not locate source for %"PRIsVALUE, name));
+}
+
+static void
+method_data_init(VALUE method, struct method_data *data)
+{
+    if (method_location(method, &data->path, &data->method_location, &data->code_end) == -1) {
+        rb_exc_raise(source_not_found_error(method));
+    }
+
+    data->filename = StringValueCStr(data->path);
+    data->method = method;
+    data->identity = NULL;
+}
+
+static VALUE
+mMethodExtensions_source(VALUE self)
+{
+    finder finder = {1, 0};
+    return probed_lookup(finder, self);
+}
+
+static VALUE
+mMethodExtensions_comment(VALUE self)
+{
+    finder finder = {0, 1};
+    return probed_lookup(finder, self);
+}
+
+static VALUE
+mMethodExtensions_comment_and_source(VALUE self)
+{
+    finder finder = {1, 1};
+    return probed_lookup(finder, self);
+}
+
+/*
+ * Fires the entry probe of the lookup, runs it and fires the return probe
+ * from an ensure, so that a lookup that raises still returns, as not found.
+ */
+static VALUE
+probed_lookup(finder finder, VALUE method)
+{
+    struct probed_lookup lookup;
+
+    lookup.finder = finder;
+    lookup.result = Qnil;
+    method_data_init(method, &lookup.data);
+
+    if (finder.comment && finder.source) {
+        PROBE_COMMENT_AND_SOURCE_ENTRY(lookup.data.filename, lookup.data.method_location);
+    } else if (finder.comment) {
+        PROBE_COMMENT_ENTRY(lookup.data.filename, lookup.data.method_location);
+    } else {
+        PROBE_SOURCE_ENTRY(lookup.data.filename, lookup.data.method_location);
+    }
+
+    rb_ensure(run_probed_lookup, (VALUE) &lookup, fire_return_probe, (VALUE) &lookup);
+    raise_if_nil(lookup.result, method);
+
+    return lookup.result;
+}
+
+static VALUE
+run_probed_lookup(VALUE arg)
+{
+    struct probed_lookup *lookup = (struct probed_lookup *) arg;
+
+    lookup->result = read_lines(lookup->finder, &lookup->data);
+
+    return Qnil;
+}
+
+static VALUE
+fire_return_probe(VALUE arg)
+{
+    struct probed_lookup *lookup = (struct probed_lookup *) arg;
+    struct method_data *data = &lookup->data;
+
+    if (lookup->finder.comment && lookup->finder.source) {
+        PROBE_COMMENT_AND_SOURCE_RETURN(data->filename, data->method_location,
+                                        !NIL_P(lookup->result));
+    } else if (lookup->finder.comment) {
+        PROBE_COMMENT_RETURN(data->filename, data->method_location, !NIL_P(lookup->result));
+    } else {
+        PROBE_SOURCE_RETURN(data->filename, data->method_location, !NIL_P(lookup->result));
+    }
+
+    return Qnil;
+}
+
+/*
+ * The module-level lookups take any object with a #source_location and go
+ * straight to it, without wrapping it first.
+ */
+static VALUE
+mFastMethodSource_source_for(VALUE self, VALUE method)
+{
+    return mMethodExtensions_source(method);
+}
+
+static VALUE
+mFastMethodSource_comment_for(VALUE self, VALUE method)
+{
+    return mMethodExtensions_comment(method);
+}
+
+static VALUE
+mFastMethodSource_comment_and_source_for(VALUE self, VALUE method)
+{
+    return mMethodExtensions_comment_and_source(method);
+}
+
+static VALUE
+mFastMethodSource_sources_for(int argc, VALUE *argv, VALUE self)
+{
+    finder finder = {1, 0};
+    VALUE methods, opts, threads = Qundef;
+    int nthreads = 1;
+    struct probed_batch batch;
+
+    rb_scan_args(argc, argv, "1:", &methods, &opts);
+    Check_Type(methods, T_ARRAY);
+
+    if (!NIL_P(opts)) {
+        ID keywords[1];
+
+        keywords[0] = id_threads;
+        rb_get_kwargs(opts, keywords, 0, 1, &threads);
+    }
+
+    if (threads != Qundef) {
+        nthreads = NUM2INT(threads);
+
+        if (nthreads < 1) {
+            rb_raise(rb_eArgError, "threads must be positive");
+        }
+    }
+
+    batch.finder = finder;
+    batch.methods = methods;
+    batch.nthreads = nthreads;
+    batch.results = Qnil;
+    PROBE_BATCH_ENTRY(RARRAY_LEN(methods));
+
+    rb_ensure(run_probed_batch, (VALUE) &batch, fire_batch_return_probe, (VALUE) &batch);
+
+    return batch.results;
+}
+
+static VALUE
+run_probed_batch(VALUE arg)
+{
+    struct probed_batch *batch = (struct probed_batch *) arg;
+
+    batch->results = read_lines_in_batch(batch->finder, batch->methods, batch->nthreads);
+
+    return Qnil;
+}
+
+static VALUE
+fire_batch_return_probe(VALUE arg)
+{
+    struct probed_batch *batch = (struct probed_batch *) arg;
+
+    PROBE_BATCH_RETURN(RARRAY_LEN(batch->methods), count_found(batch->results));
+
+    return Qnil;
+}
+
+/* The number of sources found by a batch, or 0 if it raised. */
+static long
+count_found(VALUE results)
+{
+    long found = 0;
+
+    if (NIL_P(results)) {
+        return 0;
+    }
+
+    for (long i = 0; i < RARRAY_LEN(results); i++) {
+        if (RB_TYPE_P(RARRAY_AREF(results, i), T_STRING)) {
+            found++;
+        }
+    }
+
+    return found;
+}
+
+static VALUE
+mFastMethodSource_max_mapped_files(VALUE self)
+{
+    return SIZET2NUM(file_cache_capacity());
+}
+
+static VALUE
+mFastMethodSource_set_max_mapped_files(VALUE self, VALUE max)
+{
+    long capacity = NUM2LONG(max);
+
+    if (capacity < 0) {
+        rb_raise(rb_eArgError, "max_mapped_files must not be negative");
+    }
+
+    file_cache_set_capacity((size_t) capacity);
+
+    return max;
+}
+
+static VALUE
+mFastMethodSource_map_threshold(VALUE self)
+{
+    return SIZET2NUM(file_cache_map_threshold());
+}
+
+static VALUE
+mFastMethodSource_set_map_threshold(VALUE self, VALUE threshold)
+{
+    long bytes = NUM2LONG(threshold);
+
+    if (bytes < 0) {
+        rb_raise(rb_eArgError, "map_threshold must not be negative");
+    }
+
+    file_cache_set_map_threshold((size_t) bytes);
+
+    return threshold;
+}
+
+static VALUE
+mFastMethodSource_readahead_threshold(VALUE self)
+{
+    return SIZET2NUM(file_cache_readahead_threshold());
+}
+
+static VALUE
+mFastMethodSource_set_readahead_threshold(VALUE self, VALUE threshold)
+{
+    long bytes = NUM2LONG(threshold);
+
+    if (bytes < 0) {
+        rb_raise(rb_eArgError, "readahead_threshold must not be negative");
+    }
+
+    file_cache_set_readahead_threshold((size_t) bytes);
+
+    return threshold;
+}
+
+static VALUE
+mFastMethodSource_syscall_count(VALUE self)
+{
+    return ULONG2NUM(file_cache_syscalls());
+}
+
+static VALUE
+mFastMethodSource_max_cache_bytes(VALUE self)
+{
+    return SIZET2NUM(result_cache_budget());
+}
+
+static VALUE
+mFastMethodSource_set_max_cache_bytes(VALUE self, VALUE max)
+{
+    long budget = NUM2LONG(max);
+
+    if (budget < 0) {
+        rb_raise(rb_eArgError, "max_cache_bytes must not be negative");
+    }
+
+    result_cache_set_budget((size_t) budget);
+
+    return max;
+}
+
+static VALUE
+mFastMethodSource_cache_bytes(VALUE self)
+{
+    return SIZET2NUM(result_cache_bytes());
+}
+
+static VALUE
+mFastMethodSource_clear_cache(VALUE self)
+{
+    result_cache_clear();
+
+    return Qnil;
+}
+
+static VALUE
+mFastMethodSource_span_cache_dir(VALUE self)
+{
+    char *dir = span_store_directory();
+    VALUE rb_dir;
+
+    if (dir == NULL) {
+        return Qnil;
+    }
+
+    rb_dir = rb_str_new_cstr(dir);
+    free(dir);
+
+    return rb_dir;
+}
+
+static VALUE
+mFastMethodSource_set_span_cache_dir(VALUE self, VALUE dir)
+{
+    VALUE expanded = Qnil;
+
+    if (!NIL_P(dir)) {
+        FilePathValue(dir);
+        expanded = rb_file_expand_path(dir, Qnil);
+    }
+
+    if (span_store_set_directory(NIL_P(expanded) ? NULL : StringValueCStr(expanded)) == -1) {
+        rb_memerror();
+    }
+
+    return dir;
+}
+
+static VALUE
+mFastMethodSource_engine(VALUE self)
+{
+    return ID2SYM(rb_intern(prism_engine_enabled() ? "prism" : "heuristic"));
+}
+
+/*
+ * Switching engines drops the mappings and results of the current one, so
+ * that no lookup mixes the two.
+ */
+static VALUE
+mFastMethodSource_set_engine(VALUE self, VALUE engine)
+{
+    int prism;
+
+    if (engine == ID2SYM(rb_intern("prism"))) {
+        rb_const_get(self, rb_intern("PrismEngine"));
+        prism = 1;
+    } else if (engine == ID2SYM(rb_intern("heuristic"))) {
+        prism = 0;
+    } else {
+        rb_raise(rb_eArgError, "unknown engine: %"PRIsVALUE, rb_inspect(engine));
+    }
+
+    if (prism != prism_engine_enabled()) {
+        prism_engine_set_enabled(prism);
+        file_cache_clear();
+        result_cache_clear();
+    }
+
+    return engine;
+}
+
+/*
+ * The counters since the last reset, summed over all threads. Times are in
+ * seconds, and parse attempts are bucketed by their lower bound.
+ */
+static VALUE
+mFastMethodSource_stats(VALUE self)
+{
+    static const char *const names[] = {
+        "files_opened", "files_mapped", "files_read", "file_cache_hits",
+        "file_cache_misses", "result_cache_hits", "result_cache_misses",
+        "bytes_scanned", "lines_walked", "scan_time", "parse_time",
+        "fast_path_hits", "fast_path_fallbacks", "prism_fallbacks",
+        "line_scan_fallbacks", "files_warmed", "warm_dropped"
+    };
+    static const int bucket_floors[] = {0, 1, 2, 3, 4, 8, 16};
+    unsigned long totals[STATS_COUNTERS];
+    VALUE stats = rb_hash_new();
+    VALUE attempts = rb_hash_new();
+
+    stats_read(totals);
+
+    for (int i = 0; i < STATS_PARSE_ATTEMPTS; i++) {
+        VALUE value = ULONG2NUM(totals[i]);
+
+        if (i == STATS_SCAN_NS || i == STATS_PARSE_NS) {
+            value = DBL2NUM(totals[i] / 1e9);
+        }
+
+        rb_hash_aset(stats, ID2SYM(rb_intern(names[i])), value);
+    }
+
+    for (int i = 0; i <= STATS_PARSE_ATTEMPTS_LAST - STATS_PARSE_ATTEMPTS; i++) {
+        rb_hash_aset(attempts, INT2FIX(bucket_floors[i]),
+                     ULONG2NUM(totals[STATS_PARSE_ATTEMPTS + i]));
+    }
+
+    rb_hash_aset(stats, ID2SYM(rb_intern("parse_attempts")), attempts);
+
+    return stats;
+}
+
+static VALUE
+mFastMethodSource_reset_stats(VALUE self)
+{
+    stats_reset();
+
+    return Qnil;
+}
+
+/*
+ * Queues a file for the warming thread. Returns false when it's dropped.
+ */
+static VALUE
+mFastMethodSource_warm_file(VALUE self, VALUE path)
+{
+    FilePathValue(path);
+
+    return warmer_enqueue(StringValueCStr(path)) == 0 ? Qtrue : Qfalse;
+}
+
+/*
+ * Finds the method like #comment_and_source does, but keeps only the
+ * offsets. No String is made apart from the path.
+ */
+static VALUE
+mFastMethodSource_locate(VALUE self, VALUE method)
+{
+    struct probed_locate locate;
+
+    if (method_location(method, &locate.path, &locate.lineno, &locate.code_end) == -1) {
+        rb_exc_raise(source_not_found_error(method));
+    }
+
+    locate.method = method;
+    locate.ref = Qnil;
+    PROBE_LOCATE_ENTRY(StringValueCStr(locate.path), locate.lineno);
+
+    rb_ensure(run_probed_locate, (VALUE) &locate, fire_locate_return_probe, (VALUE) &locate);
+
+    return locate.ref;
+}
+
+static VALUE
+run_probed_locate(VALUE arg)
+{
+    struct probed_locate *locate = (struct probed_locate *) arg;
+
+    locate->ref = locate_source(locate->method, locate->path, locate->lineno,
+                                &locate->code_end);
+
+    return Qnil;
+}
+
+static VALUE
+fire_locate_return_probe(VALUE arg)
+{
+    struct probed_locate *locate = (struct probed_locate *) arg;
+
+    PROBE_LOCATE_RETURN(RSTRING_PTR(locate->path), locate->lineno, !NIL_P(locate->ref));
+
+    return Qnil;
+}
+
+/*
+ * Eval'd code has no file for the reference to go back to, so the reference
+ * keeps the text of its script instead.
+ */
+static VALUE
+locate_source(VALUE method, VALUE rb_filename, unsigned lineno, const struct code_end *code_end)
+{
+    struct method_data data;
+    struct file_lookup lookup;
+
+    data.method = method;
+    data.path = OBJ_FROZEN(rb_filename) ? rb_filename : rb_obj_freeze(rb_str_dup(rb_filename));
+    data.filename = StringValueCStr(data.path);
+    data.method_location = lineno;
+    data.code_end = *code_end;
+    data.identity = NULL;
+
+    lookup.data = &data;
+    lookup.file = acquire_method_file(&data);
+
+    return rb_ensure(make_source_ref, (VALUE) &lookup, release_lookup, (VALUE) &lookup);
+}
+
+static VALUE
+make_source_ref(VALUE arg)
+{
+    struct file_lookup *lookup = (struct file_lookup *) arg;
+    struct method_data *data = lookup->data;
+    struct mapped_file *file = lookup->file;
+    struct source_ref *ref;
+    const char *start, *end;
+    size_t line_len;
+    VALUE obj;
+
+    if ((end = find_source_end(file, data->method_location, &data->code_end)) == NULL) {
+        rb_exc_raise(source_not_found_error(data->method));
+    }
+
+    obj = TypedData_Make_Struct(rb_cSourceRef, struct source_ref, &source_ref_type, ref);
+    start = mapped_file_line(file, data->method_location, &line_len);
+    ref->path = data->path;
+    ref->script = file->in_memory ? mapped_file_contents(file) : Qnil;
+    ref->identity = file->identity;
+    ref->start_line = data->method_location;
+    ref->end_line = line_index_lineno(&file->lines, end - file->map - 1);
+    ref->start_byte = start - file->map;
+    ref->end_byte = end - file->map;
+    ref->comment_start = scan_comment_start(file, data->method_location) - file->map;
+
+    return rb_obj_freeze(obj);
+}
+
+/*
+ * Yields the method, source and comment of each of +methods+, which all live
+ * in the file at +path+, and drops the mapping of the file once it's done,
+ * even when the block breaks out, unless the file was cached before. Failed
+ * lookups yield the exception in place of the source, like sources_for does.
+ * Eval'd methods, and those of a file that can't be read, are looked up one
+ * by one, so that each gets the script lines Ruby kept of it.
+ */
+static VALUE
+mFastMethodSource_each_source_in_file(VALUE self, VALUE path, VALUE methods)
+{
+    struct file_sources_call call;
+    int state;
+
+    FilePathValue(path);
+    Check_Type(methods, T_ARRAY);
+
+    if (is_script_path(StringValueCStr(path))) {
+        return yield_script_sources(methods);
+    }
+
+    call.path = path;
+    call.methods = methods;
+    call.file = (struct mapped_file *)
+        rb_protect(acquire_batch_file, (VALUE) StringValueCStr(path), &state);
+
+    if (state) {
+        rb_set_errinfo(Qnil);
+        return yield_script_sources(methods);
+    }
+
+    call.opened = call.file->lookups == 1;
+
+    return rb_ensure(yield_file_sources, (VALUE) &call, forget_file, (VALUE) &call);
+}
+
+/*
+ * The lookups happen under rb_protect() and the yields outside of it, so that
+ * a block can still break out.
+ */
+static VALUE
+yield_script_sources(VALUE methods)
+{
+    for (long i = 0; i < RARRAY_LEN(methods); i++) {
+        VALUE method = RARRAY_AREF(methods, i);
+        VALUE found;
+        int state;
+
+        found = rb_protect(find_script_source, method, &state);
+
+        if (state) {
+            VALUE error = rb_errinfo();
+
+            rb_set_errinfo(Qnil);
+            rb_yield_values(3, method, error, Qnil);
+        } else if (NIL_P(found)) {
+            rb_yield_values(3, method, source_not_found_error(method), Qnil);
+        } else {
+            rb_yield_values(3, method, RARRAY_AREF(found, 0), RARRAY_AREF(found, 1));
+        }
+    }
+
+    return Qnil;
+}
+
+/* Returns [source, comment] of +method+, or nil. */
+static VALUE
+find_script_source(VALUE method)
 {
     struct method_data data;
-    method_data_init(self, &data);
+    struct file_lookup lookup;
+
+    method_data_init(method, &data);
+    lookup.data = &data;
+    lookup.file = acquire_method_file(&data);
+
+    return rb_ensure(slice_script_source, (VALUE) &lookup, release_lookup, (VALUE) &lookup);
+}
+
+static VALUE
+slice_script_source(VALUE arg)
+{
+    struct file_lookup *lookup = (struct file_lookup *) arg;
+
+    return source_and_comment_in_file(lookup->file, lookup->data->method_location,
+                                      &lookup->data->code_end);
+}
+
+/* Returns [source, comment] of the method at +lineno+, or nil. */
+static VALUE
+source_and_comment_in_file(struct mapped_file *file, unsigned lineno,
+                           const struct code_end *code_end)
+{
+    const char *start, *end, *comment_start;
+    size_t line_len;
+
+    if ((end = find_source_end(file, lineno, code_end)) == NULL) {
+        return Qnil;
+    }
+
+    start = mapped_file_line(file, lineno, &line_len);
+    comment_start = scan_comment_start(file, lineno);
+
+    return rb_assoc_new(rb_str_new(start, end - start),
+                        rb_str_new(comment_start, start - comment_start));
+}
+
+static VALUE
+yield_file_sources(VALUE arg)
+{
+    struct file_sources_call *call = (struct file_sources_call *) arg;
+    struct mapped_file *file = call->file;
+
+    for (long i = 0; i < RARRAY_LEN(call->methods); i++) {
+        VALUE method = RARRAY_AREF(call->methods, i);
+        struct code_end code_end;
+        unsigned lineno;
+        VALUE path, found;
+
+        if (method_location(method, &path, &lineno, &code_end) == -1 ||
+            NIL_P(found = source_and_comment_in_file(file, lineno, &code_end)))
+        {
+            rb_yield_values(3, method, source_not_found_error(method), Qnil);
+            continue;
+        }
+
+        rb_yield_values(3, method, RARRAY_AREF(found, 0), RARRAY_AREF(found, 1));
+    }
+
+    return Qnil;
+}
+
+static VALUE
+forget_file(VALUE arg)
+{
+    struct file_sources_call *call = (struct file_sources_call *) arg;
+
+    file_cache_release(call->file);
+
+    /* Files that were already cached stay, for the lookups that made them hot. */
+    if (call->opened) {
+        file_cache_forget(StringValueCStr(call->path));
+    }
+
+    return Qnil;
+}
+
+static void
+source_ref_mark(void *ptr)
+{
+    struct source_ref *ref = ptr;
+
+    rb_gc_mark(ref->path);
+    rb_gc_mark(ref->script);
+}
+
+static size_t
+source_ref_memsize(const void *ptr)
+{
+    return sizeof(struct source_ref);
+}
 
-    VALUE comment = find_method_comment(&data);
-    raise_if_nil(comment, data.method_name);
+static struct source_ref *
+get_source_ref(VALUE self)
+{
+    struct source_ref *ref;
+
+    TypedData_Get_Struct(self, struct source_ref, &source_ref_type, ref);
+
+    return ref;
+}
+
+/*
+ * Returns bytes +from+...+to+ of the file the method was found in. The file
+ * must still be the one it was found in; offsets into any other version of
+ * it would be meaningless.
+ */
+static VALUE
+source_ref_slice(VALUE self, size_t from, size_t to)
+{
+    struct source_ref *ref = get_source_ref(self);
+    struct file_lookup lookup;
+
+    if (!NIL_P(ref->script)) {
+        return rb_str_subseq(ref->script, from, to - from);
+    }
+
+    lookup.file = file_cache_acquire(RSTRING_PTR(ref->path));
+    lookup.from = from;
+    lookup.to = to;
+
+    if (!file_identity_equal(&lookup.file->identity, &ref->identity)) {
+        file_cache_release(lookup.file);
+        rb_raise(rb_eSourceNotFoundError, "%"PRIsVALUE" changed since the method was located",
+                 ref->path);
+    }
+
+    return rb_ensure(slice_lookup, (VALUE) &lookup, release_lookup, (VALUE) &lookup);
+}
+
+static VALUE
+slice_lookup(VALUE arg)
+{
+    struct file_lookup *lookup = (struct file_lookup *) arg;
+    struct mapped_file *file = lookup->file;
+
+    return rb_str_new(file->map + lookup->from, lookup->to - lookup->from);
+}
+
+static VALUE
+cSourceRef_path(VALUE self)
+{
+    return get_source_ref(self)->path;
+}
+
+static VALUE
+cSourceRef_start_line(VALUE self)
+{
+    return UINT2NUM(get_source_ref(self)->start_line);
+}
+
+static VALUE
+cSourceRef_end_line(VALUE self)
+{
+    return UINT2NUM(get_source_ref(self)->end_line);
+}
+
+static VALUE
+cSourceRef_byte_range(VALUE self)
+{
+    struct source_ref *ref = get_source_ref(self);
+
+    return rb_range_new(SIZET2NUM(ref->start_byte), SIZET2NUM(ref->end_byte), 1);
+}
+
+static VALUE
+cSourceRef_comment_range(VALUE self)
+{
+    struct source_ref *ref = get_source_ref(self);
+
+    return rb_range_new(SIZET2NUM(ref->comment_start), SIZET2NUM(ref->start_byte), 1);
+}
+
+static VALUE
+cSourceRef_source(VALUE self)
+{
+    struct source_ref *ref = get_source_ref(self);
+
+    return source_ref_slice(self, ref->start_byte, ref->end_byte);
+}
+
+static VALUE
+cSourceRef_comment(VALUE self)
+{
+    struct source_ref *ref = get_source_ref(self);
+
+    return source_ref_slice(self, ref->comment_start, ref->start_byte);
+}
+
+static VALUE
+cSourceRef_comment_and_source(VALUE self)
+{
+    struct source_ref *ref = get_source_ref(self);
 
-    return comment;
+    return source_ref_slice(self, ref->comment_start, ref->end_byte);
 }
 
 void Init_fast_method_source(void)
 {
+    /*
+     * Mappings are shared under a lock, results are cached per Ractor and
+     * parsing doesn't touch process-wide state. The legacy parser path
+     * redirects stderr, which isn't safe to do from several Ractors.
+     */
+#if defined(HAVE_RB_EXT_RACTOR_SAFE) && defined(HAVE_RB_PARSER_SET_CONTEXT)
+    rb_ext_ractor_safe(true);
+#endif
+
     VALUE rb_mFastMethodSource = rb_define_module_under(rb_cObject, "FastMethodSource");
 
+#ifdef HAVE_RB_PARSER_SET_CONTEXT
+    parse_filename = rb_obj_freeze(rb_str_new_cstr("-"));
+    rb_gc_register_mark_object(parse_filename);
+#endif
+
+    id_source_location = rb_intern("source_location");
+    id_name = rb_intern("name");
+    id_threads = rb_intern("threads");
+    id_of = rb_intern("of");
+    id_script_lines = rb_intern("script_lines");
+
+    if (rb_const_defined(rb_cObject, rb_intern("RubyVM"))) {
+        VALUE rb_cRubyVM = rb_const_get(rb_cObject, rb_intern("RubyVM"));
+
+        if (rb_const_defined(rb_cRubyVM, rb_intern("InstructionSequence"))) {
+            rb_cISeq = rb_const_get(rb_cRubyVM, rb_intern("InstructionSequence"));
+        }
+    }
+
+    stats_init();
+    line_index_init();
+    warmer_init();
+    file_cache_init();
+    result_cache_init();
+    span_store_init();
+
     rb_eSourceNotFoundError = rb_define_class_under(rb_mFastMethodSource,"SourceNotFoundError", rb_eStandardError);
     VALUE rb_mMethodExtensions = rb_define_module_under(rb_mFastMethodSource, "MethodExtensions");
 
     rb_define_method(rb_mMethodExtensions, "source", mMethodExtensions_source, 0);
     rb_define_method(rb_mMethodExtensions, "comment", mMethodExtensions_comment, 0);
+    rb_define_method(rb_mMethodExtensions, "comment_and_source",
+                     mMethodExtensions_comment_and_source, 0);
+
+    rb_define_singleton_method(rb_mFastMethodSource, "source_for",
+                               mFastMethodSource_source_for, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "comment_for",
+                               mFastMethodSource_comment_for, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "comment_and_source_for",
+                               mFastMethodSource_comment_and_source_for, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "sources_for",
+                               mFastMethodSource_sources_for, -1);
+    rb_define_singleton_method(rb_mFastMethodSource, "max_mapped_files",
+                               mFastMethodSource_max_mapped_files, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "max_mapped_files=",
+                               mFastMethodSource_set_max_mapped_files, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "map_threshold",
+                               mFastMethodSource_map_threshold, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "map_threshold=",
+                               mFastMethodSource_set_map_threshold, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "readahead_threshold",
+                               mFastMethodSource_readahead_threshold, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "readahead_threshold=",
+                               mFastMethodSource_set_readahead_threshold, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "syscall_count",
+                               mFastMethodSource_syscall_count, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "max_cache_bytes",
+                               mFastMethodSource_max_cache_bytes, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "max_cache_bytes=",
+                               mFastMethodSource_set_max_cache_bytes, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "cache_bytes",
+                               mFastMethodSource_cache_bytes, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "clear_cache",
+                               mFastMethodSource_clear_cache, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "span_cache_dir",
+                               mFastMethodSource_span_cache_dir, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "span_cache_dir=",
+                               mFastMethodSource_set_span_cache_dir, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "engine", mFastMethodSource_engine, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "engine=", mFastMethodSource_set_engine, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "stats", mFastMethodSource_stats, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "reset_stats",
+                               mFastMethodSource_reset_stats, 0);
+    rb_define_singleton_method(rb_mFastMethodSource, "locate", mFastMethodSource_locate, 1);
+    rb_define_singleton_method(rb_mFastMethodSource, "each_source_in_file",
+                               mFastMethodSource_each_source_in_file, 2);
+    rb_funcall(rb_mFastMethodSource, rb_intern("private_class_method"), 1,
+               ID2SYM(rb_intern("each_source_in_file")));
+    rb_define_singleton_method(rb_mFastMethodSource, "warm_file", mFastMethodSource_warm_file, 1);
+    rb_funcall(rb_mFastMethodSource, rb_intern("private_class_method"), 1,
+               ID2SYM(rb_intern("warm_file")));
+
+    rb_cSourceRef = rb_define_class_under(rb_mFastMethodSource, "SourceRef", rb_cObject);
+    rb_undef_alloc_func(rb_cSourceRef);
+    rb_define_method(rb_cSourceRef, "path", cSourceRef_path, 0);
+    rb_define_method(rb_cSourceRef, "start_line", cSourceRef_start_line, 0);
+    rb_define_method(rb_cSourceRef, "end_line", cSourceRef_end_line, 0);
+    rb_define_method(rb_cSourceRef, "byte_range", cSourceRef_byte_range, 0);
+    rb_define_method(rb_cSourceRef, "comment_range", cSourceRef_comment_range, 0);
+    rb_define_method(rb_cSourceRef, "source", cSourceRef_source, 0);
+    rb_define_method(rb_cSourceRef, "comment", cSourceRef_comment, 0);
+    rb_define_method(rb_cSourceRef, "comment_and_source", cSourceRef_comment_and_source, 0);
 }
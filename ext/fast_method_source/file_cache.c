@@ -0,0 +1,788 @@
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ruby.h>
+#include <ruby/thread_native.h>
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+#include <ruby/ractor.h>
+#endif
+
+#include "file_cache.h"
+#include "probes.h"
+#include "stats.h"
+
+#define FILE_CACHE_BUCKETS 256
+
+/*
+ * Mappings are plain memory, so a single cache is shared by all threads and
+ * Ractors. The lock guards the table, the LRU list, refcounts and line
+ * indexes. No Ruby exception is raised while it's held.
+ */
+static rb_nativethread_lock_t lock;
+
+static struct mapped_file *buckets[FILE_CACHE_BUCKETS];
+
+/* Most recently used files are at the head, eviction starts at the tail. */
+static struct mapped_file *lru_head;
+static struct mapped_file *lru_tail;
+
+static size_t capacity = FILE_CACHE_DEFAULT_CAPACITY;
+static size_t size;
+
+/* Files at least this big are mapped, the others are read. */
+static size_t map_threshold = FILE_CACHE_DEFAULT_MAP_THRESHOLD;
+
+/* Mapped files at least this big are read ahead. */
+static size_t readahead_threshold = FILE_CACHE_DEFAULT_READAHEAD_THRESHOLD;
+
+/* System calls made on behalf of lookups since the extension was loaded. */
+static unsigned long syscalls;
+
+#define COUNT_SYSCALL() __atomic_add_fetch(&syscalls, 1, __ATOMIC_RELAXED)
+
+enum map_error {
+    MAP_OK,
+    MAP_ERROR_OPEN,
+    MAP_ERROR_STAT,
+    MAP_ERROR_MMAP,
+    MAP_ERROR_READ,
+    MAP_ERROR_NOMEM
+};
+
+static unsigned long hash_path(const char *path);
+static long stat_mtime_nsec(const struct stat *filestat);
+static void identity_from_stat(struct file_identity *identity, const struct stat *filestat);
+static struct mapped_file *lookup(const char *path, unsigned long hash);
+static struct mapped_file *map_file(const char *path, unsigned long hash, enum map_error *error);
+static char *read_file(int fd, size_t *len, enum map_error *error);
+static void raise_map_error(const char *path, enum map_error error);
+static struct mapped_file *acquire(const char *path, const struct file_identity *known,
+                                   enum map_error *error);
+static struct mapped_file *acquire_cached(const char *path, unsigned long hash);
+static struct mapped_file *insert(struct mapped_file *file);
+static void unmap_file(struct mapped_file *file);
+static void lru_unlink(struct mapped_file *file);
+static void lru_push(struct mapped_file *file);
+static void hash_unlink(struct mapped_file *file);
+static void evict(struct mapped_file *file);
+static void shrink_to(size_t limit);
+
+static unsigned long
+hash_path(const char *path)
+{
+    unsigned long hash = 5381;
+    int ch;
+
+    while ((ch = (unsigned char) *path++) != '\0') {
+        hash = ((hash << 5) + hash) + ch;
+    }
+
+    return hash;
+}
+
+static long
+stat_mtime_nsec(const struct stat *filestat)
+{
+#if defined(HAVE_STRUCT_STAT_ST_MTIM)
+    return filestat->st_mtim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC)
+    return filestat->st_mtimespec.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+static void
+identity_from_stat(struct file_identity *identity, const struct stat *filestat)
+{
+    identity->dev = filestat->st_dev;
+    identity->ino = filestat->st_ino;
+    identity->size = filestat->st_size;
+    identity->mtime = filestat->st_mtime;
+    identity->mtime_nsec = stat_mtime_nsec(filestat);
+}
+
+static struct mapped_file *
+lookup(const char *path, unsigned long hash)
+{
+    struct mapped_file *file = buckets[hash % FILE_CACHE_BUCKETS];
+
+    while (file != NULL) {
+        if (file->hash == hash && strcmp(file->path, path) == 0) {
+            return file;
+        }
+        file = file->hash_next;
+    }
+
+    return NULL;
+}
+
+/*
+ * Maps the file at +path+, or reads it if it's below the map threshold.
+ * Doesn't take the lock and doesn't raise; failures are reported through
+ * +error+.
+ */
+static struct mapped_file *
+map_file(const char *path, unsigned long hash, enum map_error *error)
+{
+    struct stat filestat;
+    struct mapped_file *file;
+    char *map = NULL;
+    size_t map_size = 0;
+    int mapped = 0;
+    int fd;
+
+    COUNT_SYSCALL();
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        *error = MAP_ERROR_OPEN;
+        return NULL;
+    }
+    stats_add(STATS_FILES_OPENED, 1);
+
+    COUNT_SYSCALL();
+    if (fstat(fd, &filestat) == -1) {
+        close(fd);
+        *error = MAP_ERROR_STAT;
+        return NULL;
+    }
+
+    /*
+     * Nothing ever writes to the mapping, so it's read-only and shared: pages
+     * come straight from the page cache, never get copied, and are shared with
+     * every other process (forked workers included) that maps the same file.
+     * The first lookup indexes every line, so a big file is read ahead rather
+     * than faulted in a page at a time.
+     */
+    if (filestat.st_size > 0 &&
+        (size_t) filestat.st_size >= __atomic_load_n(&map_threshold, __ATOMIC_RELAXED))
+    {
+        COUNT_SYSCALL();
+        map = mmap(NULL, filestat.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            *error = MAP_ERROR_MMAP;
+            return NULL;
+        }
+        map_size = filestat.st_size;
+        mapped = 1;
+        stats_add(STATS_FILES_MAPPED, 1);
+
+        if (map_size >= __atomic_load_n(&readahead_threshold, __ATOMIC_RELAXED)) {
+            COUNT_SYSCALL();
+            posix_madvise(map, map_size, POSIX_MADV_WILLNEED);
+        }
+    } else if (filestat.st_size > 0) {
+        map_size = filestat.st_size;
+        if ((map = read_file(fd, &map_size, error)) == NULL) {
+            close(fd);
+            return NULL;
+        }
+        stats_add(STATS_FILES_READ, 1);
+    }
+    COUNT_SYSCALL();
+    close(fd);
+
+    if ((file = calloc(1, sizeof(struct mapped_file))) == NULL ||
+        (file->path = strdup(path)) == NULL)
+    {
+        free(file);
+        if (mapped) {
+            munmap(map, map_size);
+        } else {
+            free(map);
+        }
+        *error = MAP_ERROR_NOMEM;
+        return NULL;
+    }
+
+    file->hash = hash;
+    identity_from_stat(&file->identity, &filestat);
+    file->map = map;
+    file->map_size = map_size;
+    file->mapped = mapped;
+    PROBE_FILE_MAP(file->path, map_size, mapped);
+
+    return file;
+}
+
+/*
+ * Reads up to +len+ bytes of the file into the heap, and sets +len+ to what
+ * it got: a file that shrinks in the meantime no longer matches its identity,
+ * so the next lookup reads it again.
+ */
+static char *
+read_file(int fd, size_t *len, enum map_error *error)
+{
+    char *contents = malloc(*len);
+    size_t done = 0;
+
+    if (contents == NULL) {
+        *error = MAP_ERROR_NOMEM;
+        return NULL;
+    }
+
+    while (done < *len) {
+        ssize_t got;
+
+        COUNT_SYSCALL();
+        if ((got = pread(fd, contents + done, *len - done, done)) == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            free(contents);
+            *error = MAP_ERROR_READ;
+            return NULL;
+        }
+
+        if (got == 0) {
+            break;
+        }
+        done += got;
+    }
+
+    *len = done;
+
+    return contents;
+}
+
+static void
+raise_map_error(const char *path, enum map_error error)
+{
+    switch (error) {
+      case MAP_ERROR_OPEN:
+        rb_raise(rb_eIOError, "failed to read - %s", path);
+      case MAP_ERROR_STAT:
+        rb_raise(rb_eIOError, "filestat failed for %s", path);
+      case MAP_ERROR_MMAP:
+        rb_raise(rb_eIOError, "mmap failed for %s", path);
+      case MAP_ERROR_READ:
+        rb_raise(rb_eIOError, "read failed for %s", path);
+      case MAP_ERROR_NOMEM:
+        rb_memerror();
+      case MAP_OK:
+        break;
+    }
+}
+
+/*
+ * Called with the lock held, so it can't raise. munmap() only fails on
+ * arguments it didn't hand out itself, which can't happen here.
+ */
+static void
+unmap_file(struct mapped_file *file)
+{
+    PROBE_FILE_UNMAP(file->path, file->map_size, file->mapped);
+
+    if (file->mapped) {
+        COUNT_SYSCALL();
+        munmap((void *) file->map, file->map_size);
+    } else {
+        free((void *) file->map);
+    }
+
+    if (file->has_lines) {
+        line_index_free(&file->lines);
+    }
+
+    if (file->has_spans) {
+        span_index_free(&file->spans);
+    }
+
+    free(file->path);
+    free(file);
+}
+
+static void
+lru_unlink(struct mapped_file *file)
+{
+    if (file->lru_prev != NULL) {
+        file->lru_prev->lru_next = file->lru_next;
+    } else {
+        lru_head = file->lru_next;
+    }
+
+    if (file->lru_next != NULL) {
+        file->lru_next->lru_prev = file->lru_prev;
+    } else {
+        lru_tail = file->lru_prev;
+    }
+
+    file->lru_prev = file->lru_next = NULL;
+}
+
+static void
+lru_push(struct mapped_file *file)
+{
+    file->lru_prev = NULL;
+    file->lru_next = lru_head;
+
+    if (lru_head != NULL) {
+        lru_head->lru_prev = file;
+    }
+    lru_head = file;
+
+    if (lru_tail == NULL) {
+        lru_tail = file;
+    }
+}
+
+static void
+hash_unlink(struct mapped_file *file)
+{
+    struct mapped_file **link = &buckets[file->hash % FILE_CACHE_BUCKETS];
+
+    while (*link != NULL) {
+        if (*link == file) {
+            *link = file->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+
+    file->hash_next = NULL;
+}
+
+/*
+ * Drops the file from the cache. Files that are still in use are only marked
+ * as stale and get unmapped by the last file_cache_release().
+ */
+static void
+evict(struct mapped_file *file)
+{
+    hash_unlink(file);
+    lru_unlink(file);
+    size--;
+
+    if (file->refcount == 0) {
+        unmap_file(file);
+    } else {
+        file->stale = 1;
+    }
+}
+
+static void
+shrink_to(size_t limit)
+{
+    struct mapped_file *file = lru_tail;
+    struct mapped_file *prev;
+
+    while (size > limit && file != NULL) {
+        prev = file->lru_prev;
+
+        if (file->refcount == 0) {
+            evict(file);
+        }
+
+        file = prev;
+    }
+}
+
+/*
+ * Pins the cached mapping of +path+ if there's one. It may be stale; the
+ * caller checks that without holding the lock.
+ */
+static struct mapped_file *
+acquire_cached(const char *path, unsigned long hash)
+{
+    struct mapped_file *file;
+
+    rb_nativethread_lock_lock(&lock);
+    if ((file = lookup(path, hash)) != NULL) {
+        file->refcount++;
+        file->lookups++;
+    }
+    rb_nativethread_lock_unlock(&lock);
+
+    return file;
+}
+
+/*
+ * Adds a freshly mapped file to the cache. Another thread may have mapped
+ * the same version of the file in the meantime, in which case that mapping
+ * wins and +file+ is dropped.
+ */
+static struct mapped_file *
+insert(struct mapped_file *file)
+{
+    struct mapped_file *cached;
+
+    rb_nativethread_lock_lock(&lock);
+
+    if ((cached = lookup(file->path, file->hash)) != NULL) {
+        if (file_identity_equal(&cached->identity, &file->identity)) {
+            cached->refcount++;
+            cached->lookups++;
+            lru_unlink(cached);
+            lru_push(cached);
+            rb_nativethread_lock_unlock(&lock);
+
+            unmap_file(file);
+            return cached;
+        }
+
+        evict(cached);
+    }
+
+    file->refcount = 1;
+    file->lookups = 1;
+
+    if (capacity == 0) {
+        file->stale = 1;
+    } else {
+        shrink_to(capacity - 1);
+
+        file->hash_next = buckets[file->hash % FILE_CACHE_BUCKETS];
+        buckets[file->hash % FILE_CACHE_BUCKETS] = file;
+        lru_push(file);
+        size++;
+    }
+
+    rb_nativethread_lock_unlock(&lock);
+
+    return file;
+}
+
+void
+file_cache_init(void)
+{
+    rb_nativethread_lock_initialize(&lock);
+}
+
+/*
+ * Returns the mapping of the file at +path+, reusing the cached one when the
+ * file's inode, size and modification time haven't changed. The caller must
+ * hand the mapping back with file_cache_release(). System calls happen
+ * outside of the lock, so lookups from different threads and Ractors only
+ * contend for the bookkeeping.
+ */
+struct mapped_file *
+file_cache_acquire(const char *path)
+{
+    enum map_error error = MAP_OK;
+    struct mapped_file *file = acquire(path, NULL, &error);
+
+    if (file == NULL) {
+        raise_map_error(path, error);
+    }
+
+    return file;
+}
+
+/*
+ * Like file_cache_acquire(), but returns NULL instead of raising, so it can
+ * be called from a thread that isn't Ruby's. A caller that has just stat()ed
+ * the file passes what it found as +identity+, and the cached mapping is
+ * checked against that instead of stat()ing the file again; others pass
+ * NULL.
+ */
+struct mapped_file *
+file_cache_try_acquire(const char *path, const struct file_identity *identity)
+{
+    enum map_error error = MAP_OK;
+
+    return acquire(path, identity, &error);
+}
+
+/*
+ * Wraps +contents+, a malloc()ed buffer of +len+ bytes, in a file that is
+ * never cached: the file_cache_release() that balances this call frees it,
+ * along with the buffer. For code that doesn't come from a file. Returns NULL
+ * (and frees the buffer) when it runs out of memory.
+ */
+struct mapped_file *
+mapped_file_from_memory(const char *path, char *contents, size_t len)
+{
+    struct mapped_file *file;
+
+    if ((file = calloc(1, sizeof(struct mapped_file))) == NULL ||
+        (file->path = strdup(path)) == NULL)
+    {
+        free(file);
+        free(contents);
+        return NULL;
+    }
+
+    file->hash = hash_path(path);
+    file->map = contents;
+    file->map_size = len;
+    file->refcount = 1;
+    file->lookups = 1;
+    file->stale = 1;
+    file->in_memory = 1;
+
+    return file;
+}
+
+static struct mapped_file *
+acquire(const char *path, const struct file_identity *known, enum map_error *error)
+{
+    struct file_identity identity;
+    unsigned long hash = hash_path(path);
+    struct mapped_file *file = acquire_cached(path, hash);
+
+    if (file != NULL) {
+        if (known == NULL && file_identity_of(path, &identity) == 0) {
+            known = &identity;
+        }
+
+        if (known != NULL && file_identity_equal(&file->identity, known)) {
+            rb_nativethread_lock_lock(&lock);
+            if (!file->stale) {
+                lru_unlink(file);
+                lru_push(file);
+            }
+            rb_nativethread_lock_unlock(&lock);
+            stats_add(STATS_FILE_CACHE_HITS, 1);
+
+            return file;
+        }
+
+        rb_nativethread_lock_lock(&lock);
+        if (!file->stale) {
+            evict(file);
+        }
+        rb_nativethread_lock_unlock(&lock);
+        file_cache_release(file);
+    }
+
+    stats_add(STATS_FILE_CACHE_MISSES, 1);
+
+    if ((file = map_file(path, hash, error)) == NULL) {
+        return NULL;
+    }
+
+    return insert(file);
+}
+
+void
+file_cache_release(struct mapped_file *file)
+{
+    int unmap;
+
+    rb_nativethread_lock_lock(&lock);
+    unmap = --file->refcount == 0 && file->stale;
+    rb_nativethread_lock_unlock(&lock);
+
+    if (unmap) {
+        unmap_file(file);
+    }
+}
+
+/*
+ * Indexes the lines of the file unless that's done already. Safe to call
+ * without the GVL. The index is built outside of the lock, which a large file
+ * would otherwise hold up every other lookup with, and installed with
+ * mapped_file_set_index(). Returns -1 when it runs out of memory.
+ */
+int
+mapped_file_index(struct mapped_file *file)
+{
+    struct line_index lines;
+
+    if (__atomic_load_n(&file->has_lines, __ATOMIC_ACQUIRE)) {
+        return 0;
+    }
+
+    if (line_index_build(&lines, file->map, file->map_size) == -1) {
+        return -1;
+    }
+
+    mapped_file_set_index(file, &lines);
+
+    return 0;
+}
+
+/*
+ * Installs an index built elsewhere, unless the file got indexed in the
+ * meantime, in which case +lines+ is freed.
+ */
+void
+mapped_file_set_index(struct mapped_file *file, struct line_index *lines)
+{
+    rb_nativethread_lock_lock(&lock);
+    if (file->has_lines) {
+        line_index_free(lines);
+    } else {
+        file->lines = *lines;
+        __atomic_store_n(&file->has_lines, 1, __ATOMIC_RELEASE);
+    }
+    rb_nativethread_lock_unlock(&lock);
+}
+
+/* Returns a frozen, shareable copy of the contents of the file. */
+VALUE
+mapped_file_contents(struct mapped_file *file)
+{
+    VALUE contents = rb_str_new(file->map, file->map_size);
+
+#ifdef HAVE_RB_RACTOR_MAKE_SHAREABLE
+    return rb_ractor_make_shareable(contents);
+#else
+    return rb_obj_freeze(contents);
+#endif
+}
+
+/*
+ * Installs a span index, unless the file got one in the meantime, in which
+ * case +spans+ is freed.
+ */
+void
+mapped_file_set_spans(struct mapped_file *file, struct span_index *spans)
+{
+    rb_nativethread_lock_lock(&lock);
+    if (file->has_spans) {
+        span_index_free(spans);
+    } else {
+        file->spans = *spans;
+        __atomic_store_n(&file->has_spans, 1, __ATOMIC_RELEASE);
+    }
+    rb_nativethread_lock_unlock(&lock);
+}
+
+/*
+ * Returns a pointer to the start of line +lineno+ (counting from 1) or NULL
+ * when the file is shorter than that. The length of the line, including its
+ * newline, is stored in +len+. Needs the GVL unless the file is indexed.
+ */
+const char *
+mapped_file_line(struct mapped_file *file, unsigned lineno, size_t *len)
+{
+    size_t start, end;
+
+    if (mapped_file_index(file) == -1) {
+        rb_memerror();
+    }
+
+    if (lineno == 0 || lineno > file->lines.count) {
+        return NULL;
+    }
+
+    start = file->lines.offsets[lineno - 1];
+    end = lineno < file->lines.count ? file->lines.offsets[lineno] : file->map_size;
+    *len = end - start;
+
+    return file->map + start;
+}
+
+size_t
+file_cache_capacity(void)
+{
+    size_t current;
+
+    rb_nativethread_lock_lock(&lock);
+    current = capacity;
+    rb_nativethread_lock_unlock(&lock);
+
+    return current;
+}
+
+void
+file_cache_set_capacity(size_t new_capacity)
+{
+    rb_nativethread_lock_lock(&lock);
+    capacity = new_capacity;
+    shrink_to(capacity);
+    rb_nativethread_lock_unlock(&lock);
+}
+
+unsigned long
+file_cache_syscalls(void)
+{
+    return __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+}
+
+size_t
+file_cache_size(void)
+{
+    size_t current;
+
+    rb_nativethread_lock_lock(&lock);
+    current = size;
+    rb_nativethread_lock_unlock(&lock);
+
+    return current;
+}
+
+size_t
+file_cache_map_threshold(void)
+{
+    return __atomic_load_n(&map_threshold, __ATOMIC_RELAXED);
+}
+
+/* Only applies to files read from now on. */
+void
+file_cache_set_map_threshold(size_t threshold)
+{
+    __atomic_store_n(&map_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+size_t
+file_cache_readahead_threshold(void)
+{
+    return __atomic_load_n(&readahead_threshold, __ATOMIC_RELAXED);
+}
+
+void
+file_cache_set_readahead_threshold(size_t threshold)
+{
+    __atomic_store_n(&readahead_threshold, threshold, __ATOMIC_RELAXED);
+}
+
+void
+file_cache_clear(void)
+{
+    rb_nativethread_lock_lock(&lock);
+    shrink_to(0);
+    rb_nativethread_lock_unlock(&lock);
+}
+
+/*
+ * Drops the mapping of +path+ from the cache. It's unmapped right away unless
+ * it's still in use.
+ */
+void
+file_cache_forget(const char *path)
+{
+    struct mapped_file *file;
+
+    rb_nativethread_lock_lock(&lock);
+    if ((file = lookup(path, hash_path(path))) != NULL) {
+        evict(file);
+    }
+    rb_nativethread_lock_unlock(&lock);
+}
+
+/*
+ * Stats the file at +path+. Returns 0 on success and -1 if the file can't be
+ * stat'ed.
+ */
+int
+file_identity_of(const char *path, struct file_identity *identity)
+{
+    struct stat filestat;
+
+    COUNT_SYSCALL();
+    if (stat(path, &filestat) == -1) {
+        return -1;
+    }
+
+    identity_from_stat(identity, &filestat);
+
+    return 0;
+}
+
+int
+file_identity_equal(const struct file_identity *a, const struct file_identity *b)
+{
+    return a->ino == b->ino &&
+        a->dev == b->dev &&
+        a->size == b->size &&
+        a->mtime == b->mtime &&
+        a->mtime_nsec == b->mtime_nsec;
+}
@@ -0,0 +1,88 @@
+#ifndef FAST_METHOD_SOURCE_FILE_CACHE_H
+#define FAST_METHOD_SOURCE_FILE_CACHE_H
+
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <ruby.h>
+
+#include "line_index.h"
+#include "span_index.h"
+
+/*
+ * What identifies a version of a file on disk. A file is assumed unchanged as
+ * long as none of these differ.
+ */
+struct file_identity {
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    time_t mtime;
+    long mtime_nsec;
+};
+
+/*
+ * A source file mapped into memory. Mappings are shared between all lookups
+ * into the same file and stay alive until they are evicted from the cache or
+ * the file changes on disk. Files smaller than the map threshold are read
+ * into the heap instead, which costs no mapping to set up and tear down;
+ * nothing else needs to know which one it got.
+ */
+struct mapped_file {
+    char *path;
+    unsigned long hash;
+
+    struct file_identity identity;
+
+    const char *map;
+    size_t map_size;
+    int mapped;
+
+    /* Built on the first line lookup. */
+    struct line_index lines;
+    int has_lines;
+
+    /* Built once the file is looked up more than once. */
+    struct span_index spans;
+    int has_spans;
+    unsigned lookups;
+
+    unsigned refcount;
+    int stale;
+
+    /* Made by mapped_file_from_memory() rather than from a file. */
+    int in_memory;
+
+    struct mapped_file *hash_next;
+    struct mapped_file *lru_prev;
+    struct mapped_file *lru_next;
+};
+
+#define FILE_CACHE_DEFAULT_CAPACITY 64
+#define FILE_CACHE_DEFAULT_MAP_THRESHOLD (256 * 1024)
+#define FILE_CACHE_DEFAULT_READAHEAD_THRESHOLD (1024 * 1024)
+
+void file_cache_init(void);
+struct mapped_file *file_cache_acquire(const char *path);
+struct mapped_file *file_cache_try_acquire(const char *path, const struct file_identity *identity);
+struct mapped_file *mapped_file_from_memory(const char *path, char *contents, size_t len);
+void file_cache_release(struct mapped_file *file);
+int mapped_file_index(struct mapped_file *file);
+void mapped_file_set_index(struct mapped_file *file, struct line_index *lines);
+void mapped_file_set_spans(struct mapped_file *file, struct span_index *spans);
+const char *mapped_file_line(struct mapped_file *file, unsigned lineno, size_t *len);
+VALUE mapped_file_contents(struct mapped_file *file);
+size_t file_cache_capacity(void);
+void file_cache_set_capacity(size_t capacity);
+size_t file_cache_size(void);
+size_t file_cache_map_threshold(void);
+void file_cache_set_map_threshold(size_t threshold);
+size_t file_cache_readahead_threshold(void);
+void file_cache_set_readahead_threshold(size_t threshold);
+unsigned long file_cache_syscalls(void);
+void file_cache_clear(void);
+void file_cache_forget(const char *path);
+int file_identity_of(const char *path, struct file_identity *identity);
+int file_identity_equal(const struct file_identity *a, const struct file_identity *b);
+
+#endif
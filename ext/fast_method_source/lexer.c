@@ -0,0 +1,732 @@
+#include <string.h>
+
+#include "lexer.h"
+
+/* Frame types. */
+#define FRAME_CODE   'c'
+#define FRAME_STRING 's'
+
+/* Kinds of the last significant token. */
+#define TK_NONE     0 /* start of a statement */
+#define TK_OPERATOR 1 /* something that expects an operand next */
+#define TK_IDENT    2 /* a bare identifier, possibly a paren-less call */
+#define TK_VALUE    3 /* a complete operand */
+#define TK_DOT      4 /* a method call operator */
+
+#define IS_VALUE_POSITION(lexer) \
+    ((lexer)->prev == TK_NONE || (lexer)->prev == TK_OPERATOR)
+
+static int is_ident_char(char ch);
+static int is_space(char ch);
+static int is_keyword(const char *word, size_t len, const char *keyword);
+static int push_frame(struct ruby_lexer *lexer, char type, char term, char open, char interp);
+static char closing_delimiter(char open);
+static size_t lex_string(struct ruby_lexer *lexer, const char *s, size_t n, size_t i);
+static size_t lex_word(struct ruby_lexer *lexer, const char *s, size_t n, size_t i);
+static size_t lex_def_header(struct ruby_lexer *lexer, const char *s, size_t n, size_t i);
+static int is_endless_body(const char *s, size_t n, size_t i);
+static size_t lex_percent_literal(struct ruby_lexer *lexer, const char *s, size_t n, size_t i);
+static size_t lex_heredoc_start(struct ruby_lexer *lexer, const char *s, size_t n, size_t i);
+static size_t lex_punctuation(struct ruby_lexer *lexer, const char *s, size_t n, size_t i,
+                              int space_before);
+static void lex_code(struct ruby_lexer *lexer, const char *s, size_t n);
+static int is_heredoc_end(const struct lexer_heredoc *heredoc, const char *s, size_t n);
+static enum lexer_status status(const struct ruby_lexer *lexer);
+
+static int
+is_ident_char(char ch)
+{
+    return (ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z') ||
+        (ch >= '0' && ch <= '9') || ch == '_' || (unsigned char) ch >= 0x80;
+}
+
+static int
+is_space(char ch)
+{
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\f' || ch == '\v';
+}
+
+static int
+is_keyword(const char *word, size_t len, const char *keyword)
+{
+    return strlen(keyword) == len && memcmp(word, keyword, len) == 0;
+}
+
+static int
+push_frame(struct ruby_lexer *lexer, char type, char term, char open, char interp)
+{
+    struct lexer_frame *frame;
+
+    if (lexer->nframes == LEXER_MAX_FRAMES) {
+        lexer->unbalanced = 1;
+        return 0;
+    }
+
+    frame = &lexer->frames[lexer->nframes++];
+    frame->type = type;
+    frame->term = term;
+    frame->open = open;
+    frame->interp = interp;
+    frame->regexp = term == '/';
+    frame->nest = 0;
+
+    return 1;
+}
+
+static char
+closing_delimiter(char open)
+{
+    switch (open) {
+    case '(': return ')';
+    case '[': return ']';
+    case '{': return '}';
+    case '<': return '>';
+    default:  return open;
+    }
+}
+
+/*
+ * Consumes the body of the string on top of the frame stack up to its
+ * terminator or the start of an interpolation.
+ */
+static size_t
+lex_string(struct ruby_lexer *lexer, const char *s, size_t n, size_t i)
+{
+    struct lexer_frame *frame = &lexer->frames[lexer->nframes - 1];
+
+    while (i < n) {
+        char ch = s[i];
+
+        if (ch == '\\') {
+            i += 2;
+        } else if (frame->interp && ch == '#' && i + 1 < n && s[i + 1] == '{') {
+            push_frame(lexer, FRAME_CODE, 0, 0, 0);
+            lexer->prev = TK_NONE;
+            return i + 2;
+        } else if (frame->open != frame->term && ch == frame->open) {
+            frame->nest++;
+            i++;
+        } else if (ch == frame->term) {
+            i++;
+
+            if (frame->nest > 0) {
+                frame->nest--;
+                continue;
+            }
+
+            if (frame->regexp) {
+                while (i < n && is_ident_char(s[i])) {
+                    i++;
+                }
+            }
+
+            lexer->nframes--;
+            lexer->prev = TK_VALUE;
+            return i;
+        } else {
+            i++;
+        }
+    }
+
+    return n;
+}
+
+/*
+ * Skips the name of a method definition and decides whether the definition
+ * needs an `end` (endless definitions like `def foo = 1` don't).
+ */
+static size_t
+lex_def_header(struct ruby_lexer *lexer, const char *s, size_t n, size_t i)
+{
+    size_t name_end;
+    size_t j;
+    int parens = 0;
+
+    while (i < n && is_space(s[i])) {
+        i++;
+    }
+
+    if (i + 5 <= n && memcmp(s + i, "self.", 5) == 0) {
+        i += 5;
+    }
+
+    if (i < n && is_ident_char(s[i])) {
+        while (i < n && is_ident_char(s[i])) {
+            i++;
+        }
+
+        /* Predicates and setters like `def foo= value`. */
+        if (i < n && (s[i] == '?' || s[i] == '!')) {
+            i++;
+        } else if (i < n && s[i] == '=' && (i + 1 == n || strchr("=~>", s[i + 1]) == NULL)) {
+            i++;
+        }
+    } else {
+        while (i < n && strchr("+-*/%<=>!~^&|[]`@", s[i]) != NULL) {
+            i++;
+        }
+    }
+
+    name_end = i;
+    lexer->prev = TK_IDENT;
+
+    /* Look past the parameter list for an endless definition. */
+    for (j = i; j < n; j++) {
+        if (s[j] == '(') {
+            parens++;
+        } else if (s[j] == ')') {
+            if (--parens == 0) {
+                j++;
+                break;
+            }
+        } else if (parens == 0 && !is_space(s[j])) {
+            break;
+        }
+    }
+
+    /* The parameter list goes on, so the check waits for its `)`. */
+    if (parens > 0) {
+        lexer->depth++;
+        lexer->def_params_depth = lexer->depth + 1;
+        return name_end;
+    }
+
+    if (!is_endless_body(s, n, j)) {
+        lexer->depth++;
+    }
+
+    return name_end;
+}
+
+/* Tells whether `= body` follows the parameter list of a `def`. */
+static int
+is_endless_body(const char *s, size_t n, size_t i)
+{
+    while (i < n && is_space(s[i])) {
+        i++;
+    }
+
+    return i < n && s[i] == '=' && (i + 1 == n || strchr("=~>", s[i + 1]) == NULL);
+}
+
+static size_t
+lex_word(struct ruby_lexer *lexer, const char *s, size_t n, size_t i)
+{
+    size_t start = i;
+    size_t len;
+    const char *word;
+
+    while (i < n && is_ident_char(s[i])) {
+        i++;
+    }
+
+    if (i < n && (s[i] == '?' || s[i] == '!') && (i + 1 == n || s[i + 1] != '=')) {
+        i++;
+    }
+
+    word = s + start;
+    len = i - start;
+
+    /* Method calls like `foo.class` and labels like `end:` aren't keywords. */
+    if (lexer->prev == TK_DOT) {
+        lexer->prev = TK_IDENT;
+        return i;
+    }
+
+    if (i + 1 < n && s[i] == ':' && s[i + 1] != ':') {
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    }
+
+    if (is_keyword(word, len, "def")) {
+        return lex_def_header(lexer, s, n, i);
+    } else if (is_keyword(word, len, "class")) {
+        lexer->depth++;
+        lexer->prev = TK_OPERATOR;
+
+        /* `class<<self` opens a singleton class, not a heredoc. */
+        while (i < n && is_space(s[i])) {
+            i++;
+        }
+        if (i + 1 < n && s[i] == '<' && s[i + 1] == '<') {
+            i += 2;
+        }
+    } else if (is_keyword(word, len, "module") || is_keyword(word, len, "begin") ||
+               is_keyword(word, len, "case")) {
+        lexer->depth++;
+        lexer->prev = TK_OPERATOR;
+    } else if (is_keyword(word, len, "if") || is_keyword(word, len, "unless")) {
+        /* Modifiers follow a complete operand. */
+        if (IS_VALUE_POSITION(lexer)) {
+            lexer->depth++;
+        }
+        lexer->prev = TK_OPERATOR;
+    } else if (is_keyword(word, len, "while") || is_keyword(word, len, "until")) {
+        if (IS_VALUE_POSITION(lexer)) {
+            lexer->depth++;
+            lexer->pending_do++;
+        }
+        lexer->prev = TK_OPERATOR;
+    } else if (is_keyword(word, len, "for")) {
+        lexer->depth++;
+        lexer->pending_do++;
+        lexer->prev = TK_OPERATOR;
+    } else if (is_keyword(word, len, "do")) {
+        /* `while cond do` reuses the loop's `end`. */
+        if (lexer->pending_do > 0) {
+            lexer->pending_do--;
+        } else {
+            lexer->depth++;
+        }
+        lexer->prev = TK_OPERATOR;
+    } else if (is_keyword(word, len, "end")) {
+        if (--lexer->depth < 0) {
+            lexer->unbalanced = 1;
+        }
+        lexer->prev = TK_VALUE;
+    } else if (is_keyword(word, len, "then") || is_keyword(word, len, "else") ||
+               is_keyword(word, len, "elsif") || is_keyword(word, len, "when") ||
+               is_keyword(word, len, "in") || is_keyword(word, len, "and") ||
+               is_keyword(word, len, "or") || is_keyword(word, len, "not") ||
+               is_keyword(word, len, "rescue") || is_keyword(word, len, "ensure")) {
+        lexer->prev = TK_OPERATOR;
+    } else if (is_keyword(word, len, "self") || is_keyword(word, len, "nil") ||
+               is_keyword(word, len, "true") || is_keyword(word, len, "false")) {
+        lexer->prev = TK_VALUE;
+    } else if (word[0] >= '0' && word[0] <= '9') {
+        /* Numeric literals, including floats like 1.5 and 1e-3. */
+        while (i < n && (is_ident_char(s[i]) ||
+                         (s[i] == '.' && i + 1 < n && s[i + 1] >= '0' && s[i + 1] <= '9') ||
+                         ((s[i] == '-' || s[i] == '+') && (s[i - 1] == 'e' || s[i - 1] == 'E')))) {
+            i++;
+        }
+        lexer->prev = TK_VALUE;
+    } else {
+        lexer->prev = TK_IDENT;
+    }
+
+    return i;
+}
+
+static size_t
+lex_percent_literal(struct ruby_lexer *lexer, const char *s, size_t n, size_t i)
+{
+    char type = 'Q';
+    char open;
+
+    i++;
+    if (i < n && is_ident_char(s[i])) {
+        type = s[i++];
+    }
+
+    if (i == n) {
+        lexer->unbalanced = 1;
+        return n;
+    }
+
+    open = s[i];
+    push_frame(lexer, FRAME_STRING, closing_delimiter(open), open,
+               strchr("QWIrx", type) != NULL);
+
+    if (type == 'r') {
+        lexer->frames[lexer->nframes - 1].regexp = 1;
+    }
+
+    return i + 1;
+}
+
+static size_t
+lex_heredoc_start(struct ruby_lexer *lexer, const char *s, size_t n, size_t i)
+{
+    struct lexer_heredoc *heredoc;
+    size_t id_start;
+    char quote = 0;
+    int indented = 0;
+
+    i += 2;
+    if (s[i] == '~' || s[i] == '-') {
+        indented = 1;
+        i++;
+    }
+
+    if (s[i] == '\'' || s[i] == '"' || s[i] == '`') {
+        quote = s[i++];
+    }
+
+    id_start = i;
+    while (i < n && (quote ? s[i] != quote : is_ident_char(s[i]))) {
+        i++;
+    }
+
+    if (lexer->nheredocs == LEXER_MAX_HEREDOCS || i - id_start >= LEXER_MAX_HEREDOC_ID ||
+        i == id_start) {
+        lexer->unbalanced = 1;
+        return n;
+    }
+
+    heredoc = &lexer->heredocs[lexer->nheredocs++];
+    memcpy(heredoc->id, s + id_start, i - id_start);
+    heredoc->id_len = i - id_start;
+    heredoc->indented = indented;
+
+    lexer->prev = TK_VALUE;
+
+    return quote ? i + 1 : i;
+}
+
+static size_t
+lex_punctuation(struct ruby_lexer *lexer, const char *s, size_t n, size_t i,
+                int space_before)
+{
+    struct lexer_frame *frame = &lexer->frames[lexer->nframes - 1];
+    char ch = s[i];
+    char next = i + 1 < n ? s[i + 1] : '\0';
+
+    /*
+     * `foo /re/`, `puts %w[a]` and `foo <<~EOS` pass a literal to a
+     * paren-less call, whereas `foo / 2` divides.
+     */
+    int starts_literal = IS_VALUE_POSITION(lexer) ||
+        (lexer->prev == TK_IDENT && space_before && next != '\0' && !is_space(next) &&
+         next != '=');
+
+    /* Operator method calls like `value.*` and `list.[](0)`. */
+    if (lexer->prev == TK_DOT && strchr("+-*/%<=>!~^&|[`", ch) != NULL) {
+        if (ch == '[' && next == ']') {
+            i += 2;
+        }
+        while (i < n && strchr("+-*/%<=>!~^&|`@", s[i]) != NULL) {
+            i++;
+        }
+        lexer->prev = TK_IDENT;
+        return i;
+    }
+
+    switch (ch) {
+    case '"':
+    case '`':
+        push_frame(lexer, FRAME_STRING, ch, ch, 1);
+        return i + 1;
+    case '\'':
+        push_frame(lexer, FRAME_STRING, ch, ch, 0);
+        return i + 1;
+    case '@':
+    case '$':
+        i++;
+        if (ch == '$' && i < n && !is_ident_char(s[i])) {
+            i++;
+        }
+        while (i < n && (is_ident_char(s[i]) || s[i] == '@')) {
+            i++;
+        }
+        lexer->prev = TK_VALUE;
+        return i;
+    case ':':
+        if (next == ':') {
+            lexer->prev = TK_DOT;
+            return i + 2;
+        } else if (next == '"' || next == '\'') {
+            push_frame(lexer, FRAME_STRING, next, next, next == '"');
+            return i + 2;
+        } else if (is_ident_char(next) || next == '@' || next == '$') {
+            i++;
+            /* Symbols of special globals like :$/ and :$; */
+            if (next == '$' && i + 1 < n && !is_ident_char(s[i + 1])) {
+                lexer->prev = TK_VALUE;
+                return i + 2;
+            }
+            while (i < n && (is_ident_char(s[i]) || s[i] == '@' || s[i] == '$')) {
+                i++;
+            }
+            if (i < n && strchr("?!=", s[i]) != NULL && (i + 1 == n || s[i + 1] != '=')) {
+                i++;
+            }
+            lexer->prev = TK_VALUE;
+            return i;
+        } else if (next == '[' && i + 2 < n && s[i + 2] == ']') {
+            i += 3;
+            if (i < n && s[i] == '=') {
+                i++;
+            }
+            lexer->prev = TK_VALUE;
+            return i;
+        } else if (next != '\0' && strchr("+-*/%<=>!~^&|`", next) != NULL) {
+            i++;
+            while (i < n && strchr("+-*/%<=>!~^&|`@", s[i]) != NULL) {
+                i++;
+            }
+            lexer->prev = TK_VALUE;
+            return i;
+        }
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    case '?':
+        /*
+         * Character literals like ?a and ?{, as opposed to the ternary
+         * operator and predicate calls like `x ?y : z`.
+         */
+        if (starts_literal && next != '\0' && !is_space(next) &&
+            (next == '\\' || !is_ident_char(next) || i + 2 == n || !is_ident_char(s[i + 2]))) {
+            i += next == '\\' ? 3 : 2;
+            lexer->prev = TK_VALUE;
+            return i > n ? n : i;
+        }
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    case '%':
+        if (starts_literal && next != '\0' && !is_space(next)) {
+            return lex_percent_literal(lexer, s, n, i);
+        }
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    case '/':
+        if (starts_literal) {
+            push_frame(lexer, FRAME_STRING, '/', '/', 1);
+            return i + 1;
+        }
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    case '<':
+        if (next == '<' && starts_literal && i + 2 < n &&
+            (is_ident_char(s[i + 2]) || strchr("~-'\"`", s[i + 2]) != NULL) &&
+            (strchr("~-", s[i + 2]) == NULL ||
+             (i + 3 < n && (is_ident_char(s[i + 3]) || strchr("'\"`", s[i + 3]) != NULL)))) {
+            return lex_heredoc_start(lexer, s, n, i);
+        }
+        lexer->prev = TK_OPERATOR;
+        return next == '<' ? i + 2 : i + 1;
+    case '(':
+    case '[':
+        lexer->depth++;
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    case '{':
+        lexer->depth++;
+        frame->nest++;
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    case '}':
+        if (lexer->nframes > 1 && frame->nest == 0) {
+            /* The end of an interpolation. */
+            lexer->nframes--;
+            return i + 1;
+        }
+        frame->nest--;
+        /* FALLTHROUGH */
+    case ')':
+    case ']':
+        if (ch == ')' && lexer->def_params_depth == lexer->depth) {
+            lexer->def_params_depth = 0;
+            if (is_endless_body(s, n, i + 1)) {
+                lexer->depth--;
+            }
+        }
+        if (--lexer->depth < 0) {
+            lexer->unbalanced = 1;
+        }
+        lexer->prev = TK_VALUE;
+        return i + 1;
+    case ';':
+        lexer->prev = TK_NONE;
+        lexer->pending_do = 0;
+        return i + 1;
+    case '.':
+        if (next == '.') {
+            while (i < n && s[i] == '.') {
+                i++;
+            }
+            lexer->prev = TK_OPERATOR;
+            return i;
+        }
+        lexer->prev = TK_DOT;
+        return i + 1;
+    case '&':
+        if (next == '.') {
+            lexer->prev = TK_DOT;
+            return i + 2;
+        }
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    default:
+        lexer->prev = TK_OPERATOR;
+        return i + 1;
+    }
+}
+
+static void
+lex_code(struct ruby_lexer *lexer, const char *s, size_t n)
+{
+    size_t i = 0;
+    int space_before = 1;
+
+    lexer->line_continues = 0;
+
+    while (i < n && !lexer->unbalanced) {
+        struct lexer_frame *frame = &lexer->frames[lexer->nframes - 1];
+        char ch = s[i];
+
+        if (frame->type == FRAME_STRING) {
+            i = lex_string(lexer, s, n, i);
+            space_before = 0;
+            continue;
+        }
+
+        if (is_space(ch)) {
+            space_before = 1;
+            i++;
+            continue;
+        }
+
+        if (ch == '\\' && i + 1 == n) {
+            lexer->line_continues = 1;
+            break;
+        }
+
+        if (ch == '#') {
+            break;
+        }
+
+        lexer->seen_token = 1;
+
+        if (is_ident_char(ch)) {
+            i = lex_word(lexer, s, n, i);
+        } else {
+            i = lex_punctuation(lexer, s, n, i, space_before);
+        }
+
+        space_before = 0;
+    }
+
+    /* Unless the line continues, a newline ends the statement. */
+    if (lexer->nframes == 1 && !lexer->line_continues &&
+        (lexer->prev == TK_IDENT || lexer->prev == TK_VALUE)) {
+        lexer->prev = TK_NONE;
+        lexer->pending_do = 0;
+    }
+}
+
+static int
+is_heredoc_end(const struct lexer_heredoc *heredoc, const char *s, size_t n)
+{
+    if (heredoc->indented) {
+        while (n > 0 && is_space(*s)) {
+            s++;
+            n--;
+        }
+    }
+
+    while (n > 0 && is_space(s[n - 1])) {
+        n--;
+    }
+
+    return n == heredoc->id_len && memcmp(s, heredoc->id, n) == 0;
+}
+
+static enum lexer_status
+status(const struct ruby_lexer *lexer)
+{
+    if (lexer->unbalanced) {
+        return LEXER_UNBALANCED;
+    }
+
+    if (lexer->nframes > 1 || lexer->nheredocs > 0 || lexer->block_comment ||
+        lexer->depth > 0 || !lexer->seen_token || lexer->line_continues ||
+        lexer->prev == TK_OPERATOR || lexer->prev == TK_DOT) {
+        return LEXER_INCOMPLETE;
+    }
+
+    return LEXER_COMPLETE;
+}
+
+void
+lexer_init(struct ruby_lexer *lexer)
+{
+    memset(lexer, 0, sizeof(*lexer));
+
+    lexer->nframes = 1;
+    lexer->frames[0].type = FRAME_CODE;
+    lexer->prev = TK_NONE;
+}
+
+/*
+ * Feeds the next line (with or without its newline) and reports whether the
+ * lines fed so far form a complete expression.
+ */
+enum lexer_status
+lexer_feed_line(struct ruby_lexer *lexer, const char *line, size_t len)
+{
+    if (len > 0 && line[len - 1] == '\n') {
+        len--;
+    }
+
+    if (lexer->unbalanced) {
+        return LEXER_UNBALANCED;
+    }
+
+    if (lexer->heredoc_body) {
+        if (is_heredoc_end(&lexer->heredocs[0], line, len)) {
+            memmove(lexer->heredocs, lexer->heredocs + 1,
+                    --lexer->nheredocs * sizeof(struct lexer_heredoc));
+            lexer->heredoc_body = lexer->nheredocs > 0;
+        }
+        return status(lexer);
+    }
+
+    if (lexer->block_comment) {
+        if (len >= 4 && memcmp(line, "=end", 4) == 0) {
+            lexer->block_comment = 0;
+        }
+        return status(lexer);
+    }
+
+    if (lexer->nframes == 1 && len >= 6 && memcmp(line, "=begin", 6) == 0 &&
+        (len == 6 || is_space(line[6]))) {
+        lexer->block_comment = 1;
+        return status(lexer);
+    }
+
+    if (lexer->nframes == 1 && len == 7 && memcmp(line, "__END__", 7) == 0) {
+        lexer->unbalanced = 1;
+        return status(lexer);
+    }
+
+    lex_code(lexer, line, len);
+
+    if (lexer->nheredocs > 0) {
+        lexer->heredoc_body = 1;
+    }
+
+    return status(lexer);
+}
+
+/*
+ * Tells whether the lines fed so far end a statement, so the next line starts
+ * a new one, at whatever depth. A lexer fed a whole file is at a statement
+ * start at exactly the lines where a lexer fed from that line on would be.
+ */
+int
+lexer_at_statement_start(const struct ruby_lexer *lexer)
+{
+    return !lexer->unbalanced && lexer->nframes == 1 && lexer->nheredocs == 0 &&
+        !lexer->block_comment && !lexer->line_continues && lexer->prev == TK_NONE;
+}
+
+/*
+ * Tells whether +line+ continues the expression on the previous line, like a
+ * method chain with leading dots does.
+ */
+int
+lexer_continues_on(const char *line, size_t len)
+{
+    size_t i = 0;
+
+    while (i < len && is_space(line[i])) {
+        i++;
+    }
+
+    if (i < len && line[i] == '.') {
+        return i + 1 == len || line[i + 1] != '.';
+    }
+
+    return i + 1 < len && line[i] == '&' && line[i + 1] == '.';
+}
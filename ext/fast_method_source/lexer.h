@@ -0,0 +1,63 @@
+#ifndef FAST_METHOD_SOURCE_LEXER_H
+#define FAST_METHOD_SOURCE_LEXER_H
+
+#include <stddef.h>
+
+/*
+ * An incremental Ruby tokenizer that is fed one line at a time and tells
+ * whether every construct opened since the first line has been closed. It
+ * understands just enough of Ruby to track nesting: keywords that take an
+ * `end`, brackets, strings with interpolation, heredocs, % literals, regexps,
+ * symbols and comments. The result is a hint; the real parser has the final
+ * word.
+ */
+
+enum lexer_status {
+    LEXER_INCOMPLETE,
+    LEXER_COMPLETE,
+    LEXER_UNBALANCED
+};
+
+#define LEXER_MAX_FRAMES 32
+#define LEXER_MAX_HEREDOCS 8
+#define LEXER_MAX_HEREDOC_ID 64
+
+struct lexer_frame {
+    char type;
+    char term;
+    char open;
+    char interp;
+    char regexp;
+    int nest;
+};
+
+struct lexer_heredoc {
+    char id[LEXER_MAX_HEREDOC_ID];
+    size_t id_len;
+    int indented;
+};
+
+struct ruby_lexer {
+    struct lexer_frame frames[LEXER_MAX_FRAMES];
+    int nframes;
+
+    struct lexer_heredoc heredocs[LEXER_MAX_HEREDOCS];
+    int nheredocs;
+    int heredoc_body;
+
+    int depth;
+    int prev;
+    int pending_do;
+    int def_params_depth;
+    int line_continues;
+    int block_comment;
+    int seen_token;
+    int unbalanced;
+};
+
+void lexer_init(struct ruby_lexer *lexer);
+enum lexer_status lexer_feed_line(struct ruby_lexer *lexer, const char *line, size_t len);
+int lexer_continues_on(const char *line, size_t len);
+int lexer_at_statement_start(const struct ruby_lexer *lexer);
+
+#endif
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "line_index.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define LINE_INDEX_X86 1
+# include <immintrin.h>
+#endif
+
+struct offsets_buf {
+    size_t *offsets;
+    size_t count;
+    size_t capa;
+    int failed;
+};
+
+typedef size_t (*newline_scanner)(struct offsets_buf *buf, const char *src,
+                                  size_t len);
+
+static void push_offset(struct offsets_buf *buf, size_t offset);
+static void push_mask(struct offsets_buf *buf, size_t base, unsigned mask);
+static size_t scan_scalar(struct offsets_buf *buf, const char *src, size_t len);
+static newline_scanner select_scanner(void);
+
+/* Chosen by line_index_init(), before any thread can build an index. */
+static newline_scanner scanner = scan_scalar;
+
+static inline void
+push_offset(struct offsets_buf *buf, size_t offset)
+{
+    if (buf->count == buf->capa) {
+        size_t *offsets;
+
+        if (buf->failed ||
+            (offsets = realloc(buf->offsets, buf->capa * 2 * sizeof(size_t))) == NULL)
+        {
+            buf->failed = 1;
+            return;
+        }
+
+        buf->offsets = offsets;
+        buf->capa *= 2;
+    }
+
+    buf->offsets[buf->count++] = offset;
+}
+
+/* Records a line start after every newline whose bit is set in the mask. */
+static inline void
+push_mask(struct offsets_buf *buf, size_t base, unsigned mask)
+{
+    while (mask != 0) {
+        push_offset(buf, base + __builtin_ctz(mask) + 1);
+        mask &= mask - 1;
+    }
+}
+
+/*
+ * Records line starts for every newline in the first +len+ bytes and returns
+ * the number of bytes consumed.
+ */
+static size_t
+scan_scalar(struct offsets_buf *buf, const char *src, size_t len)
+{
+    const char *p = src;
+    const char *end = src + len;
+
+    while ((p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        push_offset(buf, p - src);
+    }
+
+    return len;
+}
+
+#ifdef LINE_INDEX_X86
+static size_t
+scan_sse2(struct offsets_buf *buf, const char *src, size_t len)
+{
+    const __m128i newline = _mm_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 16 <= len; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *) (src + i));
+        unsigned mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+
+        push_mask(buf, i, mask);
+    }
+
+    return i;
+}
+
+__attribute__((target("avx2")))
+static size_t
+scan_avx2(struct offsets_buf *buf, const char *src, size_t len)
+{
+    const __m256i newline = _mm256_set1_epi8('\n');
+    size_t i = 0;
+
+    for (; i + 32 <= len; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *) (src + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+
+        push_mask(buf, i, mask);
+    }
+
+    return i;
+}
+#endif
+
+static newline_scanner
+select_scanner(void)
+{
+#ifdef LINE_INDEX_X86
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2")) {
+        return scan_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        return scan_sse2;
+    }
+#endif
+
+    return scan_scalar;
+}
+
+/* Picks the fastest scanner the CPU supports. */
+void
+line_index_init(void)
+{
+    scanner = select_scanner();
+}
+
+/*
+ * Indexes the lines of +src+. Doesn't touch the Ruby VM, so it's safe to call
+ * without the GVL. Returns -1 when it runs out of memory.
+ */
+int
+line_index_build(struct line_index *index, const char *src, size_t len)
+{
+    struct offsets_buf buf;
+    size_t scanned;
+
+    /* Ruby code averages well above 16 bytes per line. */
+    buf.capa = len / 16 + 16;
+    buf.count = 0;
+    buf.failed = 0;
+    if ((buf.offsets = malloc(buf.capa * sizeof(size_t))) == NULL) {
+        return -1;
+    }
+
+    push_offset(&buf, 0);
+
+    scanned = scanner(&buf, src, len);
+    if (scanned < len) {
+        size_t tail_start = buf.count;
+
+        scan_scalar(&buf, src + scanned, len - scanned);
+        for (size_t i = tail_start; i < buf.count; i++) {
+            buf.offsets[i] += scanned;
+        }
+    }
+
+    if (buf.failed) {
+        free(buf.offsets);
+        return -1;
+    }
+
+    /* A newline at the very end doesn't start another line. */
+    if (buf.count > 1 && buf.offsets[buf.count - 1] == len) {
+        buf.count--;
+    }
+
+    index->offsets = buf.offsets;
+    index->count = len == 0 ? 0 : buf.count;
+
+    return 0;
+}
+
+/*
+ * Returns the number of the line that holds the byte at +offset+. A binary
+ * search for the last line that starts at or before it.
+ */
+size_t
+line_index_lineno(const struct line_index *index, size_t offset)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (high - low > 1) {
+        size_t mid = low + (high - low) / 2;
+
+        if (index->offsets[mid] <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    return low + 1;
+}
+
+void
+line_index_free(struct line_index *index)
+{
+    free(index->offsets);
+    index->offsets = NULL;
+    index->count = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef FAST_METHOD_SOURCE_LINE_INDEX_H
+#define FAST_METHOD_SOURCE_LINE_INDEX_H
+
+#include <stddef.h>
+
+/*
+ * Byte offsets of the line starts of a buffer. offsets[0] is the offset of
+ * the first line, offsets[n - 1] the offset of line n.
+ */
+struct line_index {
+    size_t *offsets;
+    size_t count;
+};
+
+void line_index_init(void);
+int line_index_build(struct line_index *index, const char *buf, size_t len);
+size_t line_index_lineno(const struct line_index *index, size_t offset);
+void line_index_free(struct line_index *index);
+
+#endif
@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <ruby.h>
+
+#include "prism_engine.h"
+#include "scanner.h"
+#include "stats.h"
+
+static VALUE call_locations(VALUE source);
+
+static int enabled;
+
+static VALUE
+call_locations(VALUE source)
+{
+    VALUE engine = rb_path2class("FastMethodSource::PrismEngine");
+
+    return rb_funcall(engine, rb_intern("locations"), 1, source);
+}
+
+int
+prism_engine_enabled(void)
+{
+    return __atomic_load_n(&enabled, __ATOMIC_RELAXED);
+}
+
+void
+prism_engine_set_enabled(int value)
+{
+    __atomic_store_n(&enabled, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Parses the file with Prism and turns the locations it reports into spans.
+ * A span covers whole lines, like the ones span_index_build() finds. Returns
+ * -1 when Prism fails, for instance when it's called from a Ractor other than
+ * the main one, or when it runs out of memory; the file is then left to the
+ * scanner.
+ */
+int
+prism_span_index_build(struct span_index *index, struct mapped_file *file)
+{
+    VALUE locations;
+    struct span *spans = NULL;
+    size_t count = 0;
+    long len;
+    int state;
+
+    if (mapped_file_index(file) == -1) {
+        stats_add(STATS_PRISM_FALLBACKS, 1);
+        return -1;
+    }
+
+    locations = rb_protect(call_locations, mapped_file_contents(file), &state);
+
+    if (state) {
+        VALUE error = rb_errinfo();
+
+        /* Interrupts and the like are not for this function to swallow. */
+        if (!rb_obj_is_kind_of(error, rb_eStandardError)) {
+            rb_jump_tag(state);
+        }
+
+        rb_set_errinfo(Qnil);
+        stats_add(STATS_PRISM_FALLBACKS, 1);
+        return -1;
+    }
+
+    if (!RB_TYPE_P(locations, T_ARRAY) || (len = RARRAY_LEN(locations)) % 2 != 0) {
+        stats_add(STATS_PRISM_FALLBACKS, 1);
+        return -1;
+    }
+
+    if (len > 0 && (spans = malloc(sizeof(struct span) * (len / 2))) == NULL) {
+        stats_add(STATS_PRISM_FALLBACKS, 1);
+        return -1;
+    }
+
+    for (long i = 0; i < len; i += 2) {
+        VALUE rb_lineno = RARRAY_AREF(locations, i);
+        VALUE rb_end_offset = RARRAY_AREF(locations, i + 1);
+        size_t start_len, end_len, end_offset;
+        const char *start, *end;
+        unsigned lineno, end_line;
+
+        if (!FIXNUM_P(rb_lineno) || !FIXNUM_P(rb_end_offset) ||
+            FIX2LONG(rb_lineno) < 1 || FIX2LONG(rb_end_offset) < 1 ||
+            (size_t) FIX2LONG(rb_end_offset) > file->map_size)
+        {
+            continue;
+        }
+
+        lineno = (unsigned) FIX2LONG(rb_lineno);
+        end_offset = FIX2LONG(rb_end_offset);
+
+        if ((start = mapped_file_line(file, lineno, &start_len)) == NULL) {
+            continue;
+        }
+
+        end_line = line_index_lineno(&file->lines, end_offset - 1);
+        end = mapped_file_line(file, end_line, &end_len);
+
+        spans[count].start_line = lineno;
+        spans[count].end_line = end_line;
+        spans[count].start_byte = start - file->map;
+        spans[count].end_byte = end + end_len - file->map;
+        spans[count].comment_start = scan_comment_start(file, lineno) - file->map;
+        spans[count].kind = SPAN_EXACT;
+        spans[count].reserved = 0;
+        count++;
+    }
+
+    index->spans = spans;
+    index->count = count;
+    index->map = NULL;
+    index->map_size = 0;
+
+    return 0;
+}
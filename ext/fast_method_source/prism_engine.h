@@ -0,0 +1,22 @@
+#ifndef FAST_METHOD_SOURCE_PRISM_ENGINE_H
+#define FAST_METHOD_SOURCE_PRISM_ENGINE_H
+
+#include "file_cache.h"
+#include "span_index.h"
+
+/*
+ * An alternative to the indentation heuristic and the trial parses: Prism
+ * parses the whole file once and every def, block and lambda it finds becomes
+ * a span of kind SPAN_EXACT, which lookups take as is. A line Prism has
+ * nothing for is still left to the scanner.
+ *
+ * The Prism C API isn't something an extension can link against, so the file
+ * is parsed through the Ruby API (lib/fast_method_source/prism_engine.rb).
+ * Everything in here needs the GVL.
+ */
+
+int prism_engine_enabled(void);
+void prism_engine_set_enabled(int enabled);
+int prism_span_index_build(struct span_index *index, struct mapped_file *file);
+
+#endif
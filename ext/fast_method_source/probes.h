@@ -0,0 +1,90 @@
+#ifndef FAST_METHOD_SOURCE_PROBES_H
+#define FAST_METHOD_SOURCE_PROBES_H
+
+/*
+ * Static probes (USDT) for SystemTap, bpftrace, perf and the like, under the
+ * provider "fast_method_source". A probe is a single nop until something
+ * attaches to it, and its arguments are plain values that are already at
+ * hand, so they're always compiled in when <sys/sdt.h> is there. Without it,
+ * they're compiled out; their arguments are never evaluated then.
+ *
+ *   source__entry(path, line)          #source is looked up
+ *   source__return(path, line, found)  ...and found (1) or not (0)
+ *   comment__entry(path, line)         the same for #comment
+ *   comment__return(path, line, found)
+ *   comment_and_source__entry(path, line)
+ *   comment_and_source__return(path, line, found)
+ *                                      ...and for #comment_and_source
+ *   locate__entry(path, line)          FastMethodSource.locate
+ *   locate__return(path, line, found)
+ *   batch__entry(count)                sources_for is handed +count+ methods
+ *   batch__return(count, found)        ...and finds +found+ of them
+ *   parse__entry(start, len)           a candidate is handed to the parser
+ *   parse__return(len, parsed)         ...and parses (1) or not (0)
+ *   file__map(path, size, mapped)      a file is loaded: mmap (1) or read (0)
+ *   file__unmap(path, size, mapped)    a loaded file is let go of
+ */
+
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+
+#define PROBE_SOURCE_ENTRY(path, line) \
+    DTRACE_PROBE2(fast_method_source, source__entry, path, line)
+#define PROBE_SOURCE_RETURN(path, line, found) \
+    DTRACE_PROBE3(fast_method_source, source__return, path, line, found)
+#define PROBE_COMMENT_ENTRY(path, line) \
+    DTRACE_PROBE2(fast_method_source, comment__entry, path, line)
+#define PROBE_COMMENT_RETURN(path, line, found) \
+    DTRACE_PROBE3(fast_method_source, comment__return, path, line, found)
+#define PROBE_COMMENT_AND_SOURCE_ENTRY(path, line) \
+    DTRACE_PROBE2(fast_method_source, comment_and_source__entry, path, line)
+#define PROBE_COMMENT_AND_SOURCE_RETURN(path, line, found) \
+    DTRACE_PROBE3(fast_method_source, comment_and_source__return, path, line, found)
+#define PROBE_LOCATE_ENTRY(path, line) \
+    DTRACE_PROBE2(fast_method_source, locate__entry, path, line)
+#define PROBE_LOCATE_RETURN(path, line, found) \
+    DTRACE_PROBE3(fast_method_source, locate__return, path, line, found)
+#define PROBE_BATCH_ENTRY(count) \
+    DTRACE_PROBE1(fast_method_source, batch__entry, count)
+#define PROBE_BATCH_RETURN(count, found) \
+    DTRACE_PROBE2(fast_method_source, batch__return, count, found)
+#define PROBE_PARSE_ENTRY(start, len) \
+    DTRACE_PROBE2(fast_method_source, parse__entry, start, len)
+#define PROBE_PARSE_RETURN(len, parsed) \
+    DTRACE_PROBE2(fast_method_source, parse__return, len, parsed)
+#define PROBE_FILE_MAP(path, size, mapped) \
+    DTRACE_PROBE3(fast_method_source, file__map, path, size, mapped)
+#define PROBE_FILE_UNMAP(path, size, mapped) \
+    DTRACE_PROBE3(fast_method_source, file__unmap, path, size, mapped)
+#else
+#define PROBE_SOURCE_ENTRY(path, line) \
+    do { if (0) { (void) (path); (void) (line); } } while (0)
+#define PROBE_SOURCE_RETURN(path, line, found) \
+    do { if (0) { (void) (path); (void) (line); (void) (found); } } while (0)
+#define PROBE_COMMENT_ENTRY(path, line) \
+    do { if (0) { (void) (path); (void) (line); } } while (0)
+#define PROBE_COMMENT_RETURN(path, line, found) \
+    do { if (0) { (void) (path); (void) (line); (void) (found); } } while (0)
+#define PROBE_COMMENT_AND_SOURCE_ENTRY(path, line) \
+    do { if (0) { (void) (path); (void) (line); } } while (0)
+#define PROBE_COMMENT_AND_SOURCE_RETURN(path, line, found) \
+    do { if (0) { (void) (path); (void) (line); (void) (found); } } while (0)
+#define PROBE_LOCATE_ENTRY(path, line) \
+    do { if (0) { (void) (path); (void) (line); } } while (0)
+#define PROBE_LOCATE_RETURN(path, line, found) \
+    do { if (0) { (void) (path); (void) (line); (void) (found); } } while (0)
+#define PROBE_BATCH_ENTRY(count) \
+    do { if (0) { (void) (count); } } while (0)
+#define PROBE_BATCH_RETURN(count, found) \
+    do { if (0) { (void) (count); (void) (found); } } while (0)
+#define PROBE_PARSE_ENTRY(start, len) \
+    do { if (0) { (void) (start); (void) (len); } } while (0)
+#define PROBE_PARSE_RETURN(len, parsed) \
+    do { if (0) { (void) (len); (void) (parsed); } } while (0)
+#define PROBE_FILE_MAP(path, size, mapped) \
+    do { if (0) { (void) (path); (void) (size); (void) (mapped); } } while (0)
+#define PROBE_FILE_UNMAP(path, size, mapped) \
+    do { if (0) { (void) (path); (void) (size); (void) (mapped); } } while (0)
+#endif
+
+#endif
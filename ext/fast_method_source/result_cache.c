@@ -0,0 +1,407 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+#include <ruby.h>
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+#include <ruby/ractor.h>
+#endif
+
+#include "result_cache.h"
+#include "stats.h"
+
+#define RESULT_CACHE_MIN_BUCKETS 64
+
+struct cached_result {
+    char *path;
+    unsigned long hash;
+    unsigned lineno;
+    int kind;
+    struct file_identity identity;
+
+    VALUE result;
+    size_t bytes;
+
+    struct cached_result *hash_next;
+    struct cached_result *lru_prev;
+    struct cached_result *lru_next;
+};
+
+/*
+ * Cached strings are frozen, but the entries pointing at them are mutated on
+ * every hit, so each Ractor gets a cache of its own. Only the budget and the
+ * generation are shared: a Ractor catches up with a new budget or a
+ * result_cache_clear() the next time it touches its cache.
+ */
+struct result_cache {
+    struct cached_result **buckets;
+    size_t nbuckets;
+    size_t count;
+
+    /* Most recently used results are at the head, eviction starts at the tail. */
+    struct cached_result *lru_head;
+    struct cached_result *lru_tail;
+
+    size_t bytes;
+
+    /* The generation the cache was last cleared in. */
+    unsigned long generation;
+};
+
+static size_t budget;
+
+/* Bumped by result_cache_clear(). */
+static unsigned long generation;
+
+static struct result_cache *current_cache(void);
+static unsigned long hash_key(const char *path, unsigned lineno, int kind);
+static struct cached_result *lookup(struct result_cache *cache, const char *path,
+                                    unsigned long hash, unsigned lineno, int kind);
+static int grow_buckets(struct result_cache *cache);
+static void lru_unlink(struct result_cache *cache, struct cached_result *entry);
+static void lru_push(struct result_cache *cache, struct cached_result *entry);
+static void hash_unlink(struct result_cache *cache, struct cached_result *entry);
+static void evict(struct result_cache *cache, struct cached_result *entry);
+static void shrink_to(struct result_cache *cache, size_t limit);
+static void mark_results(void *ptr);
+static void free_results(void *ptr);
+
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+static const struct rb_ractor_local_storage_type result_cache_type = {
+    mark_results,
+    free_results,
+};
+
+static rb_ractor_local_key_t cache_key;
+#else
+static const rb_data_type_t result_cache_type = {
+    "fast_method_source/result_cache",
+    {mark_results, NULL, NULL,},
+    0, 0,
+    RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static struct result_cache global_cache;
+#endif
+
+/*
+ * Returns the cache of the current Ractor, or NULL when it can't be
+ * allocated. The cache is emptied if it was cleared since its last use, and
+ * shrunk if the budget went down.
+ */
+static struct result_cache *
+current_cache(void)
+{
+    unsigned long current = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+    struct result_cache *cache = rb_ractor_local_storage_ptr(cache_key);
+
+    if (cache == NULL) {
+        if ((cache = calloc(1, sizeof(struct result_cache))) == NULL) {
+            return NULL;
+        }
+        cache->generation = current;
+        rb_ractor_local_storage_ptr_set(cache_key, cache);
+    }
+#else
+    struct result_cache *cache = &global_cache;
+#endif
+
+    if (cache->generation != current) {
+        shrink_to(cache, 0);
+        cache->generation = current;
+    }
+    shrink_to(cache, __atomic_load_n(&budget, __ATOMIC_RELAXED));
+
+    return cache;
+}
+
+static unsigned long
+hash_key(const char *path, unsigned lineno, int kind)
+{
+    unsigned long hash = 5381;
+    int ch;
+
+    while ((ch = (unsigned char) *path++) != '\0') {
+        hash = ((hash << 5) + hash) + ch;
+    }
+
+    return ((hash << 5) + hash) ^ ((unsigned long) lineno << 2 | kind);
+}
+
+static struct cached_result *
+lookup(struct result_cache *cache, const char *path, unsigned long hash,
+       unsigned lineno, int kind)
+{
+    struct cached_result *entry;
+
+    if (cache->nbuckets == 0) {
+        return NULL;
+    }
+
+    for (entry = cache->buckets[hash % cache->nbuckets]; entry != NULL; entry = entry->hash_next) {
+        if (entry->hash == hash && entry->lineno == lineno && entry->kind == kind &&
+            strcmp(entry->path, path) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/*
+ * Uses malloc() rather than the Ruby allocator: a GC can't start in the
+ * middle of an update that way. Returns -1 when it runs out of memory.
+ */
+static int
+grow_buckets(struct result_cache *cache)
+{
+    size_t new_nbuckets = cache->nbuckets == 0 ? RESULT_CACHE_MIN_BUCKETS : cache->nbuckets * 2;
+    struct cached_result **new_buckets = calloc(new_nbuckets, sizeof(struct cached_result *));
+    struct cached_result *entry, *next;
+
+    if (new_buckets == NULL) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < cache->nbuckets; i++) {
+        for (entry = cache->buckets[i]; entry != NULL; entry = next) {
+            next = entry->hash_next;
+            entry->hash_next = new_buckets[entry->hash % new_nbuckets];
+            new_buckets[entry->hash % new_nbuckets] = entry;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = new_buckets;
+    cache->nbuckets = new_nbuckets;
+
+    return 0;
+}
+
+static void
+lru_unlink(struct result_cache *cache, struct cached_result *entry)
+{
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else {
+        cache->lru_head = entry->lru_next;
+    }
+
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else {
+        cache->lru_tail = entry->lru_prev;
+    }
+
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void
+lru_push(struct result_cache *cache, struct cached_result *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+
+    if (cache->lru_head != NULL) {
+        cache->lru_head->lru_prev = entry;
+    }
+    cache->lru_head = entry;
+
+    if (cache->lru_tail == NULL) {
+        cache->lru_tail = entry;
+    }
+}
+
+static void
+hash_unlink(struct result_cache *cache, struct cached_result *entry)
+{
+    struct cached_result **link = &cache->buckets[entry->hash % cache->nbuckets];
+
+    while (*link != NULL) {
+        if (*link == entry) {
+            *link = entry->hash_next;
+            break;
+        }
+        link = &(*link)->hash_next;
+    }
+
+    entry->hash_next = NULL;
+}
+
+static void
+evict(struct result_cache *cache, struct cached_result *entry)
+{
+    hash_unlink(cache, entry);
+    lru_unlink(cache, entry);
+    cache->count--;
+    cache->bytes -= entry->bytes;
+
+    free(entry->path);
+    free(entry);
+}
+
+static void
+shrink_to(struct result_cache *cache, size_t limit)
+{
+    while (cache->bytes > limit && cache->lru_tail != NULL) {
+        evict(cache, cache->lru_tail);
+    }
+}
+
+static void
+mark_results(void *ptr)
+{
+    struct result_cache *cache = ptr;
+    struct cached_result *entry;
+
+    for (entry = cache->lru_head; entry != NULL; entry = entry->lru_next) {
+        rb_gc_mark(entry->result);
+    }
+}
+
+static void
+free_results(void *ptr)
+{
+    struct result_cache *cache = ptr;
+
+    shrink_to(cache, 0);
+    free(cache->buckets);
+    free(cache);
+}
+
+/*
+ * Registers the cache with the garbage collector, which has to see the cached
+ * strings.
+ */
+void
+result_cache_init(void)
+{
+#ifdef HAVE_RB_RACTOR_LOCAL_STORAGE_PTR_NEWKEY
+    cache_key = rb_ractor_local_storage_ptr_newkey(&result_cache_type);
+#else
+    rb_gc_register_mark_object(TypedData_Wrap_Struct(0, &result_cache_type, &global_cache));
+#endif
+}
+
+int
+result_cache_enabled(void)
+{
+    return __atomic_load_n(&budget, __ATOMIC_RELAXED) > 0;
+}
+
+/*
+ * Returns the cached result or Qundef when there's none for a file with the
+ * given +identity+. Results of older versions of the file are dropped.
+ */
+VALUE
+result_cache_get(const char *path, unsigned lineno, int kind,
+                 const struct file_identity *identity)
+{
+    struct result_cache *cache = current_cache();
+    struct cached_result *entry;
+
+    if (cache == NULL ||
+        (entry = lookup(cache, path, hash_key(path, lineno, kind), lineno, kind)) == NULL)
+    {
+        stats_add(STATS_RESULT_CACHE_MISSES, 1);
+        return Qundef;
+    }
+
+    if (!file_identity_equal(&entry->identity, identity)) {
+        evict(cache, entry);
+        stats_add(STATS_RESULT_CACHE_MISSES, 1);
+        return Qundef;
+    }
+
+    lru_unlink(cache, entry);
+    lru_push(cache, entry);
+    stats_add(STATS_RESULT_CACHE_HITS, 1);
+
+    return entry->result;
+}
+
+/*
+ * Caches +result+, which must be a frozen String. Results that don't fit into
+ * the budget on their own aren't cached, and neither are results that the
+ * cache runs out of memory for.
+ */
+void
+result_cache_put(const char *path, unsigned lineno, int kind,
+                 const struct file_identity *identity, VALUE result)
+{
+    struct result_cache *cache = current_cache();
+    unsigned long hash = hash_key(path, lineno, kind);
+    size_t entry_bytes = sizeof(struct cached_result) + strlen(path) + 1 + RSTRING_LEN(result);
+    size_t limit = __atomic_load_n(&budget, __ATOMIC_RELAXED);
+    struct cached_result *entry;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    if ((entry = lookup(cache, path, hash, lineno, kind)) != NULL) {
+        evict(cache, entry);
+    }
+
+    if (entry_bytes > limit) {
+        return;
+    }
+
+    shrink_to(cache, limit - entry_bytes);
+
+    if (cache->count >= cache->nbuckets && grow_buckets(cache) == -1) {
+        return;
+    }
+
+    if ((entry = calloc(1, sizeof(struct cached_result))) == NULL ||
+        (entry->path = strdup(path)) == NULL)
+    {
+        free(entry);
+        return;
+    }
+
+    entry->hash = hash;
+    entry->lineno = lineno;
+    entry->kind = kind;
+    entry->identity = *identity;
+    entry->result = result;
+    entry->bytes = entry_bytes;
+
+    entry->hash_next = cache->buckets[hash % cache->nbuckets];
+    cache->buckets[hash % cache->nbuckets] = entry;
+    lru_push(cache, entry);
+    cache->count++;
+    cache->bytes += entry_bytes;
+}
+
+size_t
+result_cache_budget(void)
+{
+    return __atomic_load_n(&budget, __ATOMIC_RELAXED);
+}
+
+/* Shrinks the cache of the current Ractor right away, the others on their next lookup. */
+void
+result_cache_set_budget(size_t new_budget)
+{
+    __atomic_store_n(&budget, new_budget, __ATOMIC_RELAXED);
+    current_cache();
+}
+
+size_t
+result_cache_bytes(void)
+{
+    struct result_cache *cache = current_cache();
+
+    return cache == NULL ? 0 : cache->bytes;
+}
+
+/* Empties the cache of the current Ractor right away, the others on their next lookup. */
+void
+result_cache_clear(void)
+{
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    current_cache();
+}
@@ -0,0 +1,30 @@
+#ifndef FAST_METHOD_SOURCE_RESULT_CACHE_H
+#define FAST_METHOD_SOURCE_RESULT_CACHE_H
+
+#include <stddef.h>
+#include <ruby.h>
+
+#include "file_cache.h"
+
+/*
+ * Memoized lookup results, keyed by the file, the line and the kind of lookup
+ * (source, comment or both). Every result remembers the identity of the file
+ * it was read from and is dropped as soon as the file changes. The cache is
+ * bounded by the size of the strings it holds and is off until a budget is
+ * set. Each Ractor has a cache of its own, bounded by the same budget;
+ * result_cache_set_budget() and result_cache_clear() reach the other Ractors'
+ * caches the next time those are used.
+ */
+
+void result_cache_init(void);
+int result_cache_enabled(void);
+VALUE result_cache_get(const char *path, unsigned lineno, int kind,
+                       const struct file_identity *identity);
+void result_cache_put(const char *path, unsigned lineno, int kind,
+                      const struct file_identity *identity, VALUE result);
+size_t result_cache_budget(void);
+void result_cache_set_budget(size_t budget);
+size_t result_cache_bytes(void);
+void result_cache_clear(void);
+
+#endif
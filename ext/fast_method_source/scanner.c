@@ -0,0 +1,681 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "scanner.h"
+#include "stats.h"
+
+/* Definitions indented deeper than this aren't indexed. */
+#define SPAN_MAX_INDENT 256
+
+struct span_buf {
+    struct span *spans;
+    size_t count;
+    size_t capa;
+
+    /* Links definitions that wait for their `end` with the same indentation. */
+    long *next_pending;
+};
+
+/* An expression that started at +lineno+, at a nesting depth of +depth+. */
+struct open_expr {
+    unsigned lineno;
+    int depth;
+};
+
+static size_t line_body_len(const char *line, size_t line_len);
+static size_t count_prefix_spaces(const char *line, size_t line_len);
+static int starts_with(const char *line, size_t line_len, const char *prefix, size_t prefix_len);
+static int is_definition_end(const char *line, size_t line_len);
+static int contains_end_kw(const char *line, size_t line_len);
+static int contains_heredoc_start(const char *line, size_t line_len);
+static int is_blank(const char *line, size_t line_len);
+static int is_comment(const char *line, size_t line_len);
+static int is_static_definition_start(const char *line, size_t line_len);
+static int is_identifier_char(char c);
+static const struct span *find_span(struct mapped_file *file, unsigned lineno);
+static const char *walk_comment_start(struct mapped_file *file, unsigned lineno);
+static enum scan_status scan_one_liner(struct expr_scan *scan);
+static enum scan_status scan_span(struct expr_scan *scan);
+static enum scan_status scan_indentation(struct expr_scan *scan, size_t budget);
+static enum scan_status scan_lexer(struct expr_scan *scan, size_t budget);
+static enum scan_status scan_lines(struct expr_scan *scan, size_t budget);
+static void fall_back_to_lines(struct expr_scan *scan);
+static struct span *push_span(struct span_buf *buf, struct mapped_file *file,
+                              unsigned lineno, const char *line);
+static int compare_spans(const void *a, const void *b);
+
+static size_t
+line_body_len(const char *line, size_t line_len)
+{
+    if (line_len > 0 && line[line_len - 1] == '\n') {
+        line_len--;
+    }
+
+    return line_len;
+}
+
+static size_t
+count_prefix_spaces(const char *line, size_t line_len)
+{
+    size_t spaces = 0;
+
+    while (spaces < line_len && line[spaces] == ' ') {
+        spaces++;
+    }
+
+    return spaces;
+}
+
+static int
+starts_with(const char *line, size_t line_len, const char *prefix, size_t prefix_len)
+{
+    return line_len >= prefix_len && memcmp(line, prefix, prefix_len) == 0;
+}
+
+static int
+is_definition_end(const char *line, size_t line_len)
+{
+    size_t i = count_prefix_spaces(line, line_len);
+
+    return starts_with(line + i, line_len - i, "end", 3);
+}
+
+static int
+contains_end_kw(const char *line, size_t line_len)
+{
+    for (size_t i = 0; i + 3 <= line_len; i++) {
+        if (line[i] == 'e' && line[i + 1] == 'n' && line[i + 2] == 'd') {
+            return i == 0 || line[i - 1] == ' ' || line[i - 1] == ';';
+        }
+    }
+
+    return 0;
+}
+
+/* Errs on the side of `<<` as an operator. */
+static int
+contains_heredoc_start(const char *line, size_t line_len)
+{
+    for (size_t i = 0; i + 1 < line_len; i++) {
+        if (line[i] == '<' && line[i + 1] == '<') {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int
+is_blank(const char *line, size_t line_len)
+{
+    return line_len == 1 && line[0] == '\n';
+}
+
+static int
+is_comment(const char *line, size_t line_len)
+{
+    size_t i = count_prefix_spaces(line, line_len);
+
+    if (i == line_len || line[i] != '#') {
+        return 0;
+    }
+
+    return i + 1 == line_len || line[i + 1] != '{';
+}
+
+static int
+is_static_definition_start(const char *line, size_t line_len)
+{
+    size_t i = count_prefix_spaces(line, line_len);
+
+    return starts_with(line + i, line_len - i, "def ", 4) ||
+        starts_with(line + i, line_len - i, "class ", 6);
+}
+
+static int
+is_identifier_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+        c == '_' || (unsigned char) c >= 0x80;
+}
+
+static const struct span *
+find_span(struct mapped_file *file, unsigned lineno)
+{
+    if (!__atomic_load_n(&file->has_spans, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+
+    return span_index_find(&file->spans, lineno);
+}
+
+/*
+ * Returns the start of the comment above the method at +lineno+, or the start
+ * of the method's line when there's no comment. The comment always ends where
+ * the method begins, so the two can be sliced out of the file together.
+ */
+const char *
+scan_comment_start(struct mapped_file *file, unsigned lineno)
+{
+    const struct span *span = find_span(file, lineno);
+
+    if (span != NULL) {
+        return file->map + span->comment_start;
+    }
+
+    return walk_comment_start(file, lineno);
+}
+
+static const char *
+walk_comment_start(struct mapped_file *file, unsigned lineno)
+{
+    size_t line_len;
+    const char *comment_start = mapped_file_line(file, lineno, &line_len);
+    const char *line;
+
+    while (--lineno != 0) {
+        line = mapped_file_line(file, lineno, &line_len);
+
+        /* A single blank line may separate a comment from its method. */
+        if (is_blank(line, line_len) && lineno > 1) {
+            line = mapped_file_line(file, --lineno, &line_len);
+        }
+
+        if (!is_comment(line, line_len)) {
+            break;
+        }
+
+        comment_start = line;
+    }
+
+    return comment_start;
+}
+
+/*
+ * Returns the end of the expression that starts at +lineno+, given that its
+ * last token ends right before byte +end_column+ of line +end_lineno+, which
+ * is what an iseq knows about the code it was compiled from. The location is
+ * trusted when nothing but a comment follows it on the line, as after an
+ * endless def, unless the line starts a heredoc that goes on below it. After
+ * a token that closes the expression (an `end` or a `}`), calls and closing
+ * brackets may follow too, as long as nothing could carry the expression over
+ * to the next line. Returns NULL otherwise, and the expression is left to a
+ * scan.
+ */
+const char *
+scan_code_end(struct mapped_file *file, unsigned lineno, unsigned end_lineno, size_t end_column)
+{
+    size_t line_len, body_len, rest;
+    const char *line;
+
+    if (end_lineno < lineno || mapped_file_line(file, lineno, &line_len) == NULL ||
+        (line = mapped_file_line(file, end_lineno, &line_len)) == NULL)
+    {
+        return NULL;
+    }
+
+    body_len = line_body_len(line, line_len);
+
+    if (end_column > body_len) {
+        return NULL;
+    }
+
+    rest = end_column;
+    while (rest < body_len && memchr(" \t\r", line[rest], 3) != NULL) {
+        rest++;
+    }
+
+    if ((rest == body_len || line[rest] == '#') && !contains_heredoc_start(line, end_column)) {
+        return line + line_len;
+    }
+
+    if (!(end_column >= 3 && memcmp(line + end_column - 3, "end", 3) == 0 &&
+          (end_column == 3 || !is_identifier_char(line[end_column - 4]))) &&
+        !(end_column >= 1 && line[end_column - 1] == '}'))
+    {
+        return NULL;
+    }
+
+    /* Closing brackets and calls without arguments, as in `end.freeze`. */
+    for (size_t i = end_column; i < body_len && line[i] != '#'; i++) {
+        if (line[i] == '.') {
+            size_t name_start = ++i;
+
+            while (i < body_len && is_identifier_char(line[i])) {
+                i++;
+            }
+
+            if (i == name_start) {
+                return NULL;
+            }
+
+            if (i < body_len && (line[i] == '?' || line[i] == '!')) {
+                i++;
+            }
+
+            i--;
+        } else if (memchr(" \t\r)]},;", line[i], 8) == NULL) {
+            return NULL;
+        }
+    }
+
+    return line + line_len;
+}
+
+/*
+ * Prepares a scan of the expression that starts at +lineno+, which must exist
+ * in the file. A `def` or `class` is expected to end with an `end` at the same
+ * indentation, everything else is left to the lexer. Both give way to a span a
+ * parser located.
+ */
+void
+expr_scan_init(struct expr_scan *scan, struct mapped_file *file, unsigned lineno)
+{
+    size_t line_len;
+    const char *line = mapped_file_line(file, lineno, &line_len);
+    size_t body_len = line_body_len(line, line_len);
+
+    scan->file = file;
+    scan->start = line;
+    scan->start_lineno = lineno;
+    scan->lineno = lineno;
+    scan->prefix_len = count_prefix_spaces(line, body_len);
+    scan->span = find_span(file, lineno);
+    scan->end = NULL;
+    scan->confirm = 0;
+    scan->bytes_scanned = 0;
+    scan->lines_walked = 0;
+
+    if (scan->span != NULL && scan->span->kind == SPAN_EXACT) {
+        scan->mode = SCAN_SPAN;
+    } else if (is_static_definition_start(line, body_len)) {
+        scan->mode = SCAN_ONE_LINER;
+    } else if (scan->span != NULL) {
+        scan->mode = SCAN_SPAN;
+    } else {
+        scan->mode = SCAN_LEXER;
+        lexer_init(&scan->lexer);
+    }
+}
+
+/*
+ * Looks for the next candidate end, reading at most about +budget+ bytes.
+ */
+enum scan_status
+expr_scan_next(struct expr_scan *scan, size_t budget)
+{
+    switch (scan->mode) {
+      case SCAN_ONE_LINER:
+        return scan_one_liner(scan);
+      case SCAN_SPAN:
+        return scan_span(scan);
+      case SCAN_INDENTATION:
+        return scan_indentation(scan, budget);
+      case SCAN_LEXER:
+        return scan_lexer(scan, budget);
+      case SCAN_LINES:
+        return scan_lines(scan, budget);
+      case SCAN_EXHAUSTED:
+        break;
+    }
+
+    return SCAN_NOT_FOUND;
+}
+
+/* A definition on a single line, such as `def foo; end`. */
+static enum scan_status
+scan_one_liner(struct expr_scan *scan)
+{
+    size_t line_len;
+    const char *line = mapped_file_line(scan->file, scan->start_lineno, &line_len);
+
+    scan->mode = scan->span != NULL ? SCAN_SPAN : SCAN_INDENTATION;
+    scan->lineno = scan->start_lineno + 1;
+    scan->bytes_scanned += line_len;
+    scan->lines_walked++;
+
+    if (contains_end_kw(line, line_body_len(line, line_len))) {
+        scan->end = line + line_len;
+        scan->confirm = 1;
+        return SCAN_FOUND;
+    }
+
+    return expr_scan_next(scan, SCAN_UNLIMITED);
+}
+
+/*
+ * Takes the end from the span index. A definition ends where the index says
+ * it does, just like it would with scan_indentation(), and so does anything a
+ * parser located. The end of any other expression is only a candidate; when
+ * the parser rejects it, the lexer starts over as if there was no index.
+ */
+static enum scan_status
+scan_span(struct expr_scan *scan)
+{
+    const struct span *span = scan->span;
+
+    if (span->kind == SPAN_DEFINITION || span->kind == SPAN_EXACT) {
+        scan->mode = SCAN_EXHAUSTED;
+
+        if (span->end_line == 0) {
+            return SCAN_NOT_FOUND;
+        }
+
+        scan->end = scan->file->map + span->end_byte;
+        scan->confirm = 0;
+        return SCAN_FOUND;
+    }
+
+    scan->mode = SCAN_LEXER;
+    lexer_init(&scan->lexer);
+    scan->end = scan->file->map + span->end_byte;
+    scan->confirm = 1;
+    return SCAN_FOUND;
+}
+
+/* Looks for an `end` with the same indentation as the definition. */
+static enum scan_status
+scan_indentation(struct expr_scan *scan, size_t budget)
+{
+    size_t line_len, body_len, scanned = 0;
+    const char *line;
+
+    while ((line = mapped_file_line(scan->file, scan->lineno, &line_len)) != NULL) {
+        scan->lineno++;
+        scan->bytes_scanned += line_len;
+        scan->lines_walked++;
+        body_len = line_body_len(line, line_len);
+
+        if (body_len > 0 && !is_comment(line, body_len) &&
+            is_definition_end(line, body_len) &&
+            count_prefix_spaces(line, body_len) == scan->prefix_len)
+        {
+            scan->mode = SCAN_EXHAUSTED;
+            scan->end = line + line_len;
+            scan->confirm = 0;
+            return SCAN_FOUND;
+        }
+
+        if ((scanned += line_len) >= budget) {
+            return SCAN_SUSPENDED;
+        }
+    }
+
+    scan->mode = SCAN_EXHAUSTED;
+    return SCAN_NOT_FOUND;
+}
+
+/*
+ * Feeds lines to the lexer. Each line where it sees all constructs closed is
+ * a candidate, unless the next line continues the expression with a method
+ * call. Falls back to trying every line when the lexer can't make sense of
+ * the code.
+ */
+static enum scan_status
+scan_lexer(struct expr_scan *scan, size_t budget)
+{
+    enum lexer_status status;
+    size_t line_len, next_len, scanned = 0;
+    const char *line, *next_line;
+
+    while ((line = mapped_file_line(scan->file, scan->lineno, &line_len)) != NULL) {
+        next_line = mapped_file_line(scan->file, ++scan->lineno, &next_len);
+        status = lexer_feed_line(&scan->lexer, line, line_len);
+        scan->bytes_scanned += line_len;
+        scan->lines_walked++;
+
+        if (status == LEXER_UNBALANCED) {
+            break;
+        }
+
+        if (status == LEXER_COMPLETE &&
+            (next_line == NULL || !lexer_continues_on(next_line, next_len)))
+        {
+            scan->end = line + line_len;
+            scan->confirm = 1;
+            return SCAN_FOUND;
+        }
+
+        if ((scanned += line_len) >= budget) {
+            return SCAN_SUSPENDED;
+        }
+    }
+
+    fall_back_to_lines(scan);
+
+    return scan_lines(scan, budget > scanned ? budget - scanned : 1);
+}
+
+static void
+fall_back_to_lines(struct expr_scan *scan)
+{
+    scan->mode = SCAN_LINES;
+    scan->lineno = scan->start_lineno;
+    stats_add(STATS_LINE_SCAN_FALLBACKS, 1);
+}
+
+/*
+ * Proposes every line that isn't blank or a comment. Quadratic in the length
+ * of the expression once the parser gets involved, so it's only a fallback
+ * for the lexer.
+ */
+static enum scan_status
+scan_lines(struct expr_scan *scan, size_t budget)
+{
+    size_t line_len, body_len, scanned = 0;
+    const char *line;
+
+    while ((line = mapped_file_line(scan->file, scan->lineno, &line_len)) != NULL) {
+        scan->lineno++;
+        scan->bytes_scanned += line_len;
+        scan->lines_walked++;
+        body_len = line_body_len(line, line_len);
+
+        if (body_len > 0 && !is_comment(line, body_len)) {
+            scan->end = line + line_len;
+            scan->confirm = 1;
+            return SCAN_FOUND;
+        }
+
+        if ((scanned += line_len) >= budget) {
+            return SCAN_SUSPENDED;
+        }
+    }
+
+    scan->mode = SCAN_EXHAUSTED;
+    return SCAN_NOT_FOUND;
+}
+
+static struct span *
+push_span(struct span_buf *buf, struct mapped_file *file, unsigned lineno, const char *line)
+{
+    struct span *span;
+
+    if (buf->count == buf->capa) {
+        size_t capa = buf->capa == 0 ? 64 : buf->capa * 2;
+        struct span *spans = realloc(buf->spans, capa * sizeof(struct span));
+        long *next_pending;
+
+        if (spans == NULL) {
+            return NULL;
+        }
+
+        buf->spans = spans;
+
+        if ((next_pending = realloc(buf->next_pending, capa * sizeof(long))) == NULL) {
+            return NULL;
+        }
+
+        buf->next_pending = next_pending;
+        buf->capa = capa;
+    }
+
+    buf->next_pending[buf->count] = -1;
+    span = &buf->spans[buf->count++];
+    memset(span, 0, sizeof(struct span));
+    span->start_line = lineno;
+    span->start_byte = line - file->map;
+
+    return span;
+}
+
+static int
+compare_spans(const void *a, const void *b)
+{
+    const struct span *span_a = a;
+    const struct span *span_b = b;
+
+    return span_a->start_line < span_b->start_line ? -1 : span_a->start_line > span_b->start_line;
+}
+
+/*
+ * Finds the extent of every definition in the file in one pass. Definitions
+ * (`def` and `class`) are matched with their `end` by indentation, the same
+ * way a single lookup does it. Everything else that spans several lines is
+ * tracked by a lexer fed the whole file: an expression that starts a
+ * statement at depth n ends at the first statement boundary back at depth n.
+ * The file must be indexed. Returns -1 when it runs out of memory.
+ */
+int
+span_index_build(struct span_index *index, struct mapped_file *file)
+{
+    struct ruby_lexer lexer;
+    struct span_buf buf = {NULL, 0, 0, NULL};
+    struct open_expr *open = NULL;
+    size_t nopen = 0, open_capa = 0;
+    long pending[SPAN_MAX_INDENT];
+    size_t line_len, next_len, body_len, prefix_len;
+    const char *line, *next_line;
+    unsigned lineno = 1;
+    struct span *span;
+    uint64_t started = stats_now();
+
+    for (int i = 0; i < SPAN_MAX_INDENT; i++) {
+        pending[i] = -1;
+    }
+
+    lexer_init(&lexer);
+
+    for (line = mapped_file_line(file, lineno, &line_len); line != NULL;
+         line = next_line, line_len = next_len, lineno++)
+    {
+        int at_start = lexer_at_statement_start(&lexer);
+        int depth = lexer.depth;
+        int definition = 0;
+
+        next_line = mapped_file_line(file, lineno + 1, &next_len);
+        body_len = line_body_len(line, line_len);
+        prefix_len = count_prefix_spaces(line, body_len);
+
+        if (prefix_len < SPAN_MAX_INDENT && body_len > 0 &&
+            !is_comment(line, body_len) && is_definition_end(line, body_len))
+        {
+            for (long i = pending[prefix_len]; i != -1; i = buf.next_pending[i]) {
+                buf.spans[i].end_line = lineno;
+                buf.spans[i].end_byte = line + line_len - file->map;
+            }
+            pending[prefix_len] = -1;
+        }
+
+        if (is_static_definition_start(line, body_len)) {
+            definition = 1;
+
+            if (prefix_len < SPAN_MAX_INDENT) {
+                if ((span = push_span(&buf, file, lineno, line)) == NULL) {
+                    goto nomem;
+                }
+
+                span->kind = SPAN_DEFINITION;
+                buf.next_pending[buf.count - 1] = pending[prefix_len];
+                pending[prefix_len] = buf.count - 1;
+            }
+        }
+
+        if (lexer.unbalanced) {
+            continue;
+        }
+
+        /* Tells lines with code apart from blank and comment lines. */
+        lexer.seen_token = 0;
+        lexer_feed_line(&lexer, line, line_len);
+
+        if (at_start && lexer.seen_token && !definition) {
+            if (nopen == open_capa) {
+                size_t capa = open_capa == 0 ? 16 : open_capa * 2;
+                struct open_expr *grown = realloc(open, capa * sizeof(struct open_expr));
+
+                if (grown == NULL) {
+                    goto nomem;
+                }
+
+                open = grown;
+                open_capa = capa;
+            }
+
+            open[nopen].lineno = lineno;
+            open[nopen].depth = depth;
+            nopen++;
+        }
+
+        int complete = lexer_at_statement_start(&lexer) &&
+            (next_line == NULL || !lexer_continues_on(next_line, next_len));
+
+        while (nopen > 0) {
+            struct open_expr *expr = &open[nopen - 1];
+
+            /* The expression closed more than it opened. */
+            if (lexer.unbalanced || lexer.depth < expr->depth) {
+                nopen--;
+                continue;
+            }
+
+            if (lexer.depth > expr->depth || !complete) {
+                break;
+            }
+
+            /* One-liners are found just as fast without an index. */
+            if (lineno > expr->lineno) {
+                size_t start_len;
+                const char *start = mapped_file_line(file, expr->lineno, &start_len);
+
+                if ((span = push_span(&buf, file, expr->lineno, start)) == NULL) {
+                    goto nomem;
+                }
+
+                span->kind = SPAN_EXPRESSION;
+                span->end_line = lineno;
+                span->end_byte = line + line_len - file->map;
+            }
+
+            nopen--;
+        }
+    }
+
+    free(open);
+    free(buf.next_pending);
+
+    for (size_t i = 0; i < buf.count; i++) {
+        span = &buf.spans[i];
+        span->comment_start = walk_comment_start(file, span->start_line) - file->map;
+    }
+
+    qsort(buf.spans, buf.count, sizeof(struct span), compare_spans);
+
+    index->spans = buf.spans;
+    index->count = buf.count;
+    index->map = NULL;
+    index->map_size = 0;
+
+    stats_add(STATS_BYTES_SCANNED, file->map_size);
+    stats_add(STATS_LINES_WALKED, lineno - 1);
+    stats_add(STATS_SCAN_NS, stats_now() - started);
+
+    return 0;
+
+nomem:
+    free(open);
+    free(buf.next_pending);
+    free(buf.spans);
+
+    return -1;
+}
@@ -0,0 +1,69 @@
+#ifndef FAST_METHOD_SOURCE_SCANNER_H
+#define FAST_METHOD_SOURCE_SCANNER_H
+
+#include <stddef.h>
+
+#include "file_cache.h"
+#include "lexer.h"
+
+/*
+ * The byte-scanning half of a lookup. Nothing in here touches the Ruby VM, so
+ * all of it can run without the GVL, as long as the file is indexed
+ * (mapped_file_index()) beforehand.
+ *
+ * Finding the end of an expression is a sequence of candidates: the scanner
+ * proposes an end, and the caller, holding the GVL, asks the parser whether
+ * the code up to there is complete. If it's not, the scan resumes right after
+ * the rejected candidate.
+ *
+ * Once a file has a span index (span_index_build()), the first candidate of
+ * an expression the index knows comes straight out of it.
+ */
+
+enum scan_mode {
+    SCAN_ONE_LINER,
+    SCAN_SPAN,
+    SCAN_INDENTATION,
+    SCAN_LEXER,
+    SCAN_LINES,
+    SCAN_EXHAUSTED
+};
+
+enum scan_status {
+    /* scan->end holds a candidate. It must be parsed when scan->confirm. */
+    SCAN_FOUND,
+    /* There are no more candidates. */
+    SCAN_NOT_FOUND,
+    /* The byte budget ran out before a candidate was found. */
+    SCAN_SUSPENDED
+};
+
+struct expr_scan {
+    struct mapped_file *file;
+    enum scan_mode mode;
+    const char *start;
+    unsigned start_lineno;
+    unsigned lineno;
+    size_t prefix_len;
+    const struct span *span;
+
+    const char *end;
+    int confirm;
+
+    /* What it took so far, for stats.h. */
+    size_t bytes_scanned;
+    unsigned long lines_walked;
+
+    struct ruby_lexer lexer;
+};
+
+#define SCAN_UNLIMITED ((size_t) -1)
+
+const char *scan_comment_start(struct mapped_file *file, unsigned lineno);
+const char *scan_code_end(struct mapped_file *file, unsigned lineno,
+                          unsigned end_lineno, size_t end_column);
+void expr_scan_init(struct expr_scan *scan, struct mapped_file *file, unsigned lineno);
+enum scan_status expr_scan_next(struct expr_scan *scan, size_t budget);
+int span_index_build(struct span_index *index, struct mapped_file *file);
+
+#endif
@@ -0,0 +1,45 @@
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#include "span_index.h"
+
+/*
+ * Returns the span that starts at +lineno+ or NULL if none does. A binary
+ * search over the spans of the file.
+ */
+const struct span *
+span_index_find(const struct span_index *index, unsigned lineno)
+{
+    size_t low = 0;
+    size_t high = index->count;
+
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        const struct span *span = &index->spans[mid];
+
+        if (span->start_line == lineno) {
+            return span;
+        } else if (span->start_line < lineno) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+
+    return NULL;
+}
+
+void
+span_index_free(struct span_index *index)
+{
+    if (index->map != NULL) {
+        munmap(index->map, index->map_size);
+    } else {
+        free((void *) index->spans);
+    }
+
+    index->spans = NULL;
+    index->count = 0;
+    index->map = NULL;
+    index->map_size = 0;
+}
@@ -0,0 +1,48 @@
+#ifndef FAST_METHOD_SOURCE_SPAN_INDEX_H
+#define FAST_METHOD_SOURCE_SPAN_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum span_kind {
+    /* A `def` or `class` that ends with an `end` at the same indentation. */
+    SPAN_DEFINITION,
+    /* Anything else the lexer saw spanning several lines, such as a block. */
+    SPAN_EXPRESSION,
+    /* Where a parser says the expression ends (prism_engine.h). */
+    SPAN_EXACT
+};
+
+/*
+ * Where a definition starts and ends. Offsets are relative to the start of
+ * the file; end_byte points right after the newline of the last line. A
+ * definition without an `end` has an end_line of 0.
+ *
+ * Fixed-width fields without padding, so that an index stored on disk
+ * (span_store.h) can be used right out of its mapping.
+ */
+struct span {
+    uint32_t start_line;
+    uint32_t end_line;
+    uint64_t start_byte;
+    uint64_t end_byte;
+    uint64_t comment_start;
+    uint32_t kind;
+    uint32_t reserved;
+};
+
+/*
+ * Spans sorted by start_line. They are either malloc()ed or, when map is
+ * set, live in a mapping of map_size bytes.
+ */
+struct span_index {
+    const struct span *spans;
+    size_t count;
+    void *map;
+    size_t map_size;
+};
+
+const struct span *span_index_find(const struct span_index *index, unsigned lineno);
+void span_index_free(struct span_index *index);
+
+#endif
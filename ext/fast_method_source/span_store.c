@@ -0,0 +1,374 @@
+#define _XOPEN_SOURCE 700
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ruby.h>
+#include <ruby/thread_native.h>
+
+#include "scanner.h"
+#include "span_store.h"
+
+#define SPAN_STORE_MAGIC "FMSSPANS"
+#define SPAN_STORE_BYTE_ORDER 0x01020304
+
+/* Followed by the path, padded to 8 bytes, and then by the spans. */
+struct span_store_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t span_size;
+    uint32_t path_len;
+    uint64_t source_size;
+    uint64_t digest;
+    uint64_t count;
+};
+
+/* Guards the directory. NULL when the store is disabled. */
+static rb_nativethread_lock_t lock;
+static char *directory;
+
+/* Tells temporary files of the threads of this process apart. */
+static unsigned long temp_serial;
+
+static uint64_t digest_of(const char *data, size_t len);
+static size_t padded_path_len(size_t path_len);
+static char *cache_path_of(const char *directory, const char *path);
+static int make_directories(char *directory);
+static int load_index(struct span_index *index, const char *cache_path,
+                      const struct mapped_file *file, uint64_t digest);
+static int valid_spans(const struct span *spans, uint64_t count, size_t source_size);
+static int store_index(const struct span_index *index, char *directory, const char *cache_path,
+                       const struct mapped_file *file, uint64_t digest);
+static int write_all(int fd, const void *data, size_t len);
+
+/*
+ * A fast, non-cryptographic digest: eight bytes at a time, each mixed in with
+ * a multiply and a shift. It guards against stale cache files, not against
+ * tampering, so the cache directory must only be writable by trusted users.
+ */
+static uint64_t
+digest_of(const char *data, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+    uint64_t word;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+        hash ^= hash >> 29;
+    }
+
+    word = 0;
+    memcpy(&word, data + i, len - i);
+    hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+static size_t
+padded_path_len(size_t path_len)
+{
+    return (path_len + 7) & ~(size_t) 7;
+}
+
+static char *
+cache_path_of(const char *directory, const char *path)
+{
+    size_t len = strlen(directory) + 1 + 16 + sizeof(".spans");
+    char *cache_path = malloc(len);
+
+    if (cache_path != NULL) {
+        snprintf(cache_path, len, "%s/%016llx.spans", directory,
+                 (unsigned long long) digest_of(path, strlen(path)));
+    }
+
+    return cache_path;
+}
+
+/* Like `mkdir -p`. Modifies +directory+ while it works, but restores it. */
+static int
+make_directories(char *directory)
+{
+    for (char *slash = directory + 1; ; slash++) {
+        if (*slash != '/' && *slash != '\0') {
+            continue;
+        }
+
+        char separator = *slash;
+
+        *slash = '\0';
+        if (mkdir(directory, 0755) == -1 && errno != EEXIST) {
+            *slash = separator;
+            return -1;
+        }
+        *slash = separator;
+
+        if (separator == '\0') {
+            return 0;
+        }
+    }
+}
+
+/*
+ * Maps the cache file and takes its spans if it was built from exactly the
+ * contents of +file+. Returns -1 if it can't be used.
+ */
+static int
+load_index(struct span_index *index, const char *cache_path,
+           const struct mapped_file *file, uint64_t digest)
+{
+    const struct span_store_header *header;
+    size_t path_len = strlen(file->path);
+    size_t spans_offset = sizeof(struct span_store_header) + padded_path_len(path_len);
+    struct stat filestat;
+    char *map;
+    int fd;
+
+    if ((fd = open(cache_path, O_RDONLY)) == -1) {
+        return -1;
+    }
+
+    if (fstat(fd, &filestat) == -1 || (size_t) filestat.st_size < spans_offset) {
+        close(fd);
+        return -1;
+    }
+
+    map = mmap(NULL, filestat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED) {
+        return -1;
+    }
+
+    header = (const struct span_store_header *) map;
+
+    if (memcmp(header->magic, SPAN_STORE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SPAN_STORE_VERSION ||
+        header->byte_order != SPAN_STORE_BYTE_ORDER ||
+        header->span_size != sizeof(struct span) ||
+        header->path_len != path_len ||
+        memcmp(map + sizeof(struct span_store_header), file->path, path_len) != 0 ||
+        header->source_size != file->map_size ||
+        header->digest != digest ||
+        header->count > ((size_t) filestat.st_size - spans_offset) / sizeof(struct span) ||
+        spans_offset + header->count * sizeof(struct span) != (size_t) filestat.st_size ||
+        !valid_spans((const struct span *) (map + spans_offset), header->count, file->map_size))
+    {
+        munmap(map, filestat.st_size);
+        return -1;
+    }
+
+    index->spans = (const struct span *) (map + spans_offset);
+    index->count = header->count;
+    index->map = map;
+    index->map_size = filestat.st_size;
+
+    return 0;
+}
+
+/*
+ * Lookups trust the offsets of a span, so a cache file has to be sane before
+ * it's used: sorted, and within the source file.
+ */
+static int
+valid_spans(const struct span *spans, uint64_t count, size_t source_size)
+{
+    for (uint64_t i = 0; i < count; i++) {
+        const struct span *span = &spans[i];
+
+        if ((i > 0 && span->start_line <= spans[i - 1].start_line) ||
+            span->kind > SPAN_EXPRESSION ||
+            span->comment_start > span->start_byte ||
+            span->start_byte >= source_size ||
+            span->end_byte > source_size ||
+            (span->end_line != 0 && span->end_byte <= span->start_byte))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/*
+ * Writes the index to a temporary file next to the cache file and renames it
+ * into place. Nothing is synced to disk: after a crash, a torn cache file
+ * fails validation and gets rebuilt.
+ */
+static int
+store_index(const struct span_index *index, char *directory, const char *cache_path,
+            const struct mapped_file *file, uint64_t digest)
+{
+    static const char padding[8];
+    struct span_store_header header;
+    size_t path_len = strlen(file->path);
+    size_t temp_len = strlen(cache_path) + 64;
+    char *temp_path = malloc(temp_len);
+    int fd, status = -1;
+
+    if (temp_path == NULL) {
+        return -1;
+    }
+
+    snprintf(temp_path, temp_len, "%s.%ld.%lu.tmp", cache_path, (long) getpid(),
+             __atomic_add_fetch(&temp_serial, 1, __ATOMIC_RELAXED));
+
+    fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd == -1 && errno == ENOENT && make_directories(directory) == 0) {
+        fd = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    }
+
+    if (fd == -1) {
+        free(temp_path);
+        return -1;
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SPAN_STORE_MAGIC, sizeof(header.magic));
+    header.version = SPAN_STORE_VERSION;
+    header.byte_order = SPAN_STORE_BYTE_ORDER;
+    header.span_size = sizeof(struct span);
+    header.path_len = path_len;
+    header.source_size = file->map_size;
+    header.digest = digest;
+    header.count = index->count;
+
+    if (write_all(fd, &header, sizeof(header)) == 0 &&
+        write_all(fd, file->path, path_len) == 0 &&
+        write_all(fd, padding, padded_path_len(path_len) - path_len) == 0 &&
+        write_all(fd, index->spans, index->count * sizeof(struct span)) == 0)
+    {
+        status = 0;
+    }
+
+    if (close(fd) == -1) {
+        status = -1;
+    }
+
+    if (status == 0 && rename(temp_path, cache_path) == -1) {
+        status = -1;
+    }
+
+    if (status == -1) {
+        unlink(temp_path);
+    }
+
+    free(temp_path);
+
+    return status;
+}
+
+static int
+write_all(int fd, const void *data, size_t len)
+{
+    const char *bytes = data;
+
+    while (len > 0) {
+        ssize_t written = write(fd, bytes, len);
+
+        if (written == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+
+        bytes += written;
+        len -= written;
+    }
+
+    return 0;
+}
+
+void
+span_store_init(void)
+{
+    rb_nativethread_lock_initialize(&lock);
+}
+
+int
+span_store_enabled(void)
+{
+    return __atomic_load_n(&directory, __ATOMIC_RELAXED) != NULL;
+}
+
+/* Returns a malloc()ed copy of the directory, or NULL when disabled. */
+char *
+span_store_directory(void)
+{
+    char *copy = NULL;
+
+    rb_nativethread_lock_lock(&lock);
+    if (directory != NULL) {
+        copy = strdup(directory);
+    }
+    rb_nativethread_lock_unlock(&lock);
+
+    return copy;
+}
+
+/* Disables the store when +new_directory+ is NULL. Returns -1 on OOM. */
+int
+span_store_set_directory(const char *new_directory)
+{
+    char *copy = NULL;
+    char *old;
+
+    if (new_directory != NULL && (copy = strdup(new_directory)) == NULL) {
+        return -1;
+    }
+
+    rb_nativethread_lock_lock(&lock);
+    old = directory;
+    __atomic_store_n(&directory, copy, __ATOMIC_RELAXED);
+    rb_nativethread_lock_unlock(&lock);
+
+    free(old);
+
+    return 0;
+}
+
+/*
+ * Loads the span index of the file from the store, or builds it and stores
+ * it for the next process. Without a store, it's just span_index_build().
+ * Failing to read or write the store is never an error. Returns -1 when it
+ * runs out of memory.
+ */
+int
+span_store_fetch(struct span_index *index, struct mapped_file *file)
+{
+    char *dir = span_store_directory();
+    char *cache_path;
+    uint64_t digest;
+    int status;
+
+    if (dir == NULL) {
+        return span_index_build(index, file);
+    }
+
+    if ((cache_path = cache_path_of(dir, file->path)) == NULL) {
+        free(dir);
+        return span_index_build(index, file);
+    }
+
+    digest = digest_of(file->map, file->map_size);
+
+    if (load_index(index, cache_path, file, digest) == 0) {
+        status = 0;
+    } else if ((status = span_index_build(index, file)) == 0) {
+        store_index(index, dir, cache_path, file, digest);
+    }
+
+    free(cache_path);
+    free(dir);
+
+    return status;
+}
@@ -0,0 +1,31 @@
+#ifndef FAST_METHOD_SOURCE_SPAN_STORE_H
+#define FAST_METHOD_SOURCE_SPAN_STORE_H
+
+#include "file_cache.h"
+#include "span_index.h"
+
+/*
+ * An optional on-disk cache of span indexes, so that a fresh process doesn't
+ * have to scan the files an earlier one already did. There's one cache file
+ * per source path, named after a hash of the path. It holds the path and a
+ * digest of the contents it was built from, followed by the spans as they are
+ * laid out in memory, so it's used straight out of its mapping.
+ *
+ * Cache files are written to a temporary file and renamed into place, so
+ * readers never see a partial file and concurrent writers just race to put
+ * the same contents there. A cache file that doesn't match the source, was
+ * written by another version of the format or doesn't make sense is ignored
+ * and replaced.
+ *
+ * Nothing in here touches the Ruby VM.
+ */
+
+#define SPAN_STORE_VERSION 1
+
+void span_store_init(void);
+int span_store_enabled(void);
+char *span_store_directory(void);
+int span_store_set_directory(const char *directory);
+int span_store_fetch(struct span_index *index, struct mapped_file *file);
+
+#endif
@@ -0,0 +1,176 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ruby.h>
+#include <ruby/thread_native.h>
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#endif
+
+#include "stats.h"
+
+#if defined(HAVE_PTHREAD_CREATE) && defined(RB_THREAD_LOCAL_SPECIFIER)
+# define STATS_PER_THREAD 1
+#endif
+
+struct stats_block {
+    unsigned long counters[STATS_COUNTERS];
+
+    /* Every block ever made. */
+    struct stats_block *next;
+    /* Blocks of threads that exited. */
+    struct stats_block *next_free;
+};
+
+/* Guards the lists and the baseline. Never taken when counting. */
+static rb_nativethread_lock_t lock;
+
+static struct stats_block *blocks;
+static unsigned long baseline[STATS_COUNTERS];
+
+#ifdef STATS_PER_THREAD
+static struct stats_block *free_blocks;
+static pthread_key_t block_key;
+static RB_THREAD_LOCAL_SPECIFIER struct stats_block *thread_block;
+
+static struct stats_block *attach_block(void);
+static void detach_block(void *block);
+#else
+/* Without thread-local storage, everybody counts into one block, atomically. */
+static struct stats_block shared_block;
+#endif
+
+static void sum_blocks(unsigned long totals[STATS_COUNTERS]);
+
+#ifdef STATS_PER_THREAD
+/*
+ * Gives the calling thread a block to count into: one left behind by a
+ * thread that exited, or a new one. Returns NULL when it runs out of memory,
+ * in which case the thread doesn't count.
+ */
+static struct stats_block *
+attach_block(void)
+{
+    struct stats_block *block;
+
+    rb_nativethread_lock_lock(&lock);
+    if ((block = free_blocks) != NULL) {
+        free_blocks = block->next_free;
+    } else if ((block = calloc(1, sizeof(struct stats_block))) != NULL) {
+        block->next = blocks;
+        blocks = block;
+    }
+    rb_nativethread_lock_unlock(&lock);
+
+    if (block != NULL) {
+        thread_block = block;
+        pthread_setspecific(block_key, block);
+    }
+
+    return block;
+}
+
+/* Runs when a thread that has a block exits. */
+static void
+detach_block(void *ptr)
+{
+    struct stats_block *block = ptr;
+
+    rb_nativethread_lock_lock(&lock);
+    block->next_free = free_blocks;
+    free_blocks = block;
+    rb_nativethread_lock_unlock(&lock);
+}
+#endif
+
+static void
+sum_blocks(unsigned long totals[STATS_COUNTERS])
+{
+    memset(totals, 0, sizeof(unsigned long) * STATS_COUNTERS);
+
+    for (struct stats_block *block = blocks; block != NULL; block = block->next) {
+        for (int i = 0; i < STATS_COUNTERS; i++) {
+            totals[i] += __atomic_load_n(&block->counters[i], __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void
+stats_init(void)
+{
+    rb_nativethread_lock_initialize(&lock);
+#ifdef STATS_PER_THREAD
+    pthread_key_create(&block_key, detach_block);
+#else
+    blocks = &shared_block;
+#endif
+}
+
+/*
+ * Only the owner of a block writes to it, so a plain add will do; the store
+ * is atomic so that readers never see a torn counter.
+ */
+void
+stats_add(enum stats_counter counter, unsigned long n)
+{
+#ifdef STATS_PER_THREAD
+    struct stats_block *block = thread_block;
+
+    if (block == NULL && (block = attach_block()) == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&block->counters[counter], block->counters[counter] + n, __ATOMIC_RELAXED);
+#else
+    __atomic_add_fetch(&shared_block.counters[counter], n, __ATOMIC_RELAXED);
+#endif
+}
+
+void
+stats_add_parse_attempts(unsigned attempts)
+{
+    int bucket = attempts;
+
+    if (attempts >= 16) {
+        bucket = 6;
+    } else if (attempts >= 8) {
+        bucket = 5;
+    } else if (attempts >= 4) {
+        bucket = 4;
+    }
+
+    stats_add(STATS_PARSE_ATTEMPTS + bucket, 1);
+}
+
+/* Nanoseconds on a monotonic clock. */
+uint64_t
+stats_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* The totals since the last reset. */
+void
+stats_read(unsigned long totals[STATS_COUNTERS])
+{
+    rb_nativethread_lock_lock(&lock);
+    sum_blocks(totals);
+    for (int i = 0; i < STATS_COUNTERS; i++) {
+        totals[i] -= baseline[i];
+    }
+    rb_nativethread_lock_unlock(&lock);
+}
+
+void
+stats_reset(void)
+{
+    rb_nativethread_lock_lock(&lock);
+    sum_blocks(baseline);
+    rb_nativethread_lock_unlock(&lock);
+}
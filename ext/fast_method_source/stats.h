@@ -0,0 +1,56 @@
+#ifndef FAST_METHOD_SOURCE_STATS_H
+#define FAST_METHOD_SOURCE_STATS_H
+
+#include <stdint.h>
+
+/*
+ * Counters of what lookups spend their time on, cheap enough to always be
+ * on. Every thread counts into a block of its own, without atomic operations
+ * or locks; the blocks are only summed up when the counters are read. The
+ * block of a thread that exits is handed over to the next thread that
+ * starts counting, so nothing is lost and the number of blocks never exceeds
+ * the number of threads that count at the same time.
+ *
+ * Resetting doesn't touch the blocks, which belong to their threads: it
+ * remembers the current totals, and reads subtract them.
+ *
+ * Nothing in here touches the Ruby VM.
+ */
+
+enum stats_counter {
+    STATS_FILES_OPENED,
+    STATS_FILES_MAPPED,
+    STATS_FILES_READ,
+    STATS_FILE_CACHE_HITS,
+    STATS_FILE_CACHE_MISSES,
+    STATS_RESULT_CACHE_HITS,
+    STATS_RESULT_CACHE_MISSES,
+    STATS_BYTES_SCANNED,
+    STATS_LINES_WALKED,
+    STATS_SCAN_NS,
+    STATS_PARSE_NS,
+    STATS_FAST_PATH_HITS,
+    STATS_FAST_PATH_FALLBACKS,
+    STATS_PRISM_FALLBACKS,
+    STATS_LINE_SCAN_FALLBACKS,
+    STATS_FILES_WARMED,
+    STATS_WARM_DROPPED,
+
+    /*
+     * How many times the parser was asked about candidates to find the end
+     * of an expression: 0, 1, 2, 3, 4 to 7, 8 to 15, and 16 or more.
+     */
+    STATS_PARSE_ATTEMPTS,
+    STATS_PARSE_ATTEMPTS_LAST = STATS_PARSE_ATTEMPTS + 6,
+
+    STATS_COUNTERS
+};
+
+void stats_init(void);
+void stats_add(enum stats_counter counter, unsigned long n);
+void stats_add_parse_attempts(unsigned attempts);
+uint64_t stats_now(void);
+void stats_read(unsigned long totals[STATS_COUNTERS]);
+void stats_reset(void);
+
+#endif
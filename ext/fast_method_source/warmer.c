@@ -0,0 +1,188 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdlib.h>
+#include <string.h>
+#include <ruby.h>
+#ifdef HAVE_PTHREAD_CREATE
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#include "file_cache.h"
+#include "prism_engine.h"
+#include "span_store.h"
+#include "stats.h"
+#include "warmer.h"
+
+struct warm_entry {
+    struct warm_entry *next;
+    char path[];
+};
+
+static void warm_file(const char *path);
+
+#ifdef HAVE_PTHREAD_CREATE
+/* Guards the queue and +running+. */
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+
+/*
+ * Held by the thread while it warms a file, and by fork() for its duration,
+ * so that a child never inherits a lock the thread took in the file cache.
+ */
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct warm_entry *queue_head;
+static struct warm_entry *queue_tail;
+static size_t queued;
+static int running;
+
+static void *warm_queued_files(void *arg);
+static void before_fork(void);
+static void after_fork_in_parent(void);
+static void after_fork_in_child(void);
+#endif
+
+/*
+ * Maps the file and indexes it, the way its second lookup would. The
+ * :prism engine parses files under the GVL, so under it only the lines are
+ * indexed.
+ */
+static void
+warm_file(const char *path)
+{
+    struct mapped_file *file = file_cache_try_acquire(path, NULL);
+    struct span_index spans;
+
+    if (file == NULL) {
+        return;
+    }
+
+    if (mapped_file_index(file) == 0 && !file->has_spans && !prism_engine_enabled() &&
+        span_store_fetch(&spans, file) == 0)
+    {
+        mapped_file_set_spans(file, &spans);
+    }
+
+    file_cache_release(file);
+    stats_add(STATS_FILES_WARMED, 1);
+}
+
+#ifdef HAVE_PTHREAD_CREATE
+/* Signals are for Ruby's threads to handle. */
+static void *
+warm_queued_files(void *arg)
+{
+    struct warm_entry *entry;
+    sigset_t signals;
+
+    sigfillset(&signals);
+    pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue_head == NULL) {
+            pthread_cond_wait(&queue_ready, &queue_lock);
+        }
+        entry = queue_head;
+        if ((queue_head = entry->next) == NULL) {
+            queue_tail = NULL;
+        }
+        queued--;
+        pthread_mutex_unlock(&queue_lock);
+
+        pthread_mutex_lock(&work_lock);
+        warm_file(entry->path);
+        pthread_mutex_unlock(&work_lock);
+
+        free(entry);
+    }
+
+    return NULL;
+}
+
+static void
+before_fork(void)
+{
+    pthread_mutex_lock(&work_lock);
+    pthread_mutex_lock(&queue_lock);
+}
+
+static void
+after_fork_in_parent(void)
+{
+    pthread_mutex_unlock(&queue_lock);
+    pthread_mutex_unlock(&work_lock);
+}
+
+static void
+after_fork_in_child(void)
+{
+    pthread_mutex_unlock(&queue_lock);
+    pthread_mutex_unlock(&work_lock);
+    pthread_cond_init(&queue_ready, NULL);
+    running = 0;
+}
+#endif
+
+void
+warmer_init(void)
+{
+#ifdef HAVE_PTHREAD_CREATE
+    pthread_atfork(before_fork, after_fork_in_parent, after_fork_in_child);
+#endif
+}
+
+/*
+ * Queues the file at +path+ to be warmed, starting the thread if it isn't
+ * running. Returns -1 when the file is dropped because the queue is full or
+ * the thread can't be had.
+ */
+int
+warmer_enqueue(const char *path)
+{
+#ifdef HAVE_PTHREAD_CREATE
+    size_t len = strlen(path);
+    struct warm_entry *entry = malloc(sizeof(struct warm_entry) + len + 1);
+    pthread_attr_t attr;
+    pthread_t thread;
+
+    if (entry == NULL) {
+        stats_add(STATS_WARM_DROPPED, 1);
+        return -1;
+    }
+
+    entry->next = NULL;
+    memcpy(entry->path, path, len + 1);
+
+    pthread_mutex_lock(&queue_lock);
+
+    if (!running && queued < file_cache_capacity() && pthread_attr_init(&attr) == 0) {
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        running = pthread_create(&thread, &attr, warm_queued_files, NULL) == 0;
+        pthread_attr_destroy(&attr);
+    }
+
+    if (!running || queued >= file_cache_capacity()) {
+        pthread_mutex_unlock(&queue_lock);
+        free(entry);
+        stats_add(STATS_WARM_DROPPED, 1);
+        return -1;
+    }
+
+    if (queue_tail != NULL) {
+        queue_tail->next = entry;
+    } else {
+        queue_head = entry;
+    }
+    queue_tail = entry;
+    queued++;
+
+    pthread_cond_signal(&queue_ready);
+    pthread_mutex_unlock(&queue_lock);
+#else
+    warm_file(path);
+#endif
+
+    return 0;
+}
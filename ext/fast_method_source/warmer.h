@@ -0,0 +1,22 @@
+#ifndef FAST_METHOD_SOURCE_WARMER_H
+#define FAST_METHOD_SOURCE_WARMER_H
+
+/*
+ * Loads and indexes files ahead of their first lookup, on a native thread of
+ * its own that never takes the GVL. Files are queued as they're required and
+ * warmed in that order: mapped into the file cache, with their lines and
+ * spans indexed. The queue holds no more files than the file cache does,
+ * since a file warmed beyond that would only push out another; files that
+ * don't fit are dropped.
+ *
+ * A forked child gets the queue, but not the thread: it's started again by
+ * the next file that's queued. Without pthreads, files are warmed right when
+ * they're queued.
+ *
+ * Nothing in here touches the Ruby VM.
+ */
+
+void warmer_init(void);
+int warmer_enqueue(const char *path);
+
+#endif
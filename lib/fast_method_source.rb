@@ -10,6 +10,19 @@ module FastMethodSource
   # The root path of Pry Theme source code.
   ROOT = File.expand_path(File.dirname(__FILE__))
 
+  # Loaded by FastMethodSource.engine=, so that Prism is only required by
+  # those who use it.
+  autoload :PrismEngine, File.join(ROOT, 'fast_method_source/prism_engine')
+
+  # Lets processes that can't configure the library, such as test workers,
+  # share an on-disk span index.
+  if ENV['FAST_METHOD_SOURCE_CACHE_DIR']
+    self.span_cache_dir = ENV['FAST_METHOD_SOURCE_CACHE_DIR']
+  end
+
+  # Wraps anything with a #source_location in #source, #comment and
+  # #comment_and_source. The lookups don't need it: FastMethodSource.source_for
+  # and friends take the method as is, and are faster at it.
   class Method
     include MethodExtensions
 
@@ -30,15 +43,116 @@ module FastMethodSource
     end
   end
 
-  def self.source_for(method)
-    FastMethodSource::Method.new(method).source
+  # Yields the method, source and comment of every method of a namespace (a
+  # module or class and everything nested in it), or of every method defined
+  # in the given files. Files are visited one at a time, methods in the order
+  # they appear in the file, and each file is unmapped as soon as it's done
+  # (files that were already cached stay).
+  # Returns an Enumerator without a block.
+  def self.each_source(namespace_or_files)
+    return enum_for(__method__, namespace_or_files) unless block_given?
+
+    methods_by_file = Hash.new { |hash, path| hash[path] = [] }
+    methods_in(namespace_or_files).each do |method|
+      path, line = method.source_location
+      methods_by_file[path] << [line, method] if path
+    end
+
+    methods_by_file.keys.sort.each do |path|
+      methods = methods_by_file.delete(path).sort_by!(&:first).map!(&:last)
+      each_source_in_file(path, methods) { |*tuple| yield tuple }
+    end
+
+    nil
+  end
+
+  # Warms up files as they're loaded, so that the first lookups into them
+  # don't have to read and scan them. With mode: :background, every file that
+  # is required or loaded from then on is queued for a native thread, which
+  # maps it and indexes its lines and methods without holding the GVL. Files
+  # outside of the +paths+ directories (all of them by default) are left
+  # alone.
+  # At most max_mapped_files files are queued at a time; the rest are
+  # dropped. mode: :off stops queueing files.
+  def self.warm!(mode: :background, paths: nil)
+    unless mode == :background || mode == :off
+      raise ArgumentError, "unknown warm-up mode #{mode.inspect} (expected :background or :off)"
+    end
+
+    @warm_trace&.disable
+    @warm_trace = nil
+    return if mode == :off
+
+    dirs = paths && Array(paths).map { |path| File.expand_path(path) }
+    prefixes = dirs&.map { |dir| File.join(dir, '') }
+    @warm_trace = TracePoint.new(:script_compiled) do |tp|
+      next if tp.eval_script
+
+      path = tp.instruction_sequence.path
+      if dirs.nil? || dirs.include?(path) || prefixes.any? { |prefix| path.start_with?(prefix) }
+        warm_file(path)
+      end
+    end
+    @warm_trace.enable
+
+    nil
+  end
+
+  def self.methods_in(namespace_or_files)
+    if namespace_or_files.is_a?(Module)
+      methods_in_namespace(namespace_or_files)
+    else
+      methods_in_files(Array(namespace_or_files))
+    end
   end
+  private_class_method :methods_in
+
+  def self.methods_in_namespace(namespace)
+    seen = {}.compare_by_identity
+    queue = [namespace]
+    methods = []
+
+    until queue.empty?
+      mod = queue.shift
+      next if seen[mod]
+      seen[mod] = true
 
-  def self.comment_for(method)
-    FastMethodSource::Method.new(method).comment
+      methods.concat(own_methods(mod))
+      mod.constants(false).each do |name|
+        next if mod.autoload?(name)
+        const = mod.const_get(name, false) rescue next
+        queue << const if const.is_a?(Module) && const.name&.start_with?("#{mod.name}::")
+      end
+    end
+
+    methods
   end
+  private_class_method :methods_in_namespace
+
+  def self.methods_in_files(files)
+    paths = files.map { |file| File.expand_path(file) }.to_h { |path| [path, true] }
+    methods = []
 
-  def self.comment_and_source_for(method)
-    self.comment_for(method) + self.source_for(method)
+    ObjectSpace.each_object(Module) do |mod|
+      # Their methods come with those of the module they belong to.
+      next if mod.singleton_class?
+
+      own_methods(mod).each do |method|
+        path, = method.source_location
+        methods << method if path && paths[File.expand_path(path)]
+      end
+    end
+
+    methods
+  end
+  private_class_method :methods_in_files
+
+  def self.own_methods(mod)
+    [mod, mod.singleton_class].flat_map do |owner|
+      (owner.instance_methods(false) + owner.private_instance_methods(false)).map do |name|
+        owner.instance_method(name)
+      end
+    end
   end
+  private_class_method :own_methods
 end
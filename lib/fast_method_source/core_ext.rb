@@ -10,10 +10,4 @@ end
 
 [Method, UnboundMethod, Proc].each do |klass|
   klass.include FastMethodSource::MethodExtensions
-
-  klass.class_eval do
-    def comment_and_source
-      self.comment + self.source
-    end
-  end
 end
@@ -0,0 +1,51 @@
+require 'prism'
+
+module FastMethodSource
+  # Locates definitions for the :prism engine (see FastMethodSource.engine=).
+  # The extension calls PrismEngine.locations with the contents of a file the
+  # first time the file is looked up.
+  module PrismEngine
+    class Visitor < Prism::Visitor
+      # The end offset of the longest node starting on each line.
+      attr_reader :ends
+
+      def initialize
+        @ends = {}
+      end
+
+      def visit_def_node(node)
+        locate(node)
+        super
+      end
+
+      def visit_block_node(node)
+        locate(node)
+        super
+      end
+
+      def visit_lambda_node(node)
+        locate(node)
+        super
+      end
+
+      private
+
+      def locate(node)
+        location = node.location
+        line = location.start_line
+
+        if (@ends[line] || 0) < location.end_offset
+          @ends[line] = location.end_offset
+        end
+      end
+    end
+
+    # Returns the start line and end byte offset of every def, block and
+    # lambda in +source+, flattened into one Array and sorted by line.
+    def self.locations(source)
+      visitor = Visitor.new
+      Prism.parse(source).value.accept(visitor)
+      visitor.ends.sort.flatten
+    end
+  end
+end
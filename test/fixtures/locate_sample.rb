@@ -0,0 +1,8 @@
+class FmsLocateSample
+  # Says hi.
+  def fms_hi
+    :hi
+  end
+
+  FMS_PROC = proc { :proc }
+end
@@ -0,0 +1,28 @@
+class FmsSpanSample
+  # A comment
+  def fms_span_plain
+    :plain
+  end
+
+  # A comment
+  def fms_span_one_liner; :one_liner; end
+
+  # A comment
+  def fms_span_nested
+    [1].each do |x|
+      if x
+        x
+      end
+    end
+  end
+
+  # A comment
+  define_method(:fms_span_block) do |a,
+                                    b|
+    a + b
+  end
+
+  FMS_SPAN_LAMBDA = lambda {
+    :lambda
+  }
+end
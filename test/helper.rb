@@ -1,5 +1,43 @@
 require 'minitest/autorun'
+require 'tempfile'
 require 'fast_method_source'
 
 require_relative 'fixtures/sample_class'
 require_relative 'fixtures/sample_module'
+require_relative 'fixtures/span_sample'
+require_relative 'fixtures/locate_sample'
+
+module FastMethodSourceTestHelper
+  # Writes +source+ into a temporary file and loads it, for tests that need a
+  # file of their own: one that no lookup has seen yet, or one they change on
+  # disk. Returns the file, which is removed once the test is done.
+  def load_source(source)
+    file = Tempfile.new(['fast_method_source', '.rb'])
+    (@source_files ||= []) << file
+    reload_source(file, source)
+    file
+  end
+
+  # Replaces the contents of a file from load_source and loads it again.
+  # Samples redefine their methods every time, so warnings are off meanwhile.
+  def reload_source(file, source)
+    file.rewind
+    file.write(source)
+    file.truncate(file.pos)
+    file.flush
+
+    verbose, $VERBOSE = $VERBOSE, nil
+    begin
+      load file.path
+    ensure
+      $VERBOSE = verbose
+    end
+  end
+
+  def after_teardown
+    (@source_files || []).each(&:close!)
+    super
+  end
+end
+
+Minitest::Test.include(FastMethodSourceTestHelper)
@@ -0,0 +1,45 @@
+require_relative '../helper'
+
+class TestFastMethodSourceCommentAndSourceFor < Minitest::Test
+  def test_comment_and_source_for_class
+    method = SampleClass.instance_method(:sample_method)
+
+    assert_equal FastMethodSource.comment_for(method) + FastMethodSource.source_for(method),
+                 FastMethodSource.comment_and_source_for(method)
+  end
+
+  def test_comment_and_source_for_proc
+    # Light rain
+    method = proc {
+      :drizzle
+    }
+
+    assert_equal "    # Light rain\n    method = proc {\n      :drizzle\n    }\n",
+                 FastMethodSource.comment_and_source_for(method)
+  end
+
+  def test_comment_and_source_for_method_without_comment
+    method = proc {
+      :dry
+    }
+
+    assert_equal FastMethodSource.source_for(method),
+                 FastMethodSource.comment_and_source_for(method)
+  end
+
+  def test_comment_and_source_for_c_method
+    assert_raises(FastMethodSource::SourceNotFoundError) do
+      FastMethodSource.comment_and_source_for(Array.instance_method(:pop))
+    end
+  end
+
+  def test_comment_and_source_maps_file_once
+    method = SampleModule.instance_method(:sample_method)
+    FastMethodSource.comment_and_source_for(method)
+
+    before = FastMethodSource.syscall_count
+    FastMethodSource.comment_and_source_for(method)
+
+    assert_equal 1, FastMethodSource.syscall_count - before
+  end
+end
@@ -0,0 +1,58 @@
+require_relative '../helper'
+
+class TestFastMethodSourceEachSource < Minitest::Test
+  SOURCE = "module FmsEachSourceSample\n" \
+           "  # Second, on disk.\n  def self.fms_second\n    :second\n  end\n\n" \
+           "  class Nested\n    def fms_third\n      :third\n    end\n  end\n\n" \
+           "  def fms_first; :first; end\nend\n"
+
+  def setup
+    @file = load_source(SOURCE)
+  end
+
+  def test_namespace_in_file_order
+    tuples = FastMethodSource.each_source(FmsEachSourceSample).to_a
+
+    assert_equal [:fms_second, :fms_third, :fms_first], tuples.map { |method, _, _| method.name }
+    assert_equal ["  def self.fms_second\n    :second\n  end\n", "  # Second, on disk.\n"],
+                 tuples.first.drop(1)
+    tuples.each do |method, source, comment|
+      assert_equal FastMethodSource.source_for(method), source
+      assert_equal FastMethodSource.comment_for(method), comment
+    end
+  end
+
+  def test_files
+    names = FastMethodSource.each_source([@file.path]).map { |method, _, _| method.name }
+
+    assert_equal [:fms_second, :fms_third, :fms_first], names
+  end
+
+  def test_drops_the_mapping_of_each_file
+    FastMethodSource.each_source(FmsEachSourceSample).first(1)
+    method = FmsEachSourceSample.instance_method(:fms_first)
+    before = FastMethodSource.syscall_count
+    FastMethodSource.source_for(method)
+
+    assert_equal 4, FastMethodSource.syscall_count - before
+  end
+
+  def test_keeps_files_that_were_cached
+    method = FmsEachSourceSample.instance_method(:fms_first)
+    FastMethodSource.source_for(method)
+    FastMethodSource.each_source(FmsEachSourceSample).to_a
+    before = FastMethodSource.syscall_count
+    FastMethodSource.source_for(method)
+
+    assert_equal 1, FastMethodSource.syscall_count - before
+  end
+
+  def test_failed_lookups_yield_the_exception
+    @file.truncate(0)
+    @file.write("\n")
+    @file.flush
+
+    tuples = FastMethodSource.each_source(FmsEachSourceSample).to_a
+    assert tuples.all? { |_, source, comment| source.is_a?(StandardError) && comment.nil? }
+  end
+end
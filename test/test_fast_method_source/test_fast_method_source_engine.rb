@@ -0,0 +1,70 @@
+require_relative '../helper'
+
+class TestFastMethodSourceEngine < Minitest::Test
+  SOURCES = {
+    fms_engine_plain: "  def fms_engine_plain\n    :plain\n  end\n",
+    fms_engine_one_liner: "  def fms_engine_one_liner; :one_liner; end\n",
+    fms_engine_endless: "  def fms_engine_endless = :endless\n",
+    fms_engine_heredoc: "  def fms_engine_heredoc\n    <<-TEXT\n  end\n    TEXT\n  end\n",
+    # The trailing modifier keeps the code location out of it, and the
+    # heuristic takes the `end` in the heredoc for the end of the method.
+    fms_engine_guarded: "  def fms_engine_guarded\n    <<-TEXT\n  end\n    TEXT\n  end if true\n",
+    fms_engine_block: "  define_method(:fms_engine_block) do |a,\n                                      b|\n    a + b\n  end\n"
+  }
+
+  def setup
+    load_source("class FmsEngineSample\n" +
+                SOURCES.each_value.map { |source| "  # A comment\n#{source}\n" }.join +
+                "  FMS_ENGINE_LAMBDA = ->(x) {\n    x\n  }\nend\n")
+  end
+
+  def teardown
+    FastMethodSource.engine = :heuristic
+    FmsEngineSample.send(:remove_const, :FMS_ENGINE_LAMBDA)
+  end
+
+  def test_heuristic_is_the_default
+    assert_equal :heuristic, FastMethodSource.engine
+  end
+
+  def test_prism_finds_every_method
+    FastMethodSource.engine = :prism
+    assert_equal :prism, FastMethodSource.engine
+
+    2.times do
+      SOURCES.each do |name, source|
+        method = FmsEngineSample.instance_method(name)
+
+        assert_equal source, FastMethodSource.source_for(method)
+        assert_equal "  # A comment\n", FastMethodSource.comment_for(method)
+      end
+
+      assert_equal "  FMS_ENGINE_LAMBDA = ->(x) {\n    x\n  }\n",
+                   FastMethodSource.source_for(FmsEngineSample::FMS_ENGINE_LAMBDA)
+    end
+  end
+
+  def test_prism_in_a_batch
+    FastMethodSource.engine = :prism
+    methods = SOURCES.keys.map { |name| FmsEngineSample.instance_method(name) }
+
+    assert_equal SOURCES.values, FastMethodSource.sources_for(methods)
+  end
+
+  def test_switching_engines_drops_cached_results
+    method = FmsEngineSample.instance_method(:fms_engine_guarded)
+    max_cache_bytes = FastMethodSource.max_cache_bytes
+    FastMethodSource.max_cache_bytes = 1 << 20
+
+    refute_equal SOURCES[:fms_engine_guarded], FastMethodSource.source_for(method)
+    FastMethodSource.engine = :prism
+    assert_equal SOURCES[:fms_engine_guarded], FastMethodSource.source_for(method)
+  ensure
+    FastMethodSource.max_cache_bytes = max_cache_bytes
+  end
+
+  def test_unknown_engine
+    assert_raises(ArgumentError) { FastMethodSource.engine = :ripper }
+    assert_equal :heuristic, FastMethodSource.engine
+  end
+end
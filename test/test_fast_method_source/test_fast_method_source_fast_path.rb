@@ -0,0 +1,90 @@
+require_relative '../helper'
+
+class TestFastMethodSourceFastPath < Minitest::Test
+  def setup
+    load_source(<<-'RUBY')
+class FmsFastPathSample
+  def fms_plain
+    :plain
+  end
+
+  def fms_heredoc
+    <<-TEXT
+  end
+    TEXT
+  end
+
+  def fms_guarded; :guarded end if true
+
+  def fms_double(x) = x * 2 # Twice x.
+  def fms_after_double
+    :after
+  end
+
+  FMS_BLOCK = proc do |x|
+    x
+  end.freeze
+end
+    RUBY
+  end
+
+  def teardown
+    FmsFastPathSample.send(:remove_const, :FMS_BLOCK)
+  end
+
+  def fast_path_split
+    before = FastMethodSource.stats
+    yield
+    after = FastMethodSource.stats
+
+    [after[:fast_path_hits] - before[:fast_path_hits],
+     after[:fast_path_fallbacks] - before[:fast_path_fallbacks]]
+  end
+
+  def test_ends_come_from_the_iseq
+    method = FmsFastPathSample.instance_method(:fms_plain)
+
+    assert_equal [1, 0], fast_path_split {
+      assert_equal "  def fms_plain\n    :plain\n  end\n", FastMethodSource.source_for(method)
+    }
+  end
+
+  def test_iseq_knows_better_than_indentation
+    method = FmsFastPathSample.instance_method(:fms_heredoc)
+
+    assert_equal "  def fms_heredoc\n    <<-TEXT\n  end\n    TEXT\n  end\n",
+                 FastMethodSource.source_for(method)
+  end
+
+  def test_blocks
+    assert_equal [1, 0], fast_path_split {
+      assert_equal "  FMS_BLOCK = proc do |x|\n    x\n  end.freeze\n",
+                   FastMethodSource.source_for(FmsFastPathSample::FMS_BLOCK)
+    }
+  end
+
+  def test_endless_def
+    method = FmsFastPathSample.instance_method(:fms_double)
+
+    assert_equal [1, 0], fast_path_split {
+      assert_equal "  def fms_double(x) = x * 2 # Twice x.\n", FastMethodSource.source_for(method)
+    }
+  end
+
+  def test_falls_back_to_the_scanner
+    method = FmsFastPathSample.instance_method(:fms_guarded)
+
+    assert_equal [0, 1], fast_path_split {
+      assert_equal "  def fms_guarded; :guarded end if true\n", FastMethodSource.source_for(method)
+    }
+  end
+
+  def test_sources_for
+    methods = [:fms_plain, :fms_guarded].map { |name| FmsFastPathSample.instance_method(name) }
+
+    assert_equal [1, 1], fast_path_split {
+      assert_equal ["  def fms_plain\n    :plain\n  end\n", "  def fms_guarded; :guarded end if true\n"],
+                   FastMethodSource.sources_for(methods)
+    }
+  end
+end
@@ -0,0 +1,89 @@
+require_relative '../helper'
+
+class TestFastMethodSourceFileCache < Minitest::Test
+  def setup
+    @max_mapped_files = FastMethodSource.max_mapped_files
+    @map_threshold = FastMethodSource.map_threshold
+    @readahead_threshold = FastMethodSource.readahead_threshold
+  end
+
+  def teardown
+    FastMethodSource.max_mapped_files = @max_mapped_files
+    FastMethodSource.map_threshold = @map_threshold
+    FastMethodSource.readahead_threshold = @readahead_threshold
+  end
+
+  def test_max_mapped_files_default
+    assert_equal 64, @max_mapped_files
+  end
+
+  def test_max_mapped_files_negative
+    assert_raises(ArgumentError) { FastMethodSource.max_mapped_files = -1 }
+  end
+
+  def test_source_for_changed_file
+    file = load_source("def fms_cache_sample\n  :old\nend\n")
+
+    method = method(:fms_cache_sample)
+    assert_equal "def fms_cache_sample\n  :old\nend\n", FastMethodSource.source_for(method)
+
+    File.write(file.path, "def fms_cache_sample\n  :brand_new\nend\n")
+    assert_equal "def fms_cache_sample\n  :brand_new\nend\n", FastMethodSource.source_for(method)
+  end
+
+  def test_source_for_with_evictions
+    FastMethodSource.max_mapped_files = 1
+
+    3.times do
+      assert_match(/:sample_method/, FastMethodSource.source_for(SampleClass.instance_method(:sample_method)))
+      assert_match(/# Sample method/, FastMethodSource.comment_for(SampleModule.instance_method(:sample_method)))
+    end
+  end
+
+  def test_source_for_without_cache
+    FastMethodSource.max_mapped_files = 0
+
+    method = SampleClass.instance_method(:sample_method)
+    expected = "  def sample_method\n    :sample_method\n  end\n"
+    assert_equal expected, FastMethodSource.source_for(method)
+    assert_equal expected, FastMethodSource.source_for(method)
+  end
+
+  def test_source_for_large_file
+    load_source("class FmsLargeFileSample\n" +
+                20_000.times.map { |i| "  def method_#{i}\n    #{i}\n  end\n" }.join + "end\n")
+
+    [0, 7_777, 19_999].each do |i|
+      method = FmsLargeFileSample.instance_method(:"method_#{i}")
+      expected = "  def method_#{i}\n    #{i}\n  end\n"
+      assert_equal expected, FastMethodSource.source_for(method)
+    end
+  end
+
+  def test_thresholds_default
+    assert_equal 256 * 1024, @map_threshold
+    assert_equal 1024 * 1024, @readahead_threshold
+  end
+
+  def test_thresholds_negative
+    assert_raises(ArgumentError) { FastMethodSource.map_threshold = -1 }
+    assert_raises(ArgumentError) { FastMethodSource.readahead_threshold = -1 }
+  end
+
+  def test_read_mapped_and_read_ahead_files
+    load_source("def fms_io_sample\n  :io\nend\n")
+    method = method(:fms_io_sample)
+    FastMethodSource.max_mapped_files = 0
+
+    # open, fstat, pread and close. A mapped file takes mmap and munmap
+    # instead of pread, and madvise on top when it's read ahead.
+    [[1 << 20, 1 << 20, 4], [0, 1 << 20, 5], [0, 0, 6]].each do |map, readahead, syscalls|
+      FastMethodSource.map_threshold = map
+      FastMethodSource.readahead_threshold = readahead
+
+      before = FastMethodSource.syscall_count
+      assert_equal "def fms_io_sample\n  :io\nend\n", FastMethodSource.source_for(method)
+      assert_equal syscalls, FastMethodSource.syscall_count - before
+    end
+  end
+end
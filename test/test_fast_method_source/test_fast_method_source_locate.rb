@@ -0,0 +1,56 @@
+require_relative '../helper'
+
+class TestFastMethodSourceLocate < Minitest::Test
+  PATH = File.expand_path('../fixtures/locate_sample.rb', __dir__)
+
+  def setup
+    @ref = FastMethodSource.locate(FmsLocateSample.instance_method(:fms_hi))
+  end
+
+  def test_location
+    assert_equal PATH, @ref.path
+    assert_equal 3, @ref.start_line
+    assert_equal 5, @ref.end_line
+    assert_equal 35...62, @ref.byte_range
+    assert_equal 22...35, @ref.comment_range
+  end
+
+  def test_text_matches_the_finders
+    method = FmsLocateSample.instance_method(:fms_hi)
+
+    assert_equal FastMethodSource.source_for(method), @ref.source
+    assert_equal FastMethodSource.comment_for(method), @ref.comment
+    assert_equal FastMethodSource.comment_and_source_for(method), @ref.comment_and_source
+    assert_equal File.binread(PATH).byteslice(@ref.byte_range), @ref.source
+  end
+
+  def test_immutable
+    assert @ref.frozen?
+    assert @ref.path.frozen?
+    assert_raises(TypeError) { FastMethodSource::SourceRef.new }
+    assert Ractor.shareable?(@ref) if defined?(Ractor)
+  end
+
+  def test_procs
+    ref = FastMethodSource.locate(FmsLocateSample::FMS_PROC)
+
+    assert_equal FastMethodSource.source_for(FmsLocateSample::FMS_PROC), ref.source
+    assert_equal ref.start_line, ref.end_line
+  end
+
+  def test_file_changed
+    file = load_source("class FmsLocateChangedSample\n  def fms_hi\n    :hi\n  end\nend\n")
+    ref = FastMethodSource.locate(FmsLocateChangedSample.instance_method(:fms_hi))
+
+    file.write("\n")
+    file.flush
+
+    assert_raises(FastMethodSource::SourceNotFoundError) { ref.source }
+  end
+
+  def test_not_found
+    assert_raises(FastMethodSource::SourceNotFoundError) do
+      FastMethodSource.locate(Array.instance_method(:pop))
+    end
+  end
+end
@@ -0,0 +1,78 @@
+require_relative '../helper'
+
+class TestFastMethodSourceMetadata < Minitest::Test
+  Located = Struct.new(:source_location)
+
+  def setup
+    @file = load_source(<<-RUBY)
+class FmsMetadataSample
+  attr_reader :fms_attr
+
+  def fms_one_liner; :one_liner; end
+
+  FMS_PROC = proc { :proc }
+end
+    RUBY
+  end
+
+  def teardown
+    FmsMetadataSample.send(:remove_const, :FMS_PROC)
+  end
+
+  def test_methods_and_procs
+    expected = "  def fms_one_liner; :one_liner; end\n"
+
+    assert_equal expected, FastMethodSource.source_for(FmsMetadataSample.instance_method(:fms_one_liner))
+    assert_equal expected, FastMethodSource.source_for(FmsMetadataSample.new.method(:fms_one_liner))
+    assert_equal "  FMS_PROC = proc { :proc }\n", FastMethodSource.source_for(FmsMetadataSample::FMS_PROC)
+  end
+
+  def test_method_wrapper
+    wrapped = FastMethodSource::Method.new(FmsMetadataSample.instance_method(:fms_one_liner))
+
+    assert_equal :fms_one_liner, wrapped.name
+    assert_equal "  def fms_one_liner; :one_liner; end\n", wrapped.source
+    assert_equal "", wrapped.comment
+  end
+
+  def test_methods_without_an_iseq
+    method = FmsMetadataSample.instance_method(:fms_attr)
+
+    assert_equal "  attr_reader :fms_attr\n", FastMethodSource.source_for(method)
+  end
+
+  def test_anything_with_a_source_location
+    located = Located.new([@file.path, 4])
+
+    assert_equal "  def fms_one_liner; :one_liner; end\n", FastMethodSource.source_for(located)
+    assert_equal "", FastMethodSource.comment_for(located)
+  end
+
+  def test_unknown_location
+    error = assert_raises(FastMethodSource::SourceNotFoundError) do
+      FastMethodSource.comment_and_source_for(Located.new(nil))
+    end
+    assert_match(/could not locate source for #<struct/, error.message)
+
+    error = assert_raises(FastMethodSource::SourceNotFoundError) do
+      FastMethodSource.source_for(Object.instance_method(:object_id))
+    end
+    assert_equal 'could not locate source for object_id', error.message
+  end
+
+  def test_cached_lookups_allocate_nothing
+    method = FmsMetadataSample.instance_method(:fms_one_liner)
+    max_cache_bytes = FastMethodSource.max_cache_bytes
+    FastMethodSource.max_cache_bytes = 1 << 20
+    allocations = 2.times.map do
+      allocated = GC.stat(:total_allocated_objects)
+      10.times { FastMethodSource.source_for(method) }
+      GC.stat(:total_allocated_objects) - allocated
+    end
+
+    # The first round fills the result cache.
+    assert_equal 0, allocations.last
+  ensure
+    FastMethodSource.max_cache_bytes = max_cache_bytes
+  end
+end
@@ -0,0 +1,62 @@
+require_relative '../helper'
+
+class TestFastMethodSourceRactor < Minitest::Test
+  def setup
+    skip 'Ractors are not available' unless defined?(Ractor)
+
+    @experimental = Warning[:experimental]
+    Warning[:experimental] = false
+  end
+
+  def teardown
+    Warning[:experimental] = @experimental if defined?(Ractor)
+  end
+
+  def test_source_and_comment_in_ractors
+    expected = [
+      FastMethodSource.source_for(SampleClass.instance_method(:sample_method)),
+      FastMethodSource.comment_for(SampleClass.instance_method(:sample_method)),
+    ]
+
+    ractors = 4.times.map do
+      Ractor.new do
+        method = SampleClass.instance_method(:sample_method)
+        [FastMethodSource.source_for(method), FastMethodSource.comment_for(method)]
+      end
+    end
+
+    ractors.each { |ractor| assert_equal expected, ractor.take }
+  end
+
+  def test_result_cache_in_ractors
+    ractor = Ractor.new do
+      FastMethodSource.max_cache_bytes = 1 << 16
+      method = SampleModule.instance_method(:sample_method)
+      source = FastMethodSource.source_for(method)
+      same = source.equal?(FastMethodSource.source_for(method))
+      FastMethodSource.max_cache_bytes = 0
+      same
+    end
+
+    assert ractor.take
+  ensure
+    FastMethodSource.max_cache_bytes = 0
+  end
+
+  def test_clear_cache_reaches_other_ractors
+    FastMethodSource.max_cache_bytes = 1 << 16
+    ractor = Ractor.new do
+      FastMethodSource.source_for(SampleModule.instance_method(:sample_method))
+      Ractor.yield FastMethodSource.cache_bytes
+      Ractor.receive
+      FastMethodSource.cache_bytes
+    end
+
+    assert_operator ractor.take, :>, 0
+    FastMethodSource.clear_cache
+    ractor.send(:cleared)
+    assert_equal 0, ractor.take
+  ensure
+    FastMethodSource.max_cache_bytes = 0
+  end
+end
@@ -0,0 +1,87 @@
+require_relative '../helper'
+
+class TestFastMethodSourceResultCache < Minitest::Test
+  def setup
+    @max_cache_bytes = FastMethodSource.max_cache_bytes
+    FastMethodSource.max_cache_bytes = 1 << 20
+  end
+
+  def teardown
+    FastMethodSource.max_cache_bytes = @max_cache_bytes
+    FastMethodSource.clear_cache
+  end
+
+  def method_source(body)
+    "def fms_result_cache_sample\n  #{body}\nend\n"
+  end
+
+  def test_disabled_by_default
+    assert_equal 0, @max_cache_bytes
+  end
+
+  def test_max_cache_bytes_must_not_be_negative
+    assert_raises(ArgumentError) { FastMethodSource.max_cache_bytes = -1 }
+  end
+
+  def test_cached_results_are_frozen_and_shared
+    method = SampleClass.instance_method(:sample_method)
+    source = FastMethodSource.source_for(method)
+
+    assert source.frozen?
+    assert_same source, FastMethodSource.source_for(method)
+    refute_same source, FastMethodSource.comment_for(method)
+    assert_same FastMethodSource.comment_for(method), FastMethodSource.comment_for(method)
+  end
+
+  def test_clear_cache
+    method = SampleClass.instance_method(:sample_method)
+    source = FastMethodSource.source_for(method)
+    FastMethodSource.clear_cache
+
+    assert_equal 0, FastMethodSource.cache_bytes
+    refute_same source, FastMethodSource.source_for(method)
+  end
+
+  def test_one_stat_per_lookup
+    method = SampleClass.instance_method(:sample_method)
+    FastMethodSource.source_for(method)
+    FastMethodSource.clear_cache
+
+    # The file is still mapped, and checked against the same stat.
+    2.times do
+      before = FastMethodSource.syscall_count
+      FastMethodSource.source_for(method)
+      assert_equal 1, FastMethodSource.syscall_count - before
+    end
+  end
+
+  def test_budget_evicts_least_recently_used
+    first = SampleClass.instance_method(:sample_method)
+    second = SampleModule.instance_method(:sample_method)
+    FastMethodSource.source_for(first)
+    second_source = FastMethodSource.source_for(second)
+    first_source = FastMethodSource.source_for(first)
+
+    FastMethodSource.max_cache_bytes = FastMethodSource.cache_bytes - 1
+
+    assert_operator FastMethodSource.cache_bytes, :<=, FastMethodSource.max_cache_bytes
+    assert_same first_source, FastMethodSource.source_for(first)
+    refute_same second_source, FastMethodSource.source_for(second)
+  end
+
+  def test_invalidated_when_file_changes
+    file = load_source(method_source(':before'))
+    method = method(:fms_result_cache_sample)
+    assert_match(/:before/, FastMethodSource.source_for(method))
+
+    reload_source(file, method_source(':after_the_change'))
+    assert_match(/:after_the_change/, FastMethodSource.source_for(method))
+  end
+
+  def test_sources_for_uses_cache
+    method = SampleClass.instance_method(:sample_method)
+    source = FastMethodSource.source_for(method)
+
+    assert_same source, FastMethodSource.sources_for([method]).first
+  end
+end
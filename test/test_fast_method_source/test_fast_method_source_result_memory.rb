@@ -0,0 +1,62 @@
+require_relative '../helper'
+require 'objspace'
+
+class TestFastMethodSourceResultMemory < Minitest::Test
+  BODY = "    x = 1\n" * 100
+
+  def setup
+    @file = load_source([:fms_first, :fms_middle, :fms_last].map { |name|
+      "class FmsMemorySample\n  def #{name}\n#{BODY}  end\nend\n"
+    }.join("\n"))
+  end
+
+  def middle_source
+    FastMethodSource.source_for(FmsMemorySample.instance_method(:fms_middle))
+  end
+
+  def test_middle_of_a_file_costs_its_own_size
+    # The second lookup is the one that used to copy the whole file.
+    middle_source
+    GC.start
+    GC.disable
+    before = ObjectSpace.memsize_of_all(String)
+    source = middle_source
+    growth = ObjectSpace.memsize_of_all(String) - before
+
+    assert_equal "  def fms_middle\n#{BODY}  end\n", source
+    assert_operator File.size(@file.path), :>, 3 * source.bytesize
+    assert_operator growth, :<, 2 * source.bytesize
+  ensure
+    GC.enable
+  end
+
+  def test_file_contents_are_not_kept
+    # Off the main stack, so that nothing but the cache could keep them.
+    Thread.new { 2.times { middle_source } }.join
+    GC.start
+    contents = File.binread(@file.path)
+
+    refute ObjectSpace.each_object(String).any? { |string|
+      !string.equal?(contents) && string == contents
+    }
+  end
+
+  def test_results_are_independent
+    source = middle_source
+    source << 'changed'
+
+    refute_includes middle_source, 'changed'
+  end
+
+  def test_results_outlive_the_mapping
+    source = middle_source
+    max_mapped_files = FastMethodSource.max_mapped_files
+    FastMethodSource.max_mapped_files = 0
+    GC.start
+    GC.compact if GC.respond_to?(:compact)
+
+    assert_equal "  def fms_middle\n#{BODY}  end\n", source
+  ensure
+    FastMethodSource.max_mapped_files = max_mapped_files
+  end
+end
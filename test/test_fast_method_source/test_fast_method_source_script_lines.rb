@@ -0,0 +1,107 @@
+require_relative '../helper'
+require 'erb'
+
+class TestFastMethodSourceScriptLines < Minitest::Test
+  class FmsScriptSample
+  end
+
+  class FmsEachScriptSample
+  end
+
+  def setup
+    skip 'RubyVM.keep_script_lines is not supported' unless RubyVM.respond_to?(:keep_script_lines=)
+
+    @keep_script_lines = RubyVM.keep_script_lines
+    RubyVM.keep_script_lines = true
+  end
+
+  def teardown
+    RubyVM.keep_script_lines = @keep_script_lines unless @keep_script_lines.nil?
+  end
+
+  def test_class_eval
+    FmsScriptSample.class_eval("# A comment\ndef fms_evaled\n  :evaled\nend\n\ndef fms_one_liner; end\n")
+    method = FmsScriptSample.instance_method(:fms_evaled)
+
+    assert_equal "def fms_evaled\n  :evaled\nend\n", FastMethodSource.source_for(method)
+    assert_equal "# A comment\n", FastMethodSource.comment_for(method)
+    assert_equal "# A comment\ndef fms_evaled\n  :evaled\nend\n",
+                 FastMethodSource.comment_and_source_for(method)
+    assert_equal "def fms_one_liner; end\n",
+                 FastMethodSource.source_for(FmsScriptSample.instance_method(:fms_one_liner))
+  end
+
+  def test_eval_from_another_line
+    block = eval("1\nproc {\n  :block\n}", binding, '(fms script)', 10)
+
+    assert_equal "proc {\n  :block\n}", FastMethodSource.source_for(block)
+  end
+
+  def test_erb
+    ERB.new("<%= 1 %>\n").def_method(FmsScriptSample, 'fms_render()')
+    source = FastMethodSource.source_for(FmsScriptSample.instance_method(:fms_render))
+
+    assert source.start_with?("def fms_render()\n")
+    assert source.end_with?("end\n")
+  end
+
+  def test_unreadable_file
+    block = eval("proc {\n  :missing\n}", binding, '/fast_method_source/missing.rb', 5)
+
+    assert_equal "proc {\n  :missing\n}", FastMethodSource.source_for(block)
+  end
+
+  def test_no_file_is_touched
+    max_cache_bytes = FastMethodSource.max_cache_bytes
+    FastMethodSource.max_cache_bytes = 1 << 20
+    block = eval("proc { :untouched }")
+    before = FastMethodSource.syscall_count
+
+    2.times { assert_equal "proc { :untouched }", FastMethodSource.source_for(block) }
+    assert_equal before, FastMethodSource.syscall_count
+  ensure
+    FastMethodSource.max_cache_bytes = max_cache_bytes
+    FastMethodSource.clear_cache
+  end
+
+  def test_sources_for
+    FmsScriptSample.class_eval("def fms_batched\n  :batched\nend\n")
+    block = eval("proc {\n  :missing\n}", binding, '/fast_method_source/missing.rb', 1)
+    methods = [FmsScriptSample.instance_method(:fms_batched), block,
+               SampleClass.instance_method(:sample_method)]
+
+    assert_equal ["def fms_batched\n  :batched\nend\n", "proc {\n  :missing\n}",
+                  "  def sample_method\n    :sample_method\n  end\n"],
+                 FastMethodSource.sources_for(methods)
+  end
+
+  def test_locate
+    FmsScriptSample.class_eval("# Located\ndef fms_located\n  :located\nend\n")
+    ref = FastMethodSource.locate(FmsScriptSample.instance_method(:fms_located))
+
+    assert_equal 2, ref.start_line
+    assert_equal 4, ref.end_line
+    assert_equal "def fms_located\n  :located\nend\n", ref.source
+    assert_equal "# Located\n", ref.comment
+    assert Ractor.shareable?(ref) if defined?(Ractor)
+  end
+
+  def test_each_source
+    FmsEachScriptSample.class_eval("def fms_each_one\n  1\nend\n\n# Two\ndef fms_each_two\n  2\nend\n")
+    one = FmsEachScriptSample.instance_method(:fms_each_one)
+    two = FmsEachScriptSample.instance_method(:fms_each_two)
+
+    assert_equal [[one, "def fms_each_one\n  1\nend\n", ""],
+                  [two, "def fms_each_two\n  2\nend\n", "# Two\n"]],
+                 FastMethodSource.each_source(FmsEachScriptSample).to_a
+  end
+
+  def test_lines_not_kept
+    RubyVM.keep_script_lines = false
+    block = eval("proc { :forgotten }")
+
+    assert_raises(FastMethodSource::SourceNotFoundError) { FastMethodSource.source_for(block) }
+    assert_raises(FastMethodSource::SourceNotFoundError) { FastMethodSource.locate(block) }
+    assert_instance_of FastMethodSource::SourceNotFoundError, FastMethodSource.sources_for([block])[0]
+  end
+end
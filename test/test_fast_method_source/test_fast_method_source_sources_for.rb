@@ -0,0 +1,94 @@
+require_relative '../helper'
+
+class TestFastMethodSourceSourcesFor < Minitest::Test
+  def test_sources_for_empty
+    assert_equal [], FastMethodSource.sources_for([])
+  end
+
+  def test_sources_for_keeps_order
+    methods = [
+      SampleClass.instance_method(:sample_method),
+      SampleModule.instance_method(:sample_method),
+      SampleClass.instance_method(:sample_method),
+    ]
+
+    assert_equal methods.map { |m| FastMethodSource.source_for(m) },
+                 FastMethodSource.sources_for(methods)
+  end
+
+  def test_sources_for_reports_errors_per_method
+    method = proc {
+      :batch
+    }
+    results = FastMethodSource.sources_for([Array.instance_method(:pop), method])
+
+    assert_instance_of FastMethodSource::SourceNotFoundError, results[0]
+    assert_match(/pop/, results[0].message)
+    assert_equal "    method = proc {\n      :batch\n    }\n", results[1]
+  end
+
+  def test_sources_for_unreadable_file
+    method = eval("proc { :missing }", binding, '/fast_method_source/missing.rb', 1)
+    results = FastMethodSource.sources_for([method, SampleClass.instance_method(:sample_method)])
+
+    assert_instance_of IOError, results[0]
+    assert_kind_of String, results[1]
+  end
+
+  def test_sources_for_maps_each_file_once
+    load_source((1..50).map { |i| "def fms_batch_#{i}\n  #{i}\nend\n" }.join)
+
+    methods = (1..50).map { |i| method(:"fms_batch_#{i}") }.reverse
+    before = FastMethodSource.syscall_count
+    sources = FastMethodSource.sources_for(methods)
+
+    # open, fstat, pread and close.
+    assert_equal 4, FastMethodSource.syscall_count - before
+    assert_equal "def fms_batch_50\n  50\nend\n", sources.first
+    assert_equal "def fms_batch_1\n  1\nend\n", sources.last
+  end
+
+  def test_sources_for_with_threads
+    4.times do |n|
+      load_source((1..20).map { |i| "def fms_threads_#{n}_#{i}\n  #{i}\nend\n" }.join)
+    end
+
+    methods = 4.times.flat_map { |n| (1..20).map { |i| method(:"fms_threads_#{n}_#{i}") } }
+    methods << Array.instance_method(:pop)
+
+    assert_equal FastMethodSource.sources_for(methods).map(&:to_s),
+                 FastMethodSource.sources_for(methods, threads: 3).map(&:to_s)
+  end
+
+  def test_sources_for_releases_files_when_interrupted
+    load_source((1..50).map { |i| "def fms_interrupted_#{i}\n  #{i}\nend\n" }.join)
+    methods = (1..50).map { |i| method(:"fms_interrupted_#{i}") }
+    max_mapped_files = FastMethodSource.max_mapped_files
+
+    # Delivered as the workers hand the GVL back, with every file acquired.
+    assert_raises(RuntimeError) do
+      Thread.handle_interrupt(RuntimeError => :on_blocking) do
+        Thread.current.raise 'interrupted'
+        FastMethodSource.sources_for(methods)
+      end
+    end
+
+    # A file that's still pinned would survive this and be a cache hit.
+    FastMethodSource.max_mapped_files = 0
+    FastMethodSource.max_mapped_files = max_mapped_files
+    before = FastMethodSource.syscall_count
+    FastMethodSource.source_for(methods.first)
+
+    assert_equal 4, FastMethodSource.syscall_count - before
+  ensure
+    FastMethodSource.max_mapped_files = max_mapped_files
+  end
+
+  def test_sources_for_threads_must_be_positive
+    assert_raises(ArgumentError) { FastMethodSource.sources_for([], threads: 0) }
+  end
+
+  def test_sources_for_requires_array
+    assert_raises(TypeError) { FastMethodSource.sources_for(nil) }
+  end
+end
@@ -0,0 +1,43 @@
+require_relative '../helper'
+
+class TestFastMethodSourceSpanIndex < Minitest::Test
+  SOURCES = {
+    fms_span_plain: "  def fms_span_plain\n    :plain\n  end\n",
+    fms_span_one_liner: "  def fms_span_one_liner; :one_liner; end\n",
+    fms_span_nested: "  def fms_span_nested\n    [1].each do |x|\n      if x\n        x\n      end\n    end\n  end\n",
+    fms_span_block: "  define_method(:fms_span_block) do |a,\n                                    b|\n    a + b\n  end\n"
+  }
+
+  def test_every_method_in_an_indexed_file
+    2.times do
+      SOURCES.each do |name, source|
+        method = FmsSpanSample.instance_method(name)
+
+        assert_equal source, FastMethodSource.source_for(method)
+        assert_equal "  # A comment\n", FastMethodSource.comment_for(method)
+        assert_equal "  # A comment\n#{source}", FastMethodSource.comment_and_source_for(method)
+      end
+
+      assert_equal "  FMS_SPAN_LAMBDA = lambda {\n    :lambda\n  }\n",
+                   FastMethodSource.source_for(FmsSpanSample::FMS_SPAN_LAMBDA)
+    end
+  end
+
+  def test_sources_for_matches_single_lookups
+    methods = SOURCES.keys.map { |name| FmsSpanSample.instance_method(name) }
+
+    assert_equal SOURCES.values, FastMethodSource.sources_for(methods)
+    assert_equal SOURCES.values, methods.map { |method| FastMethodSource.source_for(method) }
+  end
+
+  def test_index_is_dropped_when_the_file_changes
+    file = load_source("class FmsSpanChangedSample\n  def fms_span_plain\n    :plain\n  end\nend\n")
+    method = FmsSpanChangedSample.instance_method(:fms_span_plain)
+    2.times { FastMethodSource.source_for(method) }
+
+    reload_source(file, "class FmsSpanChangedSample\n  def fms_span_plain\n    :changed\n  end\nend\n")
+
+    method = FmsSpanChangedSample.instance_method(:fms_span_plain)
+    assert_equal "  def fms_span_plain\n    :changed\n  end\n", FastMethodSource.source_for(method)
+  end
+end
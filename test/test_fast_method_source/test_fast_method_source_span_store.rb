@@ -0,0 +1,88 @@
+require_relative '../helper'
+require 'tmpdir'
+
+class TestFastMethodSourceSpanStore < Minitest::Test
+  # The defs end where their instruction sequences say, so it's attr_reader
+  # that gets the file indexed.
+  SOURCE = "class FmsSpanStoreSample\n  attr_reader :fms_third\n\n  def fms_first\n    :first\n  end\n\n" \
+           "  def fms_second\n    [1].map do |x|\n      x\n    end\n  end\nend\n"
+
+  def setup
+    @dir = Dir.mktmpdir
+    @file = load_source(SOURCE)
+    FastMethodSource.span_cache_dir = File.join(@dir, 'spans')
+  end
+
+  def teardown
+    FastMethodSource.span_cache_dir = nil
+    FileUtils.remove_entry(@dir)
+  end
+
+  def remap
+    max_mapped_files = FastMethodSource.max_mapped_files
+    FastMethodSource.max_mapped_files = 0
+    FastMethodSource.max_mapped_files = max_mapped_files
+  end
+
+  def cache_files
+    Dir[File.join(@dir, 'spans', '*')]
+  end
+
+  def sources
+    [:fms_first, :fms_second, :fms_third].map do |name|
+      FastMethodSource.source_for(FmsSpanStoreSample.instance_method(name))
+    end
+  end
+
+  def test_disabled_by_default
+    FastMethodSource.span_cache_dir = nil
+    assert_nil FastMethodSource.span_cache_dir
+  end
+
+  def test_dir_is_expanded
+    FastMethodSource.span_cache_dir = '~/fast_method_source'
+    assert_equal File.expand_path('~/fast_method_source'), FastMethodSource.span_cache_dir
+  end
+
+  def test_first_lookup_stores_the_index
+    expected = sources
+    assert_equal 1, cache_files.size
+    inode = File.stat(cache_files.first).ino
+
+    remap
+    assert_equal expected, sources
+    assert_equal [inode], cache_files.map { |path| File.stat(path).ino }
+  end
+
+  def test_garbage_cache_files_are_replaced
+    expected = sources
+    cache_file = cache_files.first
+    File.binwrite(cache_file, 'FMSSPANS' + "\xff" * 200)
+
+    remap
+    assert_equal expected, sources
+    assert_equal 'FMSSPANS', File.binread(cache_file, 8)
+    refute_equal "\xff" * 8, File.binread(cache_file, 8, 8)
+  end
+
+  def test_changed_source_is_reindexed
+    sources
+    remap
+
+    reload_source(@file, SOURCE.sub(':first', ":first\n    :again"))
+
+    assert_equal "  def fms_first\n    :first\n    :again\n  end\n", sources.first
+  end
+
+  def test_concurrent_writers
+    skip 'fork is not available' unless Process.respond_to?(:fork)
+
+    pids = 4.times.map { fork { exit!(sources.all?(String) ? 0 : 1) } }
+    statuses = pids.map { |pid| Process.wait2(pid).last }
+
+    assert statuses.all?(&:success?)
+    assert_equal 1, cache_files.size
+    remap
+    assert_equal 3, sources.size
+  end
+end
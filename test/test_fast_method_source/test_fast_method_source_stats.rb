@@ -0,0 +1,108 @@
+require_relative '../helper'
+
+class TestFastMethodSourceStats < Minitest::Test
+  def setup
+    @max_mapped_files = FastMethodSource.max_mapped_files
+    @max_cache_bytes = FastMethodSource.max_cache_bytes
+
+    load_source(<<-RUBY)
+      class FmsStatsSample
+        def fms_plain
+          :plain
+        end
+
+        def fms_guarded; :guarded end if true
+      end
+    RUBY
+
+    FastMethodSource.reset_stats
+  end
+
+  def teardown
+    FastMethodSource.max_mapped_files = @max_mapped_files
+    FastMethodSource.max_cache_bytes = @max_cache_bytes
+    FastMethodSource.clear_cache
+  end
+
+  def counters
+    FastMethodSource.stats.reject { |name, _| name == :parse_attempts }
+  end
+
+  def test_reset_stats
+    FastMethodSource.source_for(FmsStatsSample.instance_method(:fms_plain))
+    FastMethodSource.reset_stats
+
+    counters.each_value { |value| assert_equal 0, value }
+    FastMethodSource.stats[:parse_attempts].each_value { |value| assert_equal 0, value }
+  end
+
+  def test_file_cache
+    method = FmsStatsSample.instance_method(:fms_plain)
+    FastMethodSource.source_for(method)
+    FastMethodSource.source_for(method)
+    stats = FastMethodSource.stats
+
+    assert_equal 1, stats[:files_opened]
+    assert_equal 1, stats[:files_read]
+    assert_equal 0, stats[:files_mapped]
+    assert_equal 1, stats[:file_cache_misses]
+    assert_equal 1, stats[:file_cache_hits]
+  end
+
+  def test_files_opened_without_file_cache
+    FastMethodSource.max_mapped_files = 0
+    method = FmsStatsSample.instance_method(:fms_plain)
+    3.times { FastMethodSource.source_for(method) }
+
+    assert_equal 3, FastMethodSource.stats[:files_opened]
+    assert_equal 3, FastMethodSource.stats[:file_cache_misses]
+  end
+
+  def test_result_cache
+    FastMethodSource.max_cache_bytes = 1 << 20
+    method = FmsStatsSample.instance_method(:fms_plain)
+    3.times { FastMethodSource.source_for(method) }
+
+    assert_equal 1, FastMethodSource.stats[:result_cache_misses]
+    assert_equal 2, FastMethodSource.stats[:result_cache_hits]
+  end
+
+  def test_fast_path_and_parse_attempts
+    plain = FmsStatsSample.instance_method(:fms_plain)
+    guarded = FmsStatsSample.instance_method(:fms_guarded)
+
+    assert_equal "        def fms_guarded; :guarded end if true\n", FastMethodSource.source_for(guarded)
+    FastMethodSource.source_for(plain)
+    FastMethodSource.sources_for([plain, guarded])
+    stats = FastMethodSource.stats
+
+    assert_equal 2, stats[:fast_path_hits]
+    assert_equal 2, stats[:fast_path_fallbacks]
+    assert_equal [0, 1, 2, 3, 4, 8, 16], stats[:parse_attempts].keys
+    assert_equal 4, stats[:parse_attempts].values.sum
+    assert_operator stats[:parse_attempts][0], :>=, 2
+    assert_operator stats[:bytes_scanned], :>, 0
+    assert_operator stats[:lines_walked], :>, 0
+  end
+
+  def test_times
+    FastMethodSource.source_for(FmsStatsSample.instance_method(:fms_guarded))
+    stats = FastMethodSource.stats
+
+    assert_kind_of Float, stats[:scan_time]
+    assert_kind_of Float, stats[:parse_time]
+    assert_operator stats[:scan_time], :>=, 0
+    assert_operator stats[:parse_time], :>=, 0
+  end
+
+  def test_counts_of_all_threads
+    FastMethodSource.max_mapped_files = 0
+    method = FmsStatsSample.instance_method(:fms_plain)
+
+    4.times.map { Thread.new { 5.times { FastMethodSource.source_for(method) } } }.each(&:join)
+    FastMethodSource.source_for(method)
+
+    assert_equal 21, FastMethodSource.stats[:files_opened]
+    assert_equal 21, FastMethodSource.stats[:fast_path_hits]
+  end
+end
@@ -0,0 +1,56 @@
+require_relative '../helper'
+
+class TestFastMethodSourceSyscalls < Minitest::Test
+  def syscalls
+    before = FastMethodSource.syscall_count
+    yield
+    FastMethodSource.syscall_count - before
+  end
+
+  def test_warm_source_lookup
+    method = proc {
+      :warm
+    }
+    FastMethodSource.source_for(method)
+
+    assert_equal 1, syscalls { FastMethodSource.source_for(method) }
+  end
+
+  def test_warm_comment_lookup
+    method = SampleClass.instance_method(:sample_method)
+    FastMethodSource.comment_for(method)
+
+    assert_equal 1, syscalls { FastMethodSource.comment_for(method) }
+  end
+
+  def test_cold_lookup
+    load_source("def fms_syscalls_sample\n  :cold\nend\n")
+
+    # open, fstat, pread and close.
+    assert_equal 4, syscalls { FastMethodSource.source_for(method(:fms_syscalls_sample)) }
+  end
+
+  def test_cold_lookup_of_a_mapped_file
+    source = "def fms_syscalls_mapped\n  :mapped\nend\n"
+    load_source(source + "# padding\n" * (FastMethodSource.map_threshold / 10 + 1))
+    files_mapped = FastMethodSource.stats[:files_mapped]
+
+    # open, fstat, mmap and close.
+    assert_equal 4, syscalls {
+      assert_equal source, FastMethodSource.source_for(method(:fms_syscalls_mapped))
+    }
+    assert_equal files_mapped + 1, FastMethodSource.stats[:files_mapped]
+  end
+
+  def test_parse_is_silent
+    verbose, $VERBOSE = $VERBOSE, true
+
+    method = proc { |unused|
+      x = 1
+    }
+
+    assert_silent { FastMethodSource.source_for(method) }
+  ensure
+    $VERBOSE = verbose
+  end
+end
@@ -0,0 +1,83 @@
+require_relative '../helper'
+require 'fileutils'
+require 'tmpdir'
+
+class TestFastMethodSourceWarm < Minitest::Test
+  def setup
+    @max_mapped_files = FastMethodSource.max_mapped_files
+    @dir = Dir.mktmpdir('fast_method_source')
+    @warmed = File.join(@dir, 'warmed')
+    Dir.mkdir(@warmed)
+    FastMethodSource.reset_stats
+  end
+
+  def teardown
+    FastMethodSource.warm!(mode: :off)
+    FastMethodSource.max_mapped_files = @max_mapped_files
+    FileUtils.remove_entry(@dir)
+  end
+
+  def write_sample(dir, name)
+    path = File.join(dir, "#{name}.rb")
+    File.write(path, "module FmsWarmSample\n  def self.#{name}\n    :#{name}\n  end\nend\n")
+    path
+  end
+
+  def wait_for_warmed(count)
+    deadline = Process.clock_gettime(Process::CLOCK_MONOTONIC) + 5
+    until FastMethodSource.stats[:files_warmed] >= count
+      flunk 'files were not warmed in time' if Process.clock_gettime(Process::CLOCK_MONOTONIC) > deadline
+      sleep 0.01
+    end
+  end
+
+  def test_unknown_mode
+    assert_raises(ArgumentError) { FastMethodSource.warm!(mode: :eager) }
+  end
+
+  def test_loaded_files_are_warmed
+    FastMethodSource.warm!(mode: :background, paths: @warmed)
+    load write_sample(@warmed, 'fms_warm_inside')
+    load write_sample(@dir, 'fms_warm_outside')
+    wait_for_warmed(1)
+    FastMethodSource.reset_stats
+
+    assert_equal "  def self.fms_warm_inside\n    :fms_warm_inside\n  end\n",
+                 FastMethodSource.source_for(FmsWarmSample.method(:fms_warm_inside))
+    assert_equal 0, FastMethodSource.stats[:files_opened]
+    assert_equal 1, FastMethodSource.stats[:file_cache_hits]
+
+    FastMethodSource.source_for(FmsWarmSample.method(:fms_warm_outside))
+    assert_equal 1, FastMethodSource.stats[:files_opened]
+  end
+
+  def test_paths_are_directories
+    sibling = "#{@warmed}_old"
+    Dir.mkdir(sibling)
+    FastMethodSource.warm!(mode: :background, paths: @warmed)
+    load write_sample(sibling, 'fms_warm_sibling')
+    load write_sample(@warmed, 'fms_warm_child')
+    wait_for_warmed(1)
+    sleep 0.05
+
+    assert_equal 1, FastMethodSource.stats[:files_warmed]
+  end
+
+  def test_off
+    FastMethodSource.warm!
+    FastMethodSource.warm!(mode: :off)
+    load write_sample(@warmed, 'fms_warm_off')
+    sleep 0.05
+
+    assert_equal 0, FastMethodSource.stats[:files_warmed]
+  end
+
+  def test_queue_is_bounded_by_the_file_cache
+    FastMethodSource.max_mapped_files = 0
+    FastMethodSource.warm!(mode: :background, paths: @warmed)
+    load write_sample(@warmed, 'fms_warm_dropped')
+
+    assert_equal 1, FastMethodSource.stats[:warm_dropped]
+    assert_equal 0, FastMethodSource.stats[:files_warmed]
+  end
+end